@@ -0,0 +1,508 @@
+/*
+ * Incremental pile backup and restore
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * The block DB and hash index are append-only, so a backup only needs
+ * what was appended since the previous one. A watermark file records the
+ * committed block count and the size and mtime of every image file at
+ * backup time; the next backup emits just the DB and index data past the
+ * watermark plus any image files (and the image catalog) that are new or
+ * changed, and the names of images that have been deleted. Restoring a
+ * base backup followed by each increment in order rebuilds the pile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "backup.h"
+#include "catalog.h"
+
+/* Copy buffer size in blocks */
+#define BACKUP_RUN_BLOCKS 256
+
+struct mark_entry {
+	char *name;
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint32_t mtime_nsec;
+	int changed;		/* New or changed since the old watermark
+				 * (in the old watermark: deleted since) */
+};
+
+struct mark_t {
+	uint64_t blocks;
+	uint32_t count;
+	struct mark_entry *entries;
+};
+
+
+static void bk_write(const void * const restrict data, const size_t len,
+		FILE * const restrict out)
+{
+	if (fwrite(data, 1, len, out) != len) {
+		fprintf(stderr, "Error: short write to backup output\n");
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+
+static void bk_read(void * const restrict data, const size_t len,
+		FILE * const restrict in, const char * const restrict name)
+{
+	if (fread(data, 1, len, in) != len) {
+		fprintf(stderr, "Error: %s is truncated or unreadable\n", name);
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+
+/* Read a length-prefixed image name, rejecting anything with a path */
+static void bk_read_name(char * const restrict name, FILE * const restrict in,
+		const char * const restrict src)
+{
+	uint32_t len;
+
+	bk_read(&len, 4, in, src);
+	if (len == 0 || len >= 256) goto error_name;
+	bk_read(name, len, in, src);
+	name[len] = '\0';
+	if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) goto error_name;
+	return;
+
+error_name:
+	fprintf(stderr, "Error: %s has an invalid image name\n", src);
+	exit(EXIT_FAILURE);
+}
+
+
+/* Committed blocks are those with both data and hash present */
+static uint64_t committed_blocks(const struct files_t * const restrict files)
+{
+	struct stat st;
+	uint64_t blocks = (uint64_t)db_block_count(files);
+
+	if (stat(files->indexfile, &st) != 0) return 0;
+	if ((uint64_t)st.st_size / sizeof(jodyhash_t) < blocks)
+		blocks = (uint64_t)st.st_size / sizeof(jodyhash_t);
+	return blocks;
+}
+
+
+static void load_mark(const char * const restrict path, struct mark_t * const restrict mark)
+{
+	FILE *in;
+	char magic[4], name[256];
+	uint32_t version, i;
+
+	if (!(in = fopen(path, "rb"))) {
+		fprintf(stderr, "Error: cannot open watermark: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	bk_read(magic, 4, in, path);
+	bk_read(&version, 4, in, path);
+	if (memcmp(magic, "IPWM", 4) || version < 1 || version > BACKUP_VERSION) {
+		fprintf(stderr, "Error: %s is not a watermark file\n", path);
+		exit(EXIT_FAILURE);
+	}
+	bk_read(&mark->blocks, 8, in, path);
+	bk_read(&mark->count, 4, in, path);
+	mark->entries = (struct mark_entry *)calloc(mark->count + 1, sizeof(struct mark_entry));
+	if (mark->entries == NULL) goto oom;
+	for (i = 0; i < mark->count; i++) {
+		bk_read_name(name, in, path);
+		if (!(mark->entries[i].name = strdup(name))) goto oom;
+		bk_read(&mark->entries[i].size, 8, in, path);
+		bk_read(&mark->entries[i].mtime_sec, 8, in, path);
+		bk_read(&mark->entries[i].mtime_nsec, 4, in, path);
+	}
+	fclose(in);
+	return;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+static const struct mark_entry *find_mark(const struct mark_t * const restrict mark,
+		const char * const restrict name)
+{
+	uint32_t i;
+
+	for (i = 0; i < mark->count; i++)
+		if (!strcmp(mark->entries[i].name, name)) return &mark->entries[i];
+	return NULL;
+}
+
+
+/* Copy a file into the backup stream */
+static void bk_copy_file(const char * const restrict path, const uint64_t size,
+		FILE * const restrict out, char * const restrict buf)
+{
+	FILE *in;
+	uint64_t remain = size;
+
+	if (!(in = fopen(path, "rb"))) {
+		fprintf(stderr, "Error: cannot open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	while (remain > 0) {
+		size_t n = BACKUP_RUN_BLOCKS * B_SIZE;
+		if (n > remain) n = (size_t)remain;
+		bk_read(buf, n, in, path);
+		bk_write(buf, n, out);
+		remain -= n;
+	}
+	fclose(in);
+	return;
+}
+
+
+/* backup [--since old_mark] new_mark backup_file */
+extern int backup_pile(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct mark_t mark, newmark;
+	const char *since = NULL, *markfile, *outfile;
+	char **list;
+	char *buf, *catpath;
+	struct stat cst;
+	size_t list_count, i;
+	uint64_t end, pos, u64;
+	uint32_t u32, changed = 0, images, images_changed, deleted = 0;
+	FILE *out, *idx, *mk;
+
+	if (argc == 4 && !strcmp(argv[0], "--since")) {
+		since = argv[1];
+		markfile = argv[2];
+		outfile = argv[3];
+	} else if (argc == 2) {
+		markfile = argv[0];
+		outfile = argv[1];
+	} else return 1;
+
+	memset(&mark, 0, sizeof(mark));
+	if (since != NULL) load_mark(since, &mark);
+	end = committed_blocks(files);
+	if (end < mark.blocks) {
+		fprintf(stderr, "Error: pile is shorter than watermark %s\n", since);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!strcmp(outfile, "-")) out = stdout;
+	else if (!(out = fopen(outfile, "wb"))) {
+		fprintf(stderr, "Error: cannot open outfile: %s\n", outfile);
+		exit(EXIT_FAILURE);
+	}
+	if (!(idx = fopen(files->indexfile, "rb"))) {
+		fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	buf = (char *)malloc(BACKUP_RUN_BLOCKS * B_SIZE);
+	if (buf == NULL) goto oom;
+
+	bk_write("IPBK", 4, out);
+	u32 = BACKUP_VERSION; bk_write(&u32, 4, out);
+	u32 = B_SIZE; bk_write(&u32, 4, out);
+	bk_write(&mark.blocks, 8, out);
+	bk_write(&end, 8, out);
+
+	/* Appended DB data, then the matching hash index entries */
+	for (pos = mark.blocks; pos < end; ) {
+		size_t n = BACKUP_RUN_BLOCKS;
+		if (n > end - pos) n = (size_t)(end - pos);
+		read_db_run(buf, (off_t)pos, n, files);
+		bk_write(buf, n * B_SIZE, out);
+		pos += n;
+	}
+	if (fseeko(idx, (off_t)(mark.blocks * sizeof(jodyhash_t)), SEEK_SET) != 0) goto error_index;
+	for (pos = mark.blocks; pos < end; ) {
+		size_t n = (BACKUP_RUN_BLOCKS * B_SIZE) / sizeof(jodyhash_t);
+		if (n > end - pos) n = (size_t)(end - pos);
+		if (fread(buf, sizeof(jodyhash_t), n, idx) != n) goto error_index;
+		bk_write(buf, n * sizeof(jodyhash_t), out);
+		pos += n;
+	}
+	fclose(idx);
+
+	/* Decide which images are new or changed since the old watermark */
+	if (catalog_image_list(files->imgdir, &list, &list_count) != 0) exit(EXIT_FAILURE);
+	newmark.blocks = end;
+	newmark.count = 0;
+	newmark.entries = (struct mark_entry *)calloc(list_count + 1, sizeof(struct mark_entry));
+	if (newmark.entries == NULL) goto oom;
+	for (i = 0; i < list_count; i++) {
+		const char *name = catalog_local_name(files->imgdir, list[i]);
+		const struct mark_entry *old;
+		struct mark_entry *e;
+		struct ipil_t ip;
+		struct stat st;
+		size_t k;
+		int ok = 1;
+
+		/* Streams name images relative to IMGDIR without subdirectories */
+		if (name == NULL) {
+			fprintf(stderr, "Warning: skipping %s (not stored directly in %s)\n",
+					list[i], files->imgdir);
+			continue;
+		}
+		if (strlen(name) >= 256 || stat(list[i], &st) != 0) continue;
+		/* Skip images still being written past the watermark */
+		if (ipil_open(list[i], &ip) != 0) continue;
+		if (ip.depth > 0 && ip.meta_max >= end) ok = 0;
+		for (k = 0; ok && k < ip.count; k++) if (ip.offsets[k] >= end) ok = 0;
+		ipil_close(&ip);
+		if (!ok) {
+			fprintf(stderr, "Warning: skipping %s (references blocks past the watermark)\n", list[i]);
+			continue;
+		}
+		e = &newmark.entries[newmark.count++];
+		e->name = list[i];
+		e->size = (uint64_t)st.st_size;
+		e->mtime_sec = (uint64_t)st.st_mtim.tv_sec;
+		e->mtime_nsec = (uint32_t)st.st_mtim.tv_nsec;
+		old = find_mark(&mark, name);
+		if (old == NULL || old->size != e->size || old->mtime_sec != e->mtime_sec
+				|| old->mtime_nsec != e->mtime_nsec) {
+			e->changed = 1;
+			changed++;
+		}
+	}
+
+	/* The catalog travels like an image file, after the images it names,
+	 * but is not counted as one */
+	images = newmark.count;
+	images_changed = changed;
+	catpath = (char *)malloc(strlen(files->imgdir) + sizeof(CATALOG_FILE) + 1);
+	if (catpath == NULL) goto oom;
+	sprintf(catpath, "%s/%s", files->imgdir, CATALOG_FILE);
+	if (stat(catpath, &cst) == 0) {
+		const struct mark_entry *old = find_mark(&mark, CATALOG_FILE);
+		struct mark_entry *e = &newmark.entries[newmark.count++];
+
+		e->name = catpath;
+		e->size = (uint64_t)cst.st_size;
+		e->mtime_sec = (uint64_t)cst.st_mtim.tv_sec;
+		e->mtime_nsec = (uint32_t)cst.st_mtim.tv_nsec;
+		if (old == NULL || old->size != e->size || old->mtime_sec != e->mtime_sec
+				|| old->mtime_nsec != e->mtime_nsec) {
+			e->changed = 1;
+			changed++;
+		}
+	}
+
+	bk_write(&changed, 4, out);
+	for (i = 0; i < newmark.count; i++) {
+		struct mark_entry *e = &newmark.entries[i];
+		const char *name = ipil_base_name(e->name);
+
+		if (!e->changed) continue;
+		u32 = (uint32_t)strlen(name); bk_write(&u32, 4, out);
+		bk_write(name, u32, out);
+		bk_write(&e->size, 8, out);
+		bk_copy_file(e->name, e->size, out, buf);
+	}
+
+	/* Images in the old watermark that are gone were deleted, either with
+	 * "delete" (the catalog sent above holds the tombstone) or by hand */
+	for (i = 0; i < mark.count; i++) {
+		struct mark_entry *e = &mark.entries[i];
+		char path[PATH_MAX + 300];
+		struct stat st;
+
+		if (!strcmp(e->name, CATALOG_FILE)) continue;
+		snprintf(path, sizeof(path), "%s/%s", files->imgdir, e->name);
+		if (lstat(path, &st) != 0 && errno == ENOENT) {
+			e->changed = 1;
+			deleted++;
+		}
+	}
+	bk_write(&deleted, 4, out);
+	for (i = 0; i < mark.count; i++) {
+		const struct mark_entry *e = &mark.entries[i];
+
+		if (!e->changed) continue;
+		u32 = (uint32_t)strlen(e->name); bk_write(&u32, 4, out);
+		bk_write(e->name, u32, out);
+	}
+	bk_write("KBPI", 4, out);
+	if (fflush(out) != 0) goto error_out;
+	if (out != stdout && (fsync(fileno(out)) != 0 || fclose(out) != 0)) goto error_out;
+
+	/* Only record the new watermark once the backup is safely written */
+	if (!(mk = fopen(markfile, "wb"))) {
+		fprintf(stderr, "Error: cannot open watermark: %s\n", markfile);
+		exit(EXIT_FAILURE);
+	}
+	bk_write("IPWM", 4, mk);
+	u32 = BACKUP_VERSION; bk_write(&u32, 4, mk);
+	bk_write(&newmark.blocks, 8, mk);
+	bk_write(&newmark.count, 4, mk);
+	for (i = 0; i < newmark.count; i++) {
+		const struct mark_entry *e = &newmark.entries[i];
+		const char *name = ipil_base_name(e->name);
+		u32 = (uint32_t)strlen(name); bk_write(&u32, 4, mk);
+		bk_write(name, u32, mk);
+		bk_write(&e->size, 8, mk);
+		bk_write(&e->mtime_sec, 8, mk);
+		bk_write(&e->mtime_nsec, 4, mk);
+	}
+	if (fclose(mk) != 0) goto error_out;
+
+	u64 = end - mark.blocks;
+	fprintf(stderr, "Backup: %ju new blocks (%ju KiB), %" PRIu32 " of %" PRIu32 " images new or changed, %" PRIu32 " deleted\n",
+			(uintmax_t)u64, (uintmax_t)(u64 * (B_SIZE / 1024)), images_changed, images, deleted);
+	for (i = 0; i < mark.count; i++) free(mark.entries[i].name);
+	free(mark.entries);
+	free(newmark.entries);
+	ipil_free_list(list, list_count);
+	free(catpath);
+	free(buf);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_index:
+	fprintf(stderr, "Error: can't read index: %s\n", files->indexfile);
+	exit(EXIT_FAILURE);
+error_out:
+	fprintf(stderr, "Error: short write to backup output\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Apply one backup stream to the pile in IMGDIR */
+static void restore_one(struct files_t * const restrict files,
+		const char * const restrict src, char * const restrict buf)
+{
+	FILE *in, *idx;
+	char magic[4], name[256];
+	char path[PATH_MAX + 300];
+	uint32_t version, bsize, count;
+	uint64_t base, end, have, pos;
+	uint32_t deleted = 0;
+
+	if (!strcmp(src, "-")) in = stdin;
+	else if (!(in = fopen(src, "rb"))) {
+		fprintf(stderr, "Error: cannot open backup: %s\n", src);
+		exit(EXIT_FAILURE);
+	}
+	bk_read(magic, 4, in, src);
+	bk_read(&version, 4, in, src);
+	bk_read(&bsize, 4, in, src);
+	bk_read(&base, 8, in, src);
+	bk_read(&end, 8, in, src);
+	if (memcmp(magic, "IPBK", 4) || version < 1 || version > BACKUP_VERSION
+			|| bsize != B_SIZE || end < base) {
+		fprintf(stderr, "Error: %s is not a usable backup\n", src);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Drop any uncommitted tail, then make sure this increment fits */
+	have = committed_blocks(files);
+	if (have != base) {
+		fprintf(stderr, "Error: %s starts at block %ju but the pile has %ju; apply backups in order\n",
+				src, (uintmax_t)base, (uintmax_t)have);
+		exit(EXIT_FAILURE);
+	}
+	if (!(idx = fopen(files->indexfile, "ab"))) goto error_pile;
+	fflush(files->db);
+	if (ftruncate(fileno(files->db), (off_t)(base * B_SIZE)) != 0) goto error_pile;
+	if (ftruncate(fileno(idx), (off_t)(base * sizeof(jodyhash_t))) != 0) goto error_pile;
+
+	fseeko(files->db, 0, SEEK_END);
+	for (pos = base; pos < end; ) {
+		size_t n = BACKUP_RUN_BLOCKS;
+		if (n > end - pos) n = (size_t)(end - pos);
+		bk_read(buf, n * B_SIZE, in, src);
+		if (fwrite(buf, B_SIZE, n, files->db) != n) goto error_pile;
+		pos += n;
+	}
+	if (fflush(files->db) != 0 || fsync(fileno(files->db)) != 0) goto error_pile;
+
+	for (pos = base; pos < end; ) {
+		size_t n = (BACKUP_RUN_BLOCKS * B_SIZE) / sizeof(jodyhash_t);
+		if (n > end - pos) n = (size_t)(end - pos);
+		bk_read(buf, n * sizeof(jodyhash_t), in, src);
+		if (fwrite(buf, sizeof(jodyhash_t), n, idx) != n) goto error_pile;
+		pos += n;
+	}
+	if (fflush(idx) != 0 || fsync(fileno(idx)) != 0 || fclose(idx) != 0) goto error_pile;
+
+	bk_read(&count, 4, in, src);
+	for (; count > 0; count--) {
+		char tmp[PATH_MAX + 310];
+		uint64_t size;
+		FILE *out;
+
+		bk_read_name(name, in, src);
+		bk_read(&size, 8, in, src);
+		snprintf(path, sizeof(path), "%s/%s", files->imgdir, name);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		if (!(out = fopen(tmp, "wb"))) goto error_pile;
+		while (size > 0) {
+			size_t n = BACKUP_RUN_BLOCKS * B_SIZE;
+			if (n > size) n = (size_t)size;
+			bk_read(buf, n, in, src);
+			if (fwrite(buf, 1, n, out) != n) goto error_pile;
+			size -= n;
+		}
+		if (fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0) goto error_pile;
+		if (rename(tmp, path) != 0) goto error_pile;
+	}
+
+	/* Remove images deleted since the previous backup */
+	if (version >= 2) {
+		bk_read(&count, 4, in, src);
+		for (; count > 0; count--) {
+			bk_read_name(name, in, src);
+			snprintf(path, sizeof(path), "%s/%s", files->imgdir, name);
+			if (unlink(path) != 0 && errno != ENOENT) goto error_pile;
+			deleted++;
+		}
+	}
+	bk_read(magic, 4, in, src);
+	if (memcmp(magic, "KBPI", 4)) {
+		fprintf(stderr, "Error: %s has a bad trailer\n", src);
+		exit(EXIT_FAILURE);
+	}
+	if (in != stdin) fclose(in);
+	fprintf(stderr, "Restored %s: blocks %ju to %ju, %" PRIu32 " images deleted\n",
+			src, (uintmax_t)base, (uintmax_t)end, deleted);
+	return;
+
+error_pile:
+	fprintf(stderr, "Error: cannot write to pile %s: %s\n", files->imgdir, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+
+/* restore-backup base_backup [increment...] */
+extern int restore_backup(struct files_t * const restrict files, int argc, char **argv)
+{
+	char *buf;
+	int i;
+
+	if (argc < 1) return 1;
+	buf = (char *)malloc(BACKUP_RUN_BLOCKS * B_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < argc; i++) restore_one(files, argv[i], buf);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,37 @@
+/* Incremental pile backup headers
+ * See imagepile.c for copyright information */
+
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+/*
+ * Watermark file layout (native byte order)
+ * 'IPWM', version (u32), committed blocks (u64), image count (u32),
+ * then per image: name length (u32), name, size (u64), mtime sec (u64),
+ * mtime nsec (u32)
+ *
+ * Backup stream layout (native byte order)
+ * 'IPBK', version (u32), B_SIZE (u32), base blocks (u64), end blocks (u64),
+ * (end - base) * B_SIZE bytes of DB data,
+ * (end - base) hashes of index data,
+ * image count (u32), then per image: name length (u32), name, size (u64),
+ * file contents; deleted image count (u32), then per deleted image: name
+ * length (u32), name; trailer 'KBPI'
+ * Version 1 streams have no deleted image list.
+ */
+#define BACKUP_VERSION 2
+
+extern int backup_pile(struct files_t * const restrict files, int argc, char **argv);
+extern int restore_backup(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* BACKUP_H */
@@ -0,0 +1,707 @@
+/*
+ * Image catalog
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Image files can live anywhere, so without a catalog the only way to
+ * find all images using a pile is to crawl the filesystem. The catalog
+ * is an append-only log of image additions and deletions kept in IMGDIR.
+ * Loading it replays the log into an array sorted by name, which serves
+ * as the index for lookups and prefix listing. Once the log grows well
+ * past the last snapshot, the sorted live entries are written out as a
+ * new snapshot so later loads only replay the records after it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "catalog.h"
+
+/* Size of the fixed part of a catalog record */
+#define CAT_HDR_SIZE 56
+
+/* Size of the snapshot header */
+#define CAT_SNAP_HDR_SIZE 32
+
+/* Log bytes past the snapshot that trigger a new snapshot */
+#define CAT_SNAP_TAIL (64 * 1024)
+
+/* One replayed log record */
+struct cat_rec {
+	struct catalog_entry e;
+	uint32_t type;
+	size_t seq;
+};
+
+
+/* Turn an image path into its catalog name: relative to IMGDIR for images
+ * inside it, absolute otherwise. Works whether or not the file exists. */
+static int catalog_name(const char * const restrict imgdir,
+		const char * const restrict path, char * const restrict name)
+{
+	char rdir[PATH_MAX], rpath[PATH_MAX], dir[PATH_MAX];
+	const char *base = ipil_base_name(path);
+	size_t len;
+
+	if (!realpath(imgdir, rdir)) return -1;
+	if (base == path) strcpy(dir, ".");
+	else {
+		len = (size_t)(base - path);
+		if (len >= PATH_MAX) return -1;
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+	}
+	if (!realpath(dir, rpath)) return -1;
+	len = strlen(rdir);
+	if (!strncmp(rpath, rdir, len) && (rpath[len] == '/' || rpath[len] == '\0')) {
+		const char *rel = rpath + len;
+		if (*rel == '/') rel++;
+		if (strlen(rel) + strlen(base) + 2 > PATH_MAX) return -1;
+		if (*rel) sprintf(name, "%s/%s", rel, base);
+		else strcpy(name, base);
+	} else {
+		if (strlen(rpath) + strlen(base) + 2 > PATH_MAX) return -1;
+		sprintf(name, "%s/%s", rpath, base);
+	}
+	return 0;
+}
+
+
+/* Encode one record; returns its length including the checksum */
+static char *catalog_encode(const uint32_t type, const char * const restrict name,
+		const char * const restrict parent, const struct catalog_entry * const restrict info,
+		const uint64_t ctime, size_t * const restrict reclen)
+{
+	char *rec;
+	uint32_t *u32;
+	uint64_t *u64;
+	jodyhash_t sum;
+	const size_t nlen = strlen(name), plen = parent ? strlen(parent) : 0;
+	size_t len = CAT_HDR_SIZE + nlen + plen;
+
+	len = (len + 7) & ~(size_t)7;
+	rec = (char *)calloc(1, len + sizeof(jodyhash_t));
+	if (rec == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	u32 = (uint32_t *)rec;
+	u64 = (uint64_t *)rec;
+	memcpy(rec, "IPCR", 4);
+	u32[1] = (uint32_t)(len + sizeof(jodyhash_t));
+	u32[2] = type;
+	u32[3] = (uint32_t)nlen;
+	u32[4] = (uint32_t)plen;
+	if (info != NULL) {
+		u64[3] = info->size;
+		u64[4] = info->blocks;
+		u64[5] = info->digest;
+	}
+	u64[6] = ctime;
+	memcpy(rec + CAT_HDR_SIZE, name, nlen);
+	if (plen) memcpy(rec + CAT_HDR_SIZE + nlen, parent, plen);
+	sum = jody_block_hash((const jodyhash_t *)rec, 0, len);
+	memcpy(rec + len, &sum, sizeof(jodyhash_t));
+	*reclen = len + sizeof(jodyhash_t);
+	return rec;
+}
+
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct cat_rec *x = (const struct cat_rec *)a;
+	const struct cat_rec *y = (const struct cat_rec *)b;
+	const int c = strcmp(x->e.name, y->e.name);
+	if (c) return c;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+
+/* Decode the valid records at the start of buf into a growing array
+ * Returns the number of bytes decoded; decoding stops at damage */
+static size_t catalog_parse(const char * const restrict buf, const size_t size,
+		struct cat_rec ** const restrict recs, size_t * const restrict nrec,
+		size_t * const restrict alloc)
+{
+	size_t pos = 0;
+
+	while (pos + CAT_HDR_SIZE + sizeof(jodyhash_t) <= size) {
+		const char *rec = buf + pos;
+		struct cat_rec *r;
+		uint32_t u32[5];
+		uint64_t u64[4];
+		jodyhash_t sum;
+		size_t len;
+
+		memcpy(u32, rec + 4, sizeof(u32));
+		memcpy(u64, rec + 24, sizeof(u64));
+		len = u32[0];
+		if (memcmp(rec, "IPCR", 4) || len < CAT_HDR_SIZE + sizeof(jodyhash_t)
+				|| pos + len > size || (len & 7)
+				|| CAT_HDR_SIZE + (size_t)u32[2] + u32[3] + sizeof(jodyhash_t) > len) break;
+		memcpy(&sum, rec + len - sizeof(jodyhash_t), sizeof(jodyhash_t));
+		if (sum != jody_block_hash((const jodyhash_t *)(const void *)rec, 0, len - sizeof(jodyhash_t))) break;
+
+		if (*nrec == *alloc) {
+			struct cat_rec *tmp;
+			*alloc = *alloc ? *alloc * 2 : 256;
+			tmp = (struct cat_rec *)realloc(*recs, *alloc * sizeof(struct cat_rec));
+			if (tmp == NULL) goto oom;
+			*recs = tmp;
+		}
+		r = &(*recs)[*nrec];
+		r->type = u32[1];
+		r->seq = *nrec;
+		r->e.name = strndup(rec + CAT_HDR_SIZE, u32[2]);
+		r->e.parent = u32[3] ? strndup(rec + CAT_HDR_SIZE + u32[2], u32[3]) : NULL;
+		if (r->e.name == NULL) goto oom;
+		r->e.size = u64[0];
+		r->e.blocks = u64[1];
+		r->e.digest = u64[2];
+		r->e.ctime = u64[3];
+		(*nrec)++;
+		pos += len;
+	}
+	return pos;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Read a whole file (or its tail from offset) into memory */
+static char *catalog_slurp(const char * const restrict path, const uint64_t offset,
+		size_t * const restrict size)
+{
+	struct stat st;
+	char *buf;
+	FILE *in;
+
+	if (!(in = fopen(path, "rb"))) return NULL;
+	if (fstat(fileno(in), &st) != 0 || (uint64_t)st.st_size < offset
+			|| fseeko(in, (off_t)offset, SEEK_SET) != 0) goto error;
+	*size = (size_t)((uint64_t)st.st_size - offset);
+	buf = (char *)malloc(*size + 1);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fread(buf, 1, *size, in) != *size) {
+		free(buf);
+		goto error;
+	}
+	fclose(in);
+	return buf;
+
+error:
+	fclose(in);
+	errno = EIO;
+	return NULL;
+}
+
+
+/* Log bytes covered by the snapshot, or 0 if there is none */
+static uint64_t catalog_snap_covered(const char * const restrict imgdir)
+{
+	char path[PATH_MAX + 32];
+	char hdr[CAT_SNAP_HDR_SIZE];
+	uint64_t covered;
+	FILE *in;
+
+	snprintf(path, sizeof(path), "%s/%s", imgdir, CATALOG_SNAP_FILE);
+	if (!(in = fopen(path, "rb"))) return 0;
+	if (fread(hdr, CAT_SNAP_HDR_SIZE, 1, in) != 1 || memcmp(hdr, "IPCS", 4)) covered = 0;
+	else memcpy(&covered, hdr + 8, 8);
+	fclose(in);
+	return covered;
+}
+
+
+/* Load the snapshot if it matches the start of the log in logfd
+ * Returns the sorted live entries and sets *covered, or NULL if unusable */
+static struct cat_rec *catalog_snap_load(const char * const restrict imgdir,
+		const int logfd, size_t * const restrict count, size_t * const restrict alloc,
+		uint64_t * const restrict covered)
+{
+	char path[PATH_MAX + 32];
+	struct cat_rec *recs = NULL;
+	struct stat st;
+	char *buf;
+	size_t size, nrec = 0, i;
+	uint64_t u64[3];
+	jodyhash_t sum, logsum;
+
+	*count = 0;
+	*alloc = 0;
+	*covered = 0;
+	snprintf(path, sizeof(path), "%s/%s", imgdir, CATALOG_SNAP_FILE);
+	if ((buf = catalog_slurp(path, 0, &size)) == NULL) return NULL;
+	if (size < CAT_SNAP_HDR_SIZE + sizeof(jodyhash_t) || memcmp(buf, "IPCS", 4)
+			|| (size & 7)) goto unusable;
+	memcpy(&sum, buf + size - sizeof(jodyhash_t), sizeof(jodyhash_t));
+	if (sum != jody_block_hash((const jodyhash_t *)(const void *)buf, 0, size - sizeof(jodyhash_t)))
+		goto unusable;
+	memcpy(u64, buf + 8, sizeof(u64));
+
+	/* The log must still hold the records the snapshot was made from */
+	if (fstat(logfd, &st) != 0 || u64[0] > (uint64_t)st.st_size) goto unusable;
+	if (u64[0] > 0) {
+		if (u64[0] < sizeof(jodyhash_t) || pread(logfd, &logsum, sizeof(jodyhash_t),
+					(off_t)(u64[0] - sizeof(jodyhash_t))) != sizeof(jodyhash_t)
+				|| logsum != (jodyhash_t)u64[1]) goto unusable;
+	}
+
+	size -= CAT_SNAP_HDR_SIZE + sizeof(jodyhash_t);
+	if (catalog_parse(buf + CAT_SNAP_HDR_SIZE, size, &recs, &nrec, alloc) != size
+			|| nrec != u64[2]) goto unusable_recs;
+	free(buf);
+	*count = nrec;
+	*covered = u64[0];
+	return recs;
+
+unusable_recs:
+	for (i = 0; i < nrec; i++) {
+		free(recs[i].e.name);
+		free(recs[i].e.parent);
+	}
+	free(recs);
+	*alloc = 0;
+unusable:
+	free(buf);
+	return NULL;
+}
+
+
+/* Replay the catalog into an array of live images sorted by name
+ * The snapshot supplies the state up to some point in the log, so only
+ * the records after it are decoded and sorted. *logend and *logsum are
+ * set to the end of the last valid record and its checksum. */
+static int catalog_replay(const char * const restrict imgdir,
+		struct catalog_entry ** const restrict entries,
+		size_t * const restrict count, uint64_t * const restrict logend,
+		jodyhash_t * const restrict logsum)
+{
+	char path[PATH_MAX + 32];
+	struct cat_rec *snap, *recs = NULL;
+	struct catalog_entry *live;
+	char *buf;
+	size_t size, pos, nsnap, snap_alloc, nrec = 0, alloc = 0, i, j, n = 0;
+	uint64_t covered;
+	int fd;
+
+	*entries = NULL;
+	*count = 0;
+	*logend = 0;
+	*logsum = 0;
+	snprintf(path, sizeof(path), "%s/%s", imgdir, CATALOG_FILE);
+	if ((fd = open(path, O_RDONLY)) < 0) return (errno == ENOENT) ? 0 : -1;
+	snap = catalog_snap_load(imgdir, fd, &nsnap, &snap_alloc, &covered);
+	close(fd);
+	if ((buf = catalog_slurp(path, covered, &size)) == NULL) goto error_read;
+
+	pos = catalog_parse(buf, size, &recs, &nrec, &alloc);
+	if (pos < size)
+		fprintf(stderr, "Warning: ignoring %ju damaged bytes at end of %s\n",
+				(uintmax_t)(size - pos), path);
+	*logend = covered + pos;
+	if (pos > 0) memcpy(logsum, buf + pos - sizeof(jodyhash_t), sizeof(jodyhash_t));
+	else if (covered > 0) {
+		/* The snapshot ends on the last valid record */
+		if ((fd = open(path, O_RDONLY)) < 0 || pread(fd, logsum, sizeof(jodyhash_t),
+					(off_t)(covered - sizeof(jodyhash_t))) != sizeof(jodyhash_t)) {
+			if (fd >= 0) close(fd);
+			free(buf);
+			goto error_read;
+		}
+		close(fd);
+	}
+	free(buf);
+
+	/* The last record for each name decides whether it is live */
+	qsort(recs, nrec, sizeof(struct cat_rec), cmp_rec);
+	live = (struct catalog_entry *)malloc((nsnap + nrec + 1) * sizeof(struct catalog_entry));
+	if (live == NULL) goto oom;
+	for (i = 0, j = 0; i < nrec || j < nsnap; ) {
+		int c;
+
+		if (i < nrec && (i + 1) < nrec && !strcmp(recs[i].e.name, recs[i + 1].e.name)) {
+			free(recs[i].e.name);
+			free(recs[i].e.parent);
+			i++;
+			continue;
+		}
+		/* Merge the sorted snapshot with the replayed tail; the tail wins */
+		if (i == nrec) c = 1;
+		else if (j == nsnap) c = -1;
+		else c = strcmp(recs[i].e.name, snap[j].e.name);
+		if (c > 0) {
+			live[n++] = snap[j++].e;
+			continue;
+		}
+		if (c == 0) {
+			free(snap[j].e.name);
+			free(snap[j].e.parent);
+			j++;
+		}
+		if (recs[i].type == CATALOG_ADD) live[n++] = recs[i].e;
+		else {
+			free(recs[i].e.name);
+			free(recs[i].e.parent);
+		}
+		i++;
+	}
+	free(recs);
+	free(snap);
+	*entries = live;
+	*count = n;
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_read:
+	fprintf(stderr, "Error: cannot read catalog %s\n", path);
+	return -1;
+}
+
+
+/* Load the live images of a pile, sorted by name
+ * A missing catalog loads as empty; returns -1 only if it can't be read */
+extern int catalog_load(const char * const restrict imgdir,
+		struct catalog_entry ** const restrict entries,
+		size_t * const restrict count)
+{
+	uint64_t logend;
+	jodyhash_t logsum;
+
+	return catalog_replay(imgdir, entries, count, &logend, &logsum);
+}
+
+
+/* Write a snapshot of the live entries, replacing the old one atomically
+ * The snapshot is only a cache; failing to write it is not an error */
+static void catalog_snapshot(const char * const restrict imgdir)
+{
+	char path[PATH_MAX + 32], tmp[PATH_MAX + 64];
+	struct catalog_entry *entries;
+	char hdr[CAT_SNAP_HDR_SIZE];
+	uint64_t u64[3], logend;
+	jodyhash_t sum, logsum;
+	size_t count, i;
+	FILE *out;
+
+	if (catalog_replay(imgdir, &entries, &count, &logend, &logsum) != 0) return;
+	snprintf(path, sizeof(path), "%s/%s", imgdir, CATALOG_SNAP_FILE);
+	snprintf(tmp, sizeof(tmp), "%s.%ju.tmp", path, (uintmax_t)getpid());
+	if (!(out = fopen(tmp, "wb"))) goto error_write;
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "IPCS", 4);
+	u64[0] = logend;
+	u64[1] = (uint64_t)logsum;
+	u64[2] = count;
+	memcpy(hdr + 8, u64, sizeof(u64));
+	if (fwrite(hdr, CAT_SNAP_HDR_SIZE, 1, out) != 1) goto error_close;
+	sum = jody_block_hash((const jodyhash_t *)(const void *)hdr, 0, CAT_SNAP_HDR_SIZE);
+	for (i = 0; i < count; i++) {
+		size_t len;
+		char *rec = catalog_encode(CATALOG_ADD, entries[i].name, entries[i].parent,
+				&entries[i], entries[i].ctime, &len);
+		sum = jody_block_hash((const jodyhash_t *)(const void *)rec, sum, len);
+		if (fwrite(rec, len, 1, out) != 1) {
+			free(rec);
+			goto error_close;
+		}
+		free(rec);
+	}
+	if (fwrite(&sum, sizeof(sum), 1, out) != 1 || fflush(out) != 0
+			|| fsync(fileno(out)) != 0) goto error_close;
+	if (fclose(out) != 0 || rename(tmp, path) != 0) goto error_unlink;
+	catalog_free(entries, count);
+	return;
+
+error_close:
+	fclose(out);
+error_unlink:
+	unlink(tmp);
+error_write:
+	fprintf(stderr, "Warning: cannot write catalog snapshot %s\n", path);
+	catalog_free(entries, count);
+	return;
+}
+
+
+/* Append one record with a single write() and sync it */
+static int catalog_append(const char * const restrict imgdir, const uint32_t type,
+		const char * const restrict name, const char * const restrict parent,
+		const struct catalog_entry * const restrict info)
+{
+	char path[PATH_MAX + 32];
+	struct stat st;
+	char *rec;
+	size_t len;
+	uint64_t covered;
+	int fd;
+
+	rec = catalog_encode(type, name, parent, info, (uint64_t)time(NULL), &len);
+	snprintf(path, sizeof(path), "%s/%s", imgdir, CATALOG_FILE);
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) goto error_write;
+	if (write(fd, rec, len) != (ssize_t)len) goto error_write;
+	if (fsync(fd) != 0) goto error_write;
+	if (fstat(fd, &st) != 0) st.st_size = 0;
+	close(fd);
+	free(rec);
+
+	/* Fold a long tail into a new snapshot so loads stay cheap; a
+	 * snapshot past the end of the log belongs to some other log */
+	covered = catalog_snap_covered(imgdir);
+	if (covered > (uint64_t)st.st_size) covered = 0;
+	if ((uint64_t)st.st_size > covered + CAT_SNAP_TAIL) catalog_snapshot(imgdir);
+	return 0;
+
+error_write:
+	fprintf(stderr, "Error: cannot update catalog %s: %s\n", path, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+
+/* Record a new image in the catalog of the pile in imgdir */
+extern int catalog_add(const char * const restrict imgdir,
+		const char * const restrict path,
+		const struct catalog_entry * const restrict info,
+		const char * const restrict parent)
+{
+	char name[PATH_MAX], pname[PATH_MAX];
+	const char *p = NULL;
+
+	if (catalog_name(imgdir, path, name) != 0) {
+		fprintf(stderr, "Warning: cannot resolve %s; not cataloged\n", path);
+		return -1;
+	}
+	if (parent != NULL && catalog_name(imgdir, parent, pname) == 0) p = pname;
+	return catalog_append(imgdir, CATALOG_ADD, name, p, info);
+}
+
+
+/* Record the deletion of an image */
+extern int catalog_delete(const char * const restrict imgdir,
+		const char * const restrict path)
+{
+	char name[PATH_MAX];
+
+	if (catalog_name(imgdir, path, name) != 0) return -1;
+	return catalog_append(imgdir, CATALOG_DELETE, name, NULL, NULL);
+}
+
+
+/* Binary search for the first entry whose name is >= key */
+static size_t catalog_lower_bound(const struct catalog_entry * const restrict entries,
+		const size_t count, const char * const restrict key)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if (strcmp(entries[mid].name, key) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+/* Look up the catalog entry for an image path */
+extern const struct catalog_entry *catalog_find(const struct catalog_entry * const restrict entries,
+		const size_t count, const char * const restrict imgdir,
+		const char * const restrict path)
+{
+	char name[PATH_MAX];
+	size_t i;
+
+	if (catalog_name(imgdir, path, name) != 0) return NULL;
+	i = catalog_lower_bound(entries, count, name);
+	if (i < count && !strcmp(entries[i].name, name)) return &entries[i];
+	return NULL;
+}
+
+
+extern void catalog_free(struct catalog_entry * const restrict entries, const size_t count)
+{
+	size_t i;
+
+	if (entries == NULL) return;
+	for (i = 0; i < count; i++) {
+		free(entries[i].name);
+		free(entries[i].parent);
+	}
+	free(entries);
+	return;
+}
+
+
+/* Full paths of all images in a pile: from the catalog if there is one,
+ * otherwise by scanning IMGDIR. Free with ipil_free_list(). */
+extern int catalog_image_list(const char * const restrict imgdir,
+		char *** const restrict list, size_t * const restrict count)
+{
+	struct catalog_entry *entries;
+	char path[PATH_MAX + 32];
+	struct stat st;
+	size_t n, i;
+
+	snprintf(path, sizeof(path), "%s/%s", imgdir, CATALOG_FILE);
+	if (stat(path, &st) != 0) return ipil_scan_dir(imgdir, list, count);
+	if (catalog_load(imgdir, &entries, &n) != 0) return -1;
+	*list = (char **)malloc((n + 1) * sizeof(char *));
+	if (*list == NULL) goto oom;
+	for (i = 0; i < n; i++) {
+		const char *name = entries[i].name;
+		char *p = (char *)malloc(strlen(imgdir) + strlen(name) + 2);
+		if (p == NULL) goto oom;
+		if (*name == '/') strcpy(p, name);
+		else sprintf(p, "%s/%s", imgdir, name);
+		(*list)[i] = p;
+	}
+	*count = n;
+	catalog_free(entries, n);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Name of a catalog_image_list() path stored directly in IMGDIR, or NULL
+ * for images in a subdirectory or elsewhere */
+extern const char *catalog_local_name(const char * const restrict imgdir,
+		const char * const restrict path)
+{
+	const size_t len = strlen(imgdir);
+	const char *name = path + len;
+
+	if (strncmp(path, imgdir, len) != 0 || *name != '/') return NULL;
+	while (*name == '/') name++;
+	if (*name == '\0' || strchr(name, '/') != NULL) return NULL;
+	return name;
+}
+
+
+/* list [name_prefix] */
+extern int catalog_list(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct catalog_entry *entries;
+	const char *prefix = "";
+	size_t count, i, plen, shown = 0;
+
+	if (argc > 1) return 1;
+	if (argc == 1) prefix = argv[0];
+	plen = strlen(prefix);
+	if (catalog_load(files->imgdir, &entries, &count) != 0) exit(EXIT_FAILURE);
+
+	printf("%-40s %14s %10s %-16s %-19s %s\n", "NAME", "SIZE", "BLOCKS", "DIGEST", "CREATED", "PARENT");
+	for (i = catalog_lower_bound(entries, count, prefix); i < count; i++) {
+		const struct catalog_entry *e = &entries[i];
+		char stamp[32];
+		time_t t = (time_t)e->ctime;
+
+		if (strncmp(e->name, prefix, plen)) break;
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%-40s %14ju %10ju %016jx %-19s %s\n", e->name, (uintmax_t)e->size,
+				(uintmax_t)e->blocks, (uintmax_t)e->digest, stamp,
+				e->parent ? e->parent : "-");
+		shown++;
+	}
+	fprintf(stderr, "%ju of %ju images listed\n", (uintmax_t)shown, (uintmax_t)count);
+	catalog_free(entries, count);
+	return 0;
+}
+
+
+/* Check that a file starts with an image file signature */
+static int catalog_is_image(const char * const restrict path)
+{
+	char magic[4];
+	FILE *fp;
+	int ok;
+
+	if (!(fp = fopen(path, "rb"))) return 0;
+	ok = (fread(magic, 4, 1, fp) == 1
+			&& (!memcmp(magic, "IPIL", 4) || !memcmp(magic, "IPIT", 4)));
+	fclose(fp);
+	return ok;
+}
+
+
+/* delete image_file...
+ * Only image files are deleted, and only if the catalog knows them or
+ * they live inside IMGDIR; every path is checked before anything is
+ * removed so a bad argument never leaves a partial deletion behind. */
+extern int catalog_delete_verb(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct catalog_entry *entries;
+	struct stat st;
+	char name[PATH_MAX];
+	size_t count;
+	int i;
+
+	if (argc < 1) return 1;
+	if (catalog_load(files->imgdir, &entries, &count) != 0) exit(EXIT_FAILURE);
+	for (i = 0; i < argc; i++) {
+		const int known = (catalog_find(entries, count, files->imgdir, argv[i]) != NULL);
+
+		if (catalog_name(files->imgdir, argv[i], name) != 0) {
+			fprintf(stderr, "Error: cannot resolve %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		if (lstat(argv[i], &st) != 0) {
+			/* A cataloged image that is already gone only loses its entry */
+			if (errno == ENOENT && known) continue;
+			fprintf(stderr, "Error: cannot delete %s: %s\n", argv[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (!S_ISREG(st.st_mode) || !catalog_is_image(argv[i])) {
+			fprintf(stderr, "Error: %s is not an image file; not deleting\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		if (!known && *name == '/') {
+			fprintf(stderr, "Error: %s is outside %s and not in its catalog; not deleting\n",
+					argv[i], files->imgdir);
+			exit(EXIT_FAILURE);
+		}
+	}
+	catalog_free(entries, count);
+
+	for (i = 0; i < argc; i++) {
+		/* Log the deletion first so a crash never leaves a dangling entry */
+		if (catalog_delete(files->imgdir, argv[i]) != 0) {
+			fprintf(stderr, "Error: cannot resolve %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		if (unlink(argv[i]) != 0 && errno != ENOENT) {
+			fprintf(stderr, "Error: cannot delete %s: %s\n", argv[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		/* The Merkle sidecar describes this image only */
+		snprintf(name, PATH_MAX, "%s.merkle", argv[i]);
+		if (unlink(name) != 0 && errno != ENOENT) {
+			fprintf(stderr, "Error: cannot delete %s: %s\n", name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "Deleted image %s\n", argv[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,82 @@
+/* Image catalog headers
+ * See imagepile.c for copyright information */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "imagepile.h"
+
+/*
+ * The catalog is an append-only log in IMGDIR. Each record is written
+ * with a single write() and carries a checksum, so a torn record at the
+ * end (crash during an update) is detected and ignored.
+ * Record layout (native byte order)
+ * 0-3:   'IPCR' signature
+ * 4-7:   Total record length including checksum
+ * 8-11:  Record type (CATALOG_ADD or CATALOG_DELETE)
+ * 12-15: Name length
+ * 16-19: Parent name length
+ * 20-23: Reserved (zero)
+ * 24-31: Image size in bytes
+ * 32-39: Image size in blocks
+ * 40-47: Image data digest (0 if unknown)
+ * 48-55: Creation time (seconds since the epoch)
+ * 56-:   Name, parent name, zero padding to 8 bytes, 64-bit checksum
+ * Names are relative to IMGDIR for images inside it, absolute otherwise.
+ */
+#define CATALOG_FILE "imagepile.catalog"
+
+/*
+ * The snapshot caches the replayed log so loading only has to replay the
+ * records appended after it. It can be deleted at any time.
+ * 0-3:   'IPCS' signature
+ * 4-7:   Reserved (zero)
+ * 8-15:  Log bytes covered by the snapshot
+ * 16-23: Checksum of the last covered log record
+ * 24-31: Number of live entries
+ * 32-:   One CATALOG_ADD record per live entry in name order, then a
+ *        64-bit checksum of everything before it
+ */
+#define CATALOG_SNAP_FILE "imagepile.catalog.snap"
+#define CATALOG_ADD 1
+#define CATALOG_DELETE 2
+
+struct catalog_entry {
+	char *name;
+	char *parent;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t digest;
+	uint64_t ctime;
+};
+
+extern int catalog_add(const char * const restrict imgdir,
+		const char * const restrict path,
+		const struct catalog_entry * const restrict info,
+		const char * const restrict parent);
+extern int catalog_delete(const char * const restrict imgdir,
+		const char * const restrict path);
+extern int catalog_load(const char * const restrict imgdir,
+		struct catalog_entry ** const restrict entries,
+		size_t * const restrict count);
+extern const struct catalog_entry *catalog_find(const struct catalog_entry * const restrict entries,
+		const size_t count, const char * const restrict imgdir,
+		const char * const restrict path);
+extern void catalog_free(struct catalog_entry * const restrict entries, const size_t count);
+extern int catalog_image_list(const char * const restrict imgdir,
+		char *** const restrict list, size_t * const restrict count);
+extern const char *catalog_local_name(const char * const restrict imgdir,
+		const char * const restrict path);
+extern int catalog_list(struct files_t * const restrict files, int argc, char **argv);
+extern int catalog_delete_verb(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CATALOG_H */
@@ -0,0 +1,76 @@
+/*
+ * Tree image conversion
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * A flat image file carries one 32-bit offset per data block, so nightly
+ * images of the same machine repeat almost all of their metadata. This
+ * rewrites image files as trees whose offset chunks are stored in the
+ * pile and deduplicated like data; only the top level of the tree stays
+ * in the image file. --flat converts tree images back to flat files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "compact.h"
+#include "merkle.h"
+
+/* compact [--flat] image_file... */
+extern int compact_images(struct files_t * const restrict files, int argc, char **argv)
+{
+	uint64_t before = 0, after = 0;
+	off_t db_before;
+	int flat = 0, i;
+
+	if (argc > 0 && !strcmp(argv[0], "--flat")) {
+		flat = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 1) return 1;
+
+	if (!flat) load_hash_index(files);
+	db_before = db_block_count(files);
+	for (i = 0; i < argc; i++) {
+		struct merkle_t mt;
+		struct ipil_t ip;
+		struct stat st;
+		int had_tree;
+
+		if (stat(argv[i], &st) != 0 || ipil_open(argv[i], &ip) != 0) {
+			fprintf(stderr, "Error: cannot open image file: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		before += (uint64_t)st.st_size;
+		/* The offsets don't change, so a current Merkle tree stays valid */
+		had_tree = (merkle_load(argv[i], &mt) == 0);
+		if (flat) ipil_write(argv[i], ip.start_offset, ip.end_size, ip.offsets, ip.count);
+		else ipil_write_tree(argv[i], ip.start_offset, ip.end_size, ip.offsets, ip.count, files);
+		ipil_close(&ip);
+		if (had_tree) {
+			merkle_write(argv[i], &mt);
+			merkle_free(&mt);
+		}
+		if (stat(argv[i], &st) != 0) {
+			fprintf(stderr, "Error: cannot stat %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		after += (uint64_t)st.st_size;
+		fprintf(stderr, "%s %s\n", flat ? "Flattened" : "Compacted", argv[i]);
+	}
+	if (!flat) fclose(files->hashindex);
+
+	fprintf(stderr, "Stats: image files %ju -> %ju bytes, %jd new chunk blocks (%jd KiB), %ju hash failures\n",
+			(uintmax_t)before, (uintmax_t)after,
+			(intmax_t)(db_block_count(files) - db_before),
+			(intmax_t)((db_block_count(files) - db_before) * (B_SIZE / 1024)),
+			(uintmax_t)stats_hash_failures);
+	return 0;
+}
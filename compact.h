@@ -0,0 +1,19 @@
+/* Tree image conversion headers
+ * See imagepile.c for copyright information */
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int compact_images(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* COMPACT_H */
@@ -0,0 +1,265 @@
+/*
+ * Metadata-only image composition
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * An image is only a list of DB offsets, so new images can be made from
+ * existing ones without moving block data. "clone" copies (or reflinks)
+ * an image file. "splice" builds a new image from a base image with a
+ * byte range replaced by a range of another image: blocks that line up
+ * exactly are taken over by offset, and only blocks cut by the edges of
+ * the range (or all of them, if the two ranges sit at different offsets
+ * within their blocks) are rebuilt and deduplicated into the pile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>
+#endif
+#include "imagepile.h"
+#include "ipil.h"
+#include "catalog.h"
+#include "merkle.h"
+#include "range.h"
+#include "partition.h"
+#include "compose.h"
+
+
+/* Copy an image file, sharing its extents when the filesystem can */
+static int copy_image_file(const char * const restrict src, const char * const restrict dst,
+		int * const restrict reflinked)
+{
+	char buf[65536];
+	int in, out;
+	ssize_t r;
+
+	*reflinked = 0;
+	if ((in = open(src, O_RDONLY)) < 0) return -1;
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+		close(in);
+		return -1;
+	}
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) *reflinked = 1;
+#endif
+	while (!*reflinked && (r = read(in, buf, sizeof(buf))) != 0) {
+		ssize_t w = 0;
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			goto error;
+		}
+		while (w < r) {
+			const ssize_t n = write(out, buf + w, (size_t)(r - w));
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				goto error;
+			}
+			w += n;
+		}
+	}
+	close(in);
+	if (fsync(out) != 0 || close(out) != 0) {
+		unlink(dst);
+		return -1;
+	}
+	return 0;
+
+error:
+	close(in);
+	close(out);
+	unlink(dst);
+	return -1;
+}
+
+
+/* clone source_image new_image */
+extern int clone_image(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct catalog_entry *catalog, info;
+	const struct catalog_entry *src;
+	struct merkle_t mt;
+	struct ipil_t ip;
+	size_t catalog_count;
+	int reflinked;
+
+	if (argc != 2) return 1;
+	if (ipil_open(argv[0], &ip) != 0) exit(EXIT_FAILURE);
+	if (copy_image_file(argv[0], argv[1], &reflinked) != 0) {
+		fprintf(stderr, "Error: cannot clone %s to %s: %s\n", argv[0], argv[1], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* Same offsets, so a current Merkle tree applies to the clone too */
+	if (merkle_load(argv[0], &mt) == 0) {
+		merkle_write(argv[1], &mt);
+		merkle_free(&mt);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.size = ipil_image_size(&ip);
+	info.blocks = ip.count;
+	catalog_load(files->imgdir, &catalog, &catalog_count);
+	src = catalog_find(catalog, catalog_count, files->imgdir, argv[0]);
+	if (src != NULL) info.digest = src->digest;
+	catalog_add(files->imgdir, argv[1], &info, argv[0]);
+	catalog_free(catalog, catalog_count);
+	fprintf(stderr, "Cloned %s to %s (%ju blocks, %s)\n", argv[0], argv[1],
+			(uintmax_t)ip.count, reflinked ? "reflinked" : "copied");
+	ipil_close(&ip);
+	return 0;
+}
+
+
+static uint64_t compose_block(const struct ipil_t * const restrict ip, const uint64_t pos)
+{
+	if (pos < (uint64_t)(B_SIZE - ip->start_offset)) return 0;
+	return (pos + ip->start_offset) / B_SIZE;
+}
+
+
+static const struct partition *find_partition(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip, const char * const restrict path,
+		struct partition * const restrict parts, const unsigned int number)
+{
+	const char *scheme;
+	unsigned int count, i;
+
+	if (partition_table(files, ip, parts, &count, &scheme) != 0) {
+		fprintf(stderr, "Error: no readable partition table in %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < count; i++) if (parts[i].number == number) return &parts[i];
+	fprintf(stderr, "Error: %s has no partition %u\n", path, number);
+	exit(EXIT_FAILURE);
+}
+
+
+/* splice base_image new_image dst_offset src_image src_offset length
+ * splice base_image new_image --partition N src_image */
+extern int splice_image(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct partition dparts[PART_MAX], sparts[PART_MAX];
+	struct catalog_entry info;
+	struct ipil_t base, src;
+	const char *srcpath;
+	uint32_t *offsets;
+	uint64_t dpos, spos, len, k, first, last;
+	uint64_t shared = 0, rebuilt = 0;
+	off_t db_before;
+	int have_index = 0;
+
+	if (argc == 5 && !strcmp(argv[2], "--partition")) {
+		const struct partition *dp, *sp;
+		char *end;
+		const unsigned long n = strtoul(argv[3], &end, 10);
+
+		if (*end != '\0' || n == 0 || n > PART_MAX * 4) return 1;
+		srcpath = argv[4];
+		if (ipil_open(argv[0], &base) != 0 || ipil_open(srcpath, &src) != 0) exit(EXIT_FAILURE);
+		dp = find_partition(files, &base, argv[0], dparts, (unsigned int)n);
+		sp = find_partition(files, &src, srcpath, sparts, (unsigned int)n);
+		if (dp->size != sp->size) {
+			fprintf(stderr, "Error: partition %lu is %ju bytes in %s but %ju bytes in %s\n",
+					n, (uintmax_t)dp->size, argv[0], (uintmax_t)sp->size, srcpath);
+			exit(EXIT_FAILURE);
+		}
+		dpos = dp->start;
+		spos = sp->start;
+		len = dp->size;
+	} else if (argc == 6) {
+		srcpath = argv[3];
+		if (parse_size(argv[2], &dpos) != 0 || parse_size(argv[4], &spos) != 0
+				|| parse_size(argv[5], &len) != 0) return 1;
+		if (ipil_open(argv[0], &base) != 0 || ipil_open(srcpath, &src) != 0) exit(EXIT_FAILURE);
+	} else return 1;
+
+	if (len == 0 || dpos > ipil_image_size(&base) || len > ipil_image_size(&base) - dpos
+			|| spos > ipil_image_size(&src) || len > ipil_image_size(&src) - spos) {
+		fprintf(stderr, "Error: splice range does not fit inside both images\n");
+		exit(EXIT_FAILURE);
+	}
+
+	offsets = (uint32_t *)malloc(base.count * sizeof(uint32_t));
+	if (offsets == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(offsets, base.offsets, base.count * sizeof(uint32_t));
+	db_before = db_block_count(files);
+
+	first = compose_block(&base, dpos);
+	last = compose_block(&base, dpos + len - 1);
+	for (k = first; k <= last; k++) {
+		const uint64_t bpos = ipil_block_pos(&base, k);
+		const uint32_t blen = ipil_block_len(&base, k);
+		uint64_t from, to;
+		char blk[B_SIZE];
+
+		/* A block wholly inside the range that matches one source block
+		 * byte for byte is taken over by offset alone */
+		if (bpos >= dpos && bpos + blen <= dpos + len) {
+			const uint64_t s = spos + (bpos - dpos);
+			const uint64_t j = compose_block(&src, s);
+			if (ipil_block_pos(&src, j) == s && ipil_block_len(&src, j) == blen) {
+				offsets[k] = src.offsets[j];
+				shared++;
+				continue;
+			}
+		}
+
+		/* Otherwise merge the source bytes into the base block */
+		from = bpos < dpos ? dpos : bpos;
+		to = bpos + blen > dpos + len ? dpos + len : bpos + blen;
+		memset(blk, 0, B_SIZE);
+		if (image_read_range(files, &base, blk, bpos, blen) != (ssize_t)blen
+				|| image_read_range(files, &src, blk + (from - bpos), spos + (from - dpos),
+					(size_t)(to - from)) != (ssize_t)(to - from)) {
+			fprintf(stderr, "Error reading %s\n", files->dbfile);
+			exit(EXIT_FAILURE);
+		}
+		if (!have_index) {
+			load_hash_index(files);
+			have_index = 1;
+		}
+		offsets[k] = get_block_offset(blk, files);
+		rebuilt++;
+	}
+
+	if (base.depth > 0) {
+		if (!have_index) {
+			load_hash_index(files);
+			have_index = 1;
+		}
+		ipil_write_tree(argv[1], base.start_offset, base.end_size, offsets, base.count, files);
+	} else {
+		if (have_index && (fflush(files->db) != 0 || fflush(files->hashindex) != 0
+				|| fsync(fileno(files->db)) != 0 || fsync(fileno(files->hashindex)) != 0)) {
+			fprintf(stderr, "Error writing %s\n", files->dbfile);
+			exit(EXIT_FAILURE);
+		}
+		ipil_write(argv[1], base.start_offset, base.end_size, offsets, base.count);
+	}
+	memset(&info, 0, sizeof(info));
+	info.size = ipil_image_size(&base);
+	info.blocks = base.count;
+	catalog_add(files->imgdir, argv[1], &info, argv[0]);
+
+	if (rebuilt > 2) fprintf(stderr, "Warning: the ranges sit at different offsets within their blocks, so most blocks had to be rebuilt\n");
+	fprintf(stderr, "Stats: %ju bytes spliced, %ju blocks shared by offset, %ju rebuilt, %jd new in DB\n",
+			(uintmax_t)len, (uintmax_t)shared, (uintmax_t)rebuilt,
+			(intmax_t)(db_block_count(files) - db_before));
+	if (have_index) fclose(files->hashindex);
+	free(offsets);
+	ipil_close(&base);
+	ipil_close(&src);
+	return 0;
+}
@@ -0,0 +1,20 @@
+/* Metadata-only image composition headers
+ * See imagepile.c for copyright information */
+
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int clone_image(struct files_t * const restrict files, int argc, char **argv);
+extern int splice_image(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* COMPOSE_H */
@@ -0,0 +1,751 @@
+/*
+ * Compressed input streams
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Lets "add" take .gz, .xz and .zst images directly. The input format is
+ * detected from its magic number; a feeder thread decodes the file and
+ * writes the result into a pipe that input_image() reads like any other
+ * input file, so decompression overlaps hashing and deduplication.
+ *
+ * Streams made of independently sized pieces are decoded in parallel:
+ * BGZF-style gzip (members that carry their compressed size in a "BC"
+ * extra field, as written by bgzip) and zstd files with several frames
+ * (pzstd, zstd --rsyncable chunks concatenated, seekable zstd). Whole
+ * members/frames are batched into jobs, decoded by worker threads and
+ * written out in order. Anything else (an ordinary single-member gzip,
+ * one huge zstd frame) is decoded as a stream; xz uses liblzma's own
+ * multi-threaded decoder, which splits on xz blocks.
+ *
+ * Compressed bytes consumed are tracked so progress can be shown as a
+ * fraction of the compressed file size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+ #include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+ #include <zstd.h>
+#endif
+#include "decomp.h"
+
+#define FMT_NONE 0
+#define FMT_GZIP 1
+#define FMT_XZ   2
+#define FMT_ZSTD 3
+
+#define JOB_FREE  0
+#define JOB_READY 1
+#define JOB_BUSY  2
+#define JOB_DONE  3
+
+/* Compressed bytes batched into one parallel job */
+#define DECOMP_JOB_IN (1024 * 1024)
+
+/* Largest zstd frame decoded as a single job; bigger ones are streamed */
+#define DECOMP_MAX_FRAME (64 * 1024 * 1024)
+
+/* Jobs in flight per worker thread */
+#define DECOMP_JOBS_PER_THREAD 2
+
+#define DECOMP_MAX_THREADS 64
+#define DECOMP_MAX_JOBS (DECOMP_MAX_THREADS * DECOMP_JOBS_PER_THREAD)
+
+/* Streaming output buffer */
+#define DECOMP_OUT (256 * 1024)
+
+/* Requested pipe capacity (Linux) */
+#define DECOMP_PIPE_SIZE (1024 * 1024)
+
+struct decomp_job {
+	unsigned char *in, *out;
+	size_t in_len, in_alloc, out_len, out_alloc;
+	uint64_t in_end;	/* Compressed position after this job */
+	int state;
+};
+
+static struct {
+	FILE *file;		/* Read end handed to the caller */
+	int fd;			/* Compressed input */
+	int pipefd;		/* Write end of the pipe */
+	int format;
+	unsigned int threads;
+	pthread_t feeder;
+
+	/* Compressed input buffer with lookahead for splitting */
+	unsigned char *buf;
+	size_t pos, len, alloc;
+	uint64_t base;		/* File offset of buf[0] */
+	int eof;
+
+	/* Parallel decoding */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct decomp_job jobs[DECOMP_MAX_JOBS];
+	unsigned int njobs, head, tail;
+	int stop, fallback;
+
+	uint64_t in_total;
+	uint64_t in_done;	/* Read with __atomic builtins */
+} ds;
+
+static const char * const fmt_names[] = { "raw", "gzip", "xz", "zstd" };
+
+
+static void decomp_oom(void)
+{
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+static void set_done(const uint64_t pos)
+{
+	__atomic_store_n(&ds.in_done, pos, __ATOMIC_RELAXED);
+}
+
+
+/* Make at least want bytes of compressed input available at ds.buf + ds.pos
+ * Returns the number available, which is less than want only at the end */
+static size_t in_fill(const size_t want)
+{
+	if (ds.len - ds.pos >= want || ds.eof) return ds.len - ds.pos;
+	if (ds.pos > 0) {
+		memmove(ds.buf, ds.buf + ds.pos, ds.len - ds.pos);
+		ds.len -= ds.pos;
+		ds.base += ds.pos;
+		ds.pos = 0;
+	}
+	if (want > ds.alloc) {
+		size_t n = ds.alloc ? ds.alloc : DECOMP_JOB_IN;
+		unsigned char *p;
+		while (n < want) n *= 2;
+		p = (unsigned char *)realloc(ds.buf, n);
+		if (p == NULL) decomp_oom();
+		ds.buf = p;
+		ds.alloc = n;
+	}
+	while (ds.len < want && !ds.eof) {
+		const ssize_t r = read(ds.fd, ds.buf + ds.len, ds.alloc - ds.len);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "\nError: cannot read compressed input: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (r == 0) ds.eof = 1;
+		ds.len += (size_t)r;
+	}
+	return ds.len - ds.pos;
+}
+
+
+#if defined HAVE_ZLIB || defined HAVE_LZMA || defined HAVE_ZSTD
+static void in_consume(const size_t n)
+{
+	ds.pos += n;
+	set_done(ds.base + ds.pos);
+}
+#endif
+
+
+static int write_out(const unsigned char * const restrict data, const size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t r = write(ds.pipefd, data + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)r;
+	}
+	return 0;
+}
+
+
+static void reserve(unsigned char ** const restrict p, size_t * const restrict alloc,
+		const size_t need)
+{
+	size_t n = *alloc ? *alloc : 65536;
+	unsigned char *q;
+
+	if (need <= *alloc) return;
+	while (n < need) n *= 2;
+	q = (unsigned char *)realloc(*p, n);
+	if (q == NULL) decomp_oom();
+	*p = q;
+	*alloc = n;
+}
+
+
+static uint32_t get_le32(const unsigned char * const restrict p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+#if defined HAVE_ZLIB || defined HAVE_LZMA || defined HAVE_ZSTD
+static void decomp_fail(const char * const restrict what)
+{
+	fprintf(stderr, "\nError: corrupt %s input (%s)\n", fmt_names[ds.format], what);
+	exit(EXIT_FAILURE);
+}
+#endif
+
+
+/* Streaming decoders */
+
+#ifdef HAVE_ZLIB
+static void stream_gzip(void)
+{
+	unsigned char *out = (unsigned char *)malloc(DECOMP_OUT);
+	z_stream zs;
+	int ret = Z_OK;
+
+	if (out == NULL) decomp_oom();
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15 + 16) != Z_OK) decomp_oom();
+	while (1) {
+		const size_t avail = in_fill(1);
+		size_t used;
+
+		if (avail == 0) break;
+		zs.next_in = ds.buf + ds.pos;
+		zs.avail_in = (uInt)(avail > UINT_MAX ? UINT_MAX : avail);
+		zs.next_out = out;
+		zs.avail_out = DECOMP_OUT;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		used = (size_t)(zs.next_in - (ds.buf + ds.pos));
+		in_consume(used);
+		if (write_out(out, DECOMP_OUT - zs.avail_out) != 0) break;
+		if (ret == Z_STREAM_END) {
+			/* Another member may follow; anything else is trailing junk */
+			const size_t left = in_fill(2);
+			if (left == 0) break;
+			if (left < 2 || ds.buf[ds.pos] != 0x1f || ds.buf[ds.pos + 1] != 0x8b) {
+				fprintf(stderr, "\nWarning: ignoring trailing data after gzip stream\n");
+				break;
+			}
+			inflateReset(&zs);
+			continue;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) decomp_fail(zs.msg ? zs.msg : "inflate failed");
+	}
+	if (ret != Z_STREAM_END) decomp_fail("truncated");
+	inflateEnd(&zs);
+	free(out);
+}
+#endif
+
+
+#ifdef HAVE_LZMA
+static void stream_xz(void)
+{
+	unsigned char *out = (unsigned char *)malloc(DECOMP_OUT);
+	lzma_stream ls = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_ret ret;
+
+	if (out == NULL) decomp_oom();
+#if LZMA_VERSION >= 50040002
+	{
+		lzma_mt mt;
+		memset(&mt, 0, sizeof(mt));
+		mt.flags = LZMA_CONCATENATED;
+		mt.threads = ds.threads;
+		mt.memlimit_threading = lzma_physmem() / 4;
+		mt.memlimit_stop = UINT64_MAX;
+		ret = lzma_stream_decoder_mt(&ls, &mt);
+	}
+#else
+	ret = lzma_stream_decoder(&ls, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+	if (ret != LZMA_OK) decomp_oom();
+	while (1) {
+		size_t avail = 0;
+
+		if (ls.avail_in == 0 && action == LZMA_RUN) {
+			/* Hand the decoder everything buffered, then refill */
+			in_consume(ds.len - ds.pos);
+			avail = in_fill(DECOMP_JOB_IN);
+			ls.next_in = ds.buf + ds.pos;
+			ls.avail_in = avail;
+			if (avail == 0) action = LZMA_FINISH;
+		}
+		ls.next_out = out;
+		ls.avail_out = DECOMP_OUT;
+		ret = lzma_code(&ls, action);
+		if (write_out(out, DECOMP_OUT - ls.avail_out) != 0) break;
+		if (ret == LZMA_STREAM_END) break;
+		if (ret != LZMA_OK) decomp_fail(ret == LZMA_DATA_ERROR ? "data error"
+				: ret == LZMA_BUF_ERROR ? "truncated" : "decoder error");
+	}
+	in_consume(ds.len - ds.pos);
+	lzma_end(&ls);
+	free(out);
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static void stream_zstd(void)
+{
+	unsigned char *out = (unsigned char *)malloc(DECOMP_OUT);
+	ZSTD_DCtx * const dctx = ZSTD_createDCtx();
+	size_t ret = 0;
+
+	if (out == NULL || dctx == NULL) decomp_oom();
+	while (1) {
+		const size_t avail = in_fill(1);
+		ZSTD_inBuffer ib;
+		ZSTD_outBuffer ob;
+
+		if (avail == 0) break;
+		ib.src = ds.buf + ds.pos;
+		ib.size = avail;
+		ib.pos = 0;
+		ob.dst = out;
+		ob.size = DECOMP_OUT;
+		ob.pos = 0;
+		ret = ZSTD_decompressStream(dctx, &ob, &ib);
+		if (ZSTD_isError(ret)) decomp_fail(ZSTD_getErrorName(ret));
+		in_consume(ib.pos);
+		if (write_out(out, ob.pos) != 0) break;
+	}
+	if (ret != 0) decomp_fail("truncated");
+	ZSTD_freeDCtx(dctx);
+	free(out);
+}
+#endif
+
+
+static void decode_stream(void)
+{
+	switch (ds.format) {
+#ifdef HAVE_ZLIB
+	case FMT_GZIP: stream_gzip(); break;
+#endif
+#ifdef HAVE_LZMA
+	case FMT_XZ: stream_xz(); break;
+#endif
+#ifdef HAVE_ZSTD
+	case FMT_ZSTD: stream_zstd(); break;
+#endif
+	default: break;
+	}
+}
+
+
+/* Parallel decoding of independently sized members/frames */
+
+#ifdef HAVE_ZLIB
+/* Total size of a BGZF member starting at p, or 0 if it isn't one */
+static size_t bgzf_member_size(const unsigned char * const restrict p, const size_t avail)
+{
+	size_t xlen, i;
+
+	if (avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+	xlen = (size_t)p[10] | ((size_t)p[11] << 8);
+	if (avail < 12 + xlen) return 0;
+	for (i = 12; i + 4 <= 12 + xlen; ) {
+		const size_t slen = (size_t)p[i + 2] | ((size_t)p[i + 3] << 8);
+		if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= 12 + xlen)
+			return ((size_t)p[i + 4] | ((size_t)p[i + 5] << 8)) + 1;
+		i += 4 + slen;
+	}
+	return 0;
+}
+
+
+static void job_gzip(struct decomp_job * const restrict job, z_stream * const restrict zs)
+{
+	int ret;
+
+	zs->next_in = job->in;
+	zs->avail_in = (uInt)job->in_len;
+	while (1) {
+		if (job->out_len == job->out_alloc) reserve(&job->out, &job->out_alloc, job->out_alloc * 2);
+		zs->next_out = job->out + job->out_len;
+		zs->avail_out = (uInt)(job->out_alloc - job->out_len);
+		ret = inflate(zs, Z_NO_FLUSH);
+		job->out_len = job->out_alloc - zs->avail_out;
+		if (ret == Z_STREAM_END) {
+			inflateReset(zs);
+			if (zs->avail_in == 0) return;
+			continue;
+		}
+		if (ret == Z_BUF_ERROR && zs->avail_out > 0) decomp_fail("truncated member");
+		if (ret != Z_OK && ret != Z_BUF_ERROR) decomp_fail(zs->msg ? zs->msg : "inflate failed");
+	}
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static void job_zstd(struct decomp_job * const restrict job, ZSTD_DCtx * const restrict dctx)
+{
+	ZSTD_inBuffer ib;
+	size_t ret = 0;
+
+	ib.src = job->in;
+	ib.size = job->in_len;
+	ib.pos = 0;
+	while (ib.pos < ib.size) {
+		ZSTD_outBuffer ob;
+
+		if (job->out_len == job->out_alloc) reserve(&job->out, &job->out_alloc, job->out_alloc * 2);
+		ob.dst = job->out;
+		ob.size = job->out_alloc;
+		ob.pos = job->out_len;
+		ret = ZSTD_decompressStream(dctx, &ob, &ib);
+		if (ZSTD_isError(ret)) decomp_fail(ZSTD_getErrorName(ret));
+		job->out_len = ob.pos;
+	}
+	/* Flush anything still held for the last frame */
+	while (ret != 0) {
+		ZSTD_outBuffer ob;
+		reserve(&job->out, &job->out_alloc, job->out_alloc * 2);
+		ob.dst = job->out;
+		ob.size = job->out_alloc;
+		ob.pos = job->out_len;
+		ret = ZSTD_decompressStream(dctx, &ob, &ib);
+		if (ZSTD_isError(ret)) decomp_fail(ZSTD_getErrorName(ret));
+		if (ob.pos == job->out_len && ret != 0) decomp_fail("truncated frame");
+		job->out_len = ob.pos;
+	}
+}
+#endif
+
+
+static void *decomp_worker(void *arg)
+{
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *dctx = NULL;
+#endif
+
+	(void)arg;
+#ifdef HAVE_ZLIB
+	memset(&zs, 0, sizeof(zs));
+	if (ds.format == FMT_GZIP && inflateInit2(&zs, 15 + 16) != Z_OK) decomp_oom();
+#endif
+#ifdef HAVE_ZSTD
+	if (ds.format == FMT_ZSTD && (dctx = ZSTD_createDCtx()) == NULL) decomp_oom();
+#endif
+
+	pthread_mutex_lock(&ds.lock);
+	while (1) {
+		struct decomp_job *job = NULL;
+		unsigned int i;
+
+		for (i = ds.head; i != ds.tail; i++) {
+			if (ds.jobs[i % ds.njobs].state == JOB_READY) {
+				job = &ds.jobs[i % ds.njobs];
+				break;
+			}
+		}
+		if (job == NULL) {
+			if (ds.stop) break;
+			pthread_cond_wait(&ds.cond, &ds.lock);
+			continue;
+		}
+		job->state = JOB_BUSY;
+		pthread_mutex_unlock(&ds.lock);
+
+		job->out_len = 0;
+#ifdef HAVE_ZLIB
+		if (ds.format == FMT_GZIP) job_gzip(job, &zs);
+#endif
+#ifdef HAVE_ZSTD
+		if (ds.format == FMT_ZSTD) job_zstd(job, dctx);
+#endif
+
+		pthread_mutex_lock(&ds.lock);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&ds.cond);
+	}
+	pthread_mutex_unlock(&ds.lock);
+
+#ifdef HAVE_ZLIB
+	if (ds.format == FMT_GZIP) inflateEnd(&zs);
+#endif
+#ifdef HAVE_ZSTD
+	if (dctx != NULL) ZSTD_freeDCtx(dctx);
+#endif
+	return NULL;
+}
+
+
+/* Move whole members/frames from the input into a job
+ * Returns the number moved; sets ds.fallback at a piece that can't be
+ * split out, leaving the input positioned at its start */
+static unsigned int split_job(struct decomp_job * const restrict job)
+{
+	unsigned int units = 0;
+	size_t out_hint = 0;
+
+	job->in_len = 0;
+	while (job->in_len < DECOMP_JOB_IN) {
+		const unsigned char *p;
+		size_t avail, size = 0;
+
+		avail = in_fill(18);
+		if (avail == 0) break;
+		p = ds.buf + ds.pos;
+#ifdef HAVE_ZLIB
+		if (ds.format == FMT_GZIP) {
+			if (avail >= 12) avail = in_fill(12 + ((size_t)p[10] | ((size_t)p[11] << 8)));
+			p = ds.buf + ds.pos;
+			size = bgzf_member_size(p, avail);
+			if (size == 0 || size < 18 || in_fill(size) < size) {
+				ds.fallback = 1;
+				break;
+			}
+			p = ds.buf + ds.pos;
+			out_hint += get_le32(p + size - 4);
+		}
+#endif
+#ifdef HAVE_ZSTD
+		if (ds.format == FMT_ZSTD) {
+			size_t want = 65536;
+
+			/* Skippable frames carry no data */
+			if (avail >= 8 && (get_le32(p) & 0xfffffff0U) == 0x184d2a50U) {
+				size = 8 + (size_t)get_le32(p + 4);
+				if (in_fill(size) < size) decomp_fail("truncated skippable frame");
+				in_consume(size);
+				continue;
+			}
+			while (1) {
+				avail = in_fill(want);
+				p = ds.buf + ds.pos;
+				size = ZSTD_findFrameCompressedSize(p, avail);
+				if (!ZSTD_isError(size)) break;
+				if (avail < want || want >= DECOMP_MAX_FRAME) {
+					size = 0;
+					break;
+				}
+				want *= 4;
+			}
+			if (size == 0) {
+				ds.fallback = 1;
+				break;
+			}
+			{
+				const unsigned long long fcs = ZSTD_getFrameContentSize(p, size);
+				if (fcs != ZSTD_CONTENTSIZE_UNKNOWN && fcs != ZSTD_CONTENTSIZE_ERROR
+						&& fcs < DECOMP_MAX_FRAME * 4ULL) out_hint += (size_t)fcs;
+			}
+		}
+#endif
+		if (size == 0) break;
+		reserve(&job->in, &job->in_alloc, job->in_len + size);
+		memcpy(job->in + job->in_len, p, size);
+		job->in_len += size;
+		ds.pos += size;
+		units++;
+	}
+	job->in_end = ds.base + ds.pos;
+	reserve(&job->out, &job->out_alloc, out_hint ? out_hint : job->in_len * 4);
+	return units;
+}
+
+
+static void decode_parallel(void)
+{
+	pthread_t workers[DECOMP_MAX_THREADS];
+	unsigned int t, split_done = 0;
+
+	ds.njobs = ds.threads * DECOMP_JOBS_PER_THREAD;
+	for (t = 0; t < ds.threads; t++)
+		if (pthread_create(&workers[t], NULL, decomp_worker, NULL) != 0) {
+			fprintf(stderr, "Error: cannot create decompression thread\n");
+			exit(EXIT_FAILURE);
+		}
+
+	pthread_mutex_lock(&ds.lock);
+	while (1) {
+		struct decomp_job *job;
+
+		/* Keep every free slot filled with work */
+		while (!split_done && ds.jobs[ds.tail % ds.njobs].state == JOB_FREE) {
+			unsigned int units;
+
+			job = &ds.jobs[ds.tail % ds.njobs];
+			pthread_mutex_unlock(&ds.lock);
+			units = split_job(job);
+			pthread_mutex_lock(&ds.lock);
+			if (units > 0) {
+				job->state = JOB_READY;
+				ds.tail++;
+				pthread_cond_broadcast(&ds.cond);
+			}
+			if (units == 0 || ds.fallback) split_done = 1;
+		}
+		if (ds.head == ds.tail) break;
+
+		/* Write finished jobs in order */
+		job = &ds.jobs[ds.head % ds.njobs];
+		while (job->state != JOB_DONE) pthread_cond_wait(&ds.cond, &ds.lock);
+		pthread_mutex_unlock(&ds.lock);
+		if (write_out(job->out, job->out_len) != 0) {
+			pthread_mutex_lock(&ds.lock);
+			break;
+		}
+		set_done(job->in_end);
+		pthread_mutex_lock(&ds.lock);
+		job->state = JOB_FREE;
+		ds.head++;
+	}
+	ds.stop = 1;
+	pthread_cond_broadcast(&ds.cond);
+	pthread_mutex_unlock(&ds.lock);
+	for (t = 0; t < ds.threads; t++) pthread_join(workers[t], NULL);
+	for (t = 0; t < ds.njobs; t++) {
+		free(ds.jobs[t].in);
+		free(ds.jobs[t].out);
+	}
+
+	/* Whatever could not be split is decoded as a stream */
+	if (ds.fallback) decode_stream();
+}
+
+
+static void *decomp_feeder(void *arg)
+{
+	int parallel = 0;
+
+	(void)arg;
+#ifdef HAVE_ZLIB
+	if (ds.format == FMT_GZIP) {
+		const size_t avail = in_fill(64);
+		parallel = avail > 0 && bgzf_member_size(ds.buf, avail) != 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (ds.format == FMT_ZSTD) parallel = 1;
+#endif
+	fprintf(stderr, "Decompressing %s input (%s, %u threads)\n", fmt_names[ds.format],
+			parallel ? "parallel frames" : ds.format == FMT_XZ ? "xz blocks" : "stream",
+			(parallel || ds.format == FMT_XZ) ? ds.threads : 1);
+	if (parallel) decode_parallel();
+	else decode_stream();
+	close(ds.pipefd);
+	close(ds.fd);
+	free(ds.buf);
+	return NULL;
+}
+
+
+/* Open an input image, decompressing it on the fly if it is compressed
+ * Returns a stream to read the image data from, or NULL on error */
+extern FILE *decomp_open(const char * const restrict path)
+{
+	unsigned char magic[6];
+	struct stat st;
+	int pfd[2];
+	long threads;
+
+	memset(&ds, 0, sizeof(ds));
+	if ((ds.fd = open(path, O_RDONLY)) < 0) return NULL;
+	memset(magic, 0, sizeof(magic));
+	if (pread(ds.fd, magic, sizeof(magic), 0) < 0 || fstat(ds.fd, &st) != 0) {
+		close(ds.fd);
+		return NULL;
+	}
+	/* gzip: ID1, ID2 and CM = 8 (deflate), the only method defined */
+	if (magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8) ds.format = FMT_GZIP;
+	else if (!memcmp(magic, "\xfd" "7zXZ\0", 6)) ds.format = FMT_XZ;
+	else if (get_le32(magic) == 0xfd2fb528U) ds.format = FMT_ZSTD;
+	if (ds.format == FMT_NONE) {
+		close(ds.fd);
+		return fopen(path, "rb");
+	}
+#ifndef HAVE_ZLIB
+	if (ds.format == FMT_GZIP) goto unsupported;
+#endif
+#ifndef HAVE_LZMA
+	if (ds.format == FMT_XZ) goto unsupported;
+#endif
+#ifndef HAVE_ZSTD
+	if (ds.format == FMT_ZSTD) goto unsupported;
+#endif
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) threads = 1;
+	if (threads > DECOMP_MAX_THREADS) threads = DECOMP_MAX_THREADS;
+	ds.threads = (unsigned int)threads;
+	ds.in_total = (uint64_t)st.st_size;
+	pthread_mutex_init(&ds.lock, NULL);
+	pthread_cond_init(&ds.cond, NULL);
+
+	if (pipe(pfd) != 0) {
+		close(ds.fd);
+		return NULL;
+	}
+#ifdef F_SETPIPE_SZ
+	fcntl(pfd[1], F_SETPIPE_SZ, DECOMP_PIPE_SIZE);
+#endif
+	ds.pipefd = pfd[1];
+	if ((ds.file = fdopen(pfd[0], "rb")) == NULL) {
+		close(pfd[0]);
+		close(pfd[1]);
+		close(ds.fd);
+		return NULL;
+	}
+	if (pthread_create(&ds.feeder, NULL, decomp_feeder, NULL) != 0) {
+		fprintf(stderr, "Error: cannot create decompression thread\n");
+		exit(EXIT_FAILURE);
+	}
+	return ds.file;
+
+#if !defined HAVE_ZLIB || !defined HAVE_LZMA || !defined HAVE_ZSTD
+unsupported:
+	fprintf(stderr, "Error: %s is %s compressed, but this build has no %s support\n",
+			path, fmt_names[ds.format], fmt_names[ds.format]);
+	exit(EXIT_FAILURE);
+#endif
+}
+
+
+/* Compressed bytes consumed so far and the compressed file size
+ * Returns 0 for a decompressing stream, -1 for anything else */
+extern int decomp_progress(const FILE * const restrict f,
+		uint64_t * const restrict done, uint64_t * const restrict total)
+{
+	if (f == NULL || f != ds.file) return -1;
+	*done = __atomic_load_n(&ds.in_done, __ATOMIC_RELAXED);
+	*total = ds.in_total;
+	return 0;
+}
+
+
+/* Close a stream from decomp_open() */
+extern int decomp_close(FILE * const restrict f)
+{
+	int ret;
+
+	if (f == NULL || f != ds.file) return fclose(f);
+	ret = fclose(f);
+	pthread_join(ds.feeder, NULL);
+	ds.file = NULL;
+	return ret;
+}
@@ -0,0 +1,23 @@
+/* Compressed input stream headers
+ * See imagepile.c for copyright information */
+
+#ifndef DECOMP_H
+#define DECOMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+
+extern FILE *decomp_open(const char * const restrict path);
+extern int decomp_progress(const FILE * const restrict f,
+		uint64_t * const restrict done, uint64_t * const restrict total);
+extern int decomp_close(FILE * const restrict f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* DECOMP_H */
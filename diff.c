@@ -0,0 +1,271 @@
+/*
+ * Image diff
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Compares the offset lists of two images and reports the ranges of
+ * image blocks whose DB offsets differ. Within one pile, identical block
+ * data always has the same offset, so this is a content diff. The lists
+ * are compared 16 offsets at a time with SSE2 where available. If both
+ * images have current Merkle trees, only the leaves the trees disagree
+ * on are scanned. A last block that differs only in length counts as
+ * changed; images with different start offsets are refused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "merkle.h"
+#include "diff.h"
+
+#ifdef __SSE2__
+ #include <emmintrin.h>
+#endif
+
+/* Output formats */
+#define DIFF_TEXT 0
+#define DIFF_JSON 1
+#define DIFF_BINARY 2
+
+struct diff_list {
+	struct diff_extent *ext;
+	size_t count, alloc;
+};
+
+
+/* Index of the first offset in [i, end) that differs, or end */
+static uint64_t diff_skip_equal(const uint32_t * const restrict a,
+		const uint32_t * const restrict b, uint64_t i, const uint64_t end)
+{
+#ifdef __SSE2__
+	while (i + 16 <= end) {
+		const __m128i e0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i)));
+		const __m128i e1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 4)),
+				_mm_loadu_si128((const __m128i *)(b + i + 4)));
+		const __m128i e2 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 8)),
+				_mm_loadu_si128((const __m128i *)(b + i + 8)));
+		const __m128i e3 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 12)),
+				_mm_loadu_si128((const __m128i *)(b + i + 12)));
+		const __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+		if (_mm_movemask_epi8(all) != 0xffff) break;
+		i += 16;
+	}
+#endif
+	while (i < end && a[i] == b[i]) i++;
+	return i;
+}
+
+
+/* Index of the first offset in [i, end) that matches, or end */
+static uint64_t diff_skip_changed(const uint32_t * const restrict a,
+		const uint32_t * const restrict b, uint64_t i, const uint64_t end)
+{
+#ifdef __SSE2__
+	while (i + 16 <= end) {
+		const __m128i e0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i)));
+		const __m128i e1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 4)),
+				_mm_loadu_si128((const __m128i *)(b + i + 4)));
+		const __m128i e2 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 8)),
+				_mm_loadu_si128((const __m128i *)(b + i + 8)));
+		const __m128i e3 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 12)),
+				_mm_loadu_si128((const __m128i *)(b + i + 12)));
+		const __m128i any = _mm_or_si128(_mm_or_si128(e0, e1), _mm_or_si128(e2, e3));
+		if (_mm_movemask_epi8(any) != 0) break;
+		i += 16;
+	}
+#endif
+	while (i < end && a[i] != b[i]) i++;
+	return i;
+}
+
+
+/* Add a changed range, merging it with the previous one if they touch */
+static void diff_add(struct diff_list * const restrict list,
+		const uint64_t start, const uint64_t count)
+{
+	if (list->count > 0) {
+		struct diff_extent * const last = &list->ext[list->count - 1];
+		if (last->start + last->count == start) {
+			last->count += count;
+			return;
+		}
+	}
+	if (list->count == list->alloc) {
+		struct diff_extent *tmp;
+		list->alloc = list->alloc ? list->alloc * 2 : 256;
+		tmp = (struct diff_extent *)realloc(list->ext, list->alloc * sizeof(struct diff_extent));
+		if (tmp == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		list->ext = tmp;
+	}
+	list->ext[list->count].start = start;
+	list->ext[list->count].count = count;
+	list->count++;
+	return;
+}
+
+
+/* Scan [i, end) of both lists for changed ranges */
+static void diff_scan(struct diff_list * const restrict list,
+		const uint32_t * const restrict a, const uint32_t * const restrict b,
+		uint64_t i, const uint64_t end)
+{
+	while (i < end) {
+		const uint64_t start = diff_skip_equal(a, b, i, end);
+		if (start == end) break;
+		i = diff_skip_changed(a, b, start, end);
+		diff_add(list, start, i - start);
+	}
+	return;
+}
+
+
+/* Find the changed block ranges between two images
+ * The caller must free() the returned list */
+extern struct diff_extent *diff_images(const char * const restrict path_a,
+		const char * const restrict path_b, size_t * const restrict count,
+		uint64_t * const restrict blocks_a, uint64_t * const restrict blocks_b)
+{
+	struct diff_list list;
+	struct merkle_t ma, mb;
+	struct ipil_t a, b;
+	uint64_t common, tail;
+	int scanned = 0;
+
+	memset(&list, 0, sizeof(list));
+	if (ipil_open(path_a, &a) != 0 || ipil_open(path_b, &b) != 0) exit(EXIT_FAILURE);
+	if (a.start_offset != b.start_offset) {
+		fprintf(stderr, "Error: %s and %s have different start offsets; their blocks don't line up\n",
+				path_a, path_b);
+		exit(EXIT_FAILURE);
+	}
+	*blocks_a = a.count;
+	*blocks_b = b.count;
+	common = a.count < b.count ? a.count : b.count;
+	/* The last shared block can differ in length alone; check it below */
+	tail = common ? common - 1 : 0;
+
+	if (a.count == b.count && merkle_load(path_a, &ma) == 0) {
+		if (merkle_load(path_b, &mb) == 0) {
+			/* Only scan the leaves the trees disagree on */
+			size_t *leaves, n, i;
+			uint64_t visited;
+
+			leaves = merkle_diff(&ma, &mb, &n, &visited);
+			for (i = 0; i < n; i++) {
+				const uint64_t first = (uint64_t)leaves[i] * MERKLE_LEAF;
+				uint64_t last = first + MERKLE_LEAF;
+				if (last > tail) last = tail;
+				diff_scan(&list, a.offsets, b.offsets, first, last);
+			}
+			free(leaves);
+			merkle_free(&mb);
+			scanned = 1;
+		}
+		merkle_free(&ma);
+	}
+	if (!scanned) diff_scan(&list, a.offsets, b.offsets, 0, tail);
+	if (common > 0 && (a.offsets[tail] != b.offsets[tail]
+				|| ipil_block_len(&a, tail) != ipil_block_len(&b, tail)))
+		diff_add(&list, tail, 1);
+
+	/* Blocks only one of the images has are all changed */
+	if (a.count != b.count) {
+		const uint64_t longer = a.count > b.count ? a.count : b.count;
+		diff_add(&list, common, longer - common);
+	}
+	ipil_close(&a);
+	ipil_close(&b);
+	*count = list.count;
+	return list.ext;
+}
+
+
+static void diff_write(const void * const restrict data, const size_t len)
+{
+	if (fwrite(data, 1, len, stdout) != len) {
+		fprintf(stderr, "Error: cannot write diff output\n");
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+
+/* Print a string as a JSON string literal */
+static void json_string(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20) printf("\\u%04x", (unsigned int)(unsigned char)*s);
+		else putchar(*s);
+	}
+	putchar('"');
+	return;
+}
+
+
+/* diff [--json | --binary] image_a image_b */
+extern int diff_verb(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct diff_extent *ext;
+	struct timespec t0, t1;
+	size_t count, i;
+	uint64_t blocks_a, blocks_b, changed = 0;
+	double secs;
+	int format = DIFF_TEXT;
+
+	(void)files;
+	if (argc == 3 && !strcmp(argv[0], "--json")) format = DIFF_JSON;
+	else if (argc == 3 && !strcmp(argv[0], "--binary")) format = DIFF_BINARY;
+	else if (argc != 2) return 1;
+	if (argc == 3) argv++;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ext = diff_images(argv[0], argv[1], &count, &blocks_a, &blocks_b);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (format == DIFF_BINARY) {
+		const uint32_t version = DIFF_VERSION;
+		diff_write("IPDF", 4);
+		diff_write(&version, 4);
+		diff_write(&blocks_a, 8);
+		diff_write(&blocks_b, 8);
+		if (count > 0) diff_write(ext, count * sizeof(struct diff_extent));
+	} else if (format == DIFF_JSON) {
+		printf("{\"a\": ");
+		json_string(argv[0]);
+		printf(", \"b\": ");
+		json_string(argv[1]);
+		printf(", \"blocks_a\": %" PRIu64 ", \"blocks_b\": %" PRIu64
+				", \"block_size\": %d, \"extents\": [",
+				blocks_a, blocks_b, B_SIZE);
+		for (i = 0; i < count; i++)
+			printf("%s[%" PRIu64 ", %" PRIu64 "]", i ? ", " : "", ext[i].start, ext[i].count);
+		printf("]}\n");
+	} else {
+		for (i = 0; i < count; i++)
+			printf("%" PRIu64 "-%" PRIu64 "\n", ext[i].start, ext[i].start + ext[i].count - 1);
+	}
+	if (fflush(stdout) != 0) {
+		fprintf(stderr, "Error: cannot write diff output\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) changed += ext[i].count;
+	secs = (double)(t1.tv_sec - t0.tv_sec) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e9);
+	fprintf(stderr, "Stats: %ju extents, %ju changed blocks (%ju KiB) in %.3f ms\n",
+			(uintmax_t)count, (uintmax_t)changed, (uintmax_t)(changed * (B_SIZE / 1024)),
+			secs * 1000.0);
+	free(ext);
+	return 0;
+}
@@ -0,0 +1,39 @@
+/* Image diff headers
+ * See imagepile.c for copyright information */
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "imagepile.h"
+
+/*
+ * Binary diff output (native byte order)
+ * 0-3:   'IPDF' signature
+ * 4-7:   Version
+ * 8-15:  Block count of image A
+ * 16-23: Block count of image B
+ * 24-:   Extents as 64-bit (first block, block count) pairs until EOF
+ */
+#define DIFF_VERSION 1
+
+/* Changed range of image blocks */
+struct diff_extent {
+	uint64_t start;
+	uint64_t count;
+};
+
+extern struct diff_extent *diff_images(const char * const restrict path_a,
+		const char * const restrict path_b, size_t * const restrict count,
+		uint64_t * const restrict blocks_a, uint64_t * const restrict blocks_b);
+extern int diff_verb(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* DIFF_H */
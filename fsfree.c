@@ -0,0 +1,467 @@
+/*
+ * Filesystem free space map for "add --skip-free"
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Free space in an image is whatever the filesystem last deleted: unique,
+ * useless data that would otherwise be hashed and stored in the pile.
+ * This finds the NTFS and ext2/3/4 filesystems in an image (on the bare
+ * device or in MBR/GPT partitions), reads their allocation bitmaps and
+ * builds a sorted list of byte ranges that no file uses. Blocks that lie
+ * entirely inside one of those ranges are stored as zero blocks.
+ *
+ * Anything that makes a bitmap untrustworthy (a dirty NTFS volume, an
+ * ext journal that needs recovery, features this code does not know how
+ * to read) causes that filesystem to be left alone with a warning.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include "partition.h"
+#include "fsfree.h"
+
+/* Bitmap data read per pass */
+#define FF_CHUNK (1024 * 1024)
+
+struct ff_extent {
+	uint64_t start, end;
+};
+
+struct fsfree {
+	struct ff_extent *ext;
+	size_t count, alloc, cur;
+	unsigned int filesystems;
+	uint64_t skipped;
+};
+
+
+static uint16_t le16(const unsigned char * const restrict p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const unsigned char * const restrict p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const unsigned char * const restrict p)
+{
+	return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+
+static void *ff_alloc(const size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+
+/* Record a free byte range, merging it with the previous one if they touch */
+static void add_free(struct fsfree * const restrict ff, const uint64_t start, const uint64_t len)
+{
+	if (ff->count > 0 && ff->ext[ff->count - 1].end == start) {
+		ff->ext[ff->count - 1].end += len;
+		return;
+	}
+	if (ff->count == ff->alloc) {
+		ff->alloc = ff->alloc ? ff->alloc * 2 : 4096;
+		ff->ext = (struct ff_extent *)realloc(ff->ext, ff->alloc * sizeof(struct ff_extent));
+		if (ff->ext == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	ff->ext[ff->count].start = start;
+	ff->ext[ff->count].end = start + len;
+	ff->count++;
+}
+
+
+/* Add the clear bits of an allocation bitmap; bit i covers unit bytes at base + i * unit */
+static uint64_t add_bitmap(struct fsfree * const restrict ff, const unsigned char * const restrict bm,
+		const uint64_t nbits, const uint64_t unit, const uint64_t base)
+{
+	uint64_t i = 0, freed = 0;
+
+	while (i < nbits) {
+		if ((i & 7) == 0 && i + 8 <= nbits && (bm[i >> 3] == 0 || bm[i >> 3] == 0xff)) {
+			if (bm[i >> 3] == 0) {
+				add_free(ff, base + (i * unit), 8 * unit);
+				freed += 8 * unit;
+			}
+			i += 8;
+			continue;
+		}
+		if (!(bm[i >> 3] & (1U << (i & 7)))) {
+			add_free(ff, base + (i * unit), unit);
+			freed += unit;
+		}
+		i++;
+	}
+	return freed;
+}
+
+
+/* NTFS */
+
+/* Read MFT record n and undo its update sequence fixups */
+static int ntfs_record(const partition_reader read_exact, void * const restrict ctx,
+		unsigned char * const restrict rec, const uint64_t mft, const uint32_t size,
+		const unsigned int n)
+{
+	unsigned int usa_ofs, usa_count, stride, i;
+
+	if (read_exact(ctx, rec, mft + ((uint64_t)n * size), size) != 0) return -1;
+	if (memcmp(rec, "FILE", 4)) return -1;
+	usa_ofs = le16(rec + 4);
+	usa_count = le16(rec + 6);
+	if (usa_count < 2 || usa_ofs + (usa_count * 2) > size) return -1;
+	stride = size / (usa_count - 1);
+	if (stride < 256 || stride * (usa_count - 1) != size) return -1;
+	for (i = 1; i < usa_count; i++) {
+		unsigned char * const end = rec + (i * stride) - 2;
+		if (memcmp(end, rec + usa_ofs, 2)) return -1;
+		memcpy(end, rec + usa_ofs + (i * 2), 2);
+	}
+	if (!(le16(rec + 22) & 1)) return -1;	/* Record not in use */
+	return 0;
+}
+
+
+/* Find the unnamed attribute of a type in an MFT record */
+static const unsigned char *ntfs_attr(const unsigned char * const restrict rec,
+		const uint32_t size, const uint32_t type)
+{
+	uint32_t off = le16(rec + 20);
+
+	while (off + 16 <= size) {
+		const unsigned char * const a = rec + off;
+		const uint32_t atype = le32(a), alen = le32(a + 4);
+
+		if (atype == 0xffffffffU || alen < 16 || off + alen > size) break;
+		if (atype == type && a[9] == 0) return a;
+		off += alen;
+	}
+	return NULL;
+}
+
+
+static int ntfs_scan(struct fsfree * const restrict ff, const partition_reader read_exact,
+		void * const restrict ctx, const uint64_t part, const unsigned char * const restrict boot,
+		uint64_t * const restrict freed)
+{
+	const uint32_t bps = le16(boot + 11);
+	const int8_t cpr = (int8_t)boot[64];
+	uint64_t spc = boot[13], cluster, clusters, mft, bytes, done = 0, lcn = 0;
+	uint32_t recsize;
+	unsigned char *rec, *buf;
+	const unsigned char *a, *run, *aend;
+
+	if (spc > 0x80) spc = (uint64_t)1 << (256 - spc);
+	cluster = spc * bps;
+	if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) || spc == 0
+			|| (spc & (spc - 1)) || cluster > (2 * 1024 * 1024)) return -1;
+	clusters = le64(boot + 40) / spc;
+	mft = part + (le64(boot + 48) * cluster);
+	recsize = cpr > 0 ? (uint32_t)((uint64_t)cpr * cluster) : (uint32_t)1 << (-cpr);
+	if (recsize < 256 || recsize > 65536) return -1;
+
+	rec = (unsigned char *)ff_alloc(recsize);
+	/* $Volume: a dirty volume may have allocations not yet in $Bitmap */
+	if (ntfs_record(read_exact, ctx, rec, mft, recsize, 3) != 0
+			|| (a = ntfs_attr(rec, recsize, 0x70)) == NULL || a[8] != 0
+			|| le16(a + 20) + 12U > le32(a + 4)) goto error;
+	if (le16(a + le16(a + 20) + 10) & 1) {
+		fprintf(stderr, "Warning: NTFS volume at %" PRIu64 " is marked dirty\n", part);
+		goto error;
+	}
+
+	/* $Bitmap: one bit per cluster, stored non-resident */
+	if (ntfs_record(read_exact, ctx, rec, mft, recsize, 6) != 0
+			|| (a = ntfs_attr(rec, recsize, 0x80)) == NULL || a[8] == 0) goto error;
+	bytes = le64(a + 48);
+	if (bytes > (clusters + 7) / 8) bytes = (clusters + 7) / 8;
+	run = a + le16(a + 32);
+	aend = a + le32(a + 4);
+	buf = (unsigned char *)ff_alloc(FF_CHUNK);
+	while (run < aend && *run != 0 && done < bytes) {
+		const unsigned int lenb = *run & 0x0f, offb = *run >> 4;
+		uint64_t len = 0, pos;
+		int64_t delta = 0;
+		unsigned int i;
+
+		if (lenb == 0 || lenb > 8 || offb == 0 || offb > 8 || run + 1 + lenb + offb > aend) {
+			free(buf);
+			goto error;
+		}
+		for (i = 0; i < lenb; i++) len |= (uint64_t)run[1 + i] << (8 * i);
+		for (i = 0; i < offb; i++) delta |= (int64_t)((uint64_t)run[1 + lenb + i] << (8 * i));
+		if (run[lenb + offb] & 0x80 && offb < 8) delta -= (int64_t)1 << (8 * offb);
+		run += 1 + lenb + offb;
+		lcn = (uint64_t)((int64_t)lcn + delta);
+
+		/* Feed this run's bitmap bytes through in chunks */
+		for (pos = 0; pos < len * cluster && done < bytes; ) {
+			uint64_t n = (len * cluster) - pos;
+			if (n > FF_CHUNK) n = FF_CHUNK;
+			if (n > bytes - done) n = bytes - done;
+			if (read_exact(ctx, buf, part + (lcn * cluster) + pos, (size_t)n) != 0) {
+				free(buf);
+				goto error;
+			}
+			*freed += add_bitmap(ff, buf, (done + n) * 8 > clusters ? clusters - (done * 8) : n * 8,
+					cluster, part + (done * 8 * cluster));
+			pos += n;
+			done += n;
+		}
+	}
+	free(buf);
+	free(rec);
+	return done == bytes ? 0 : -1;
+
+error:
+	free(rec);
+	return -1;
+}
+
+
+/* ext2/3/4 */
+
+struct ext_meta {
+	uint64_t start, end;
+};
+
+static int ext_meta_cmp(const void *a, const void *b)
+{
+	const struct ext_meta * const x = (const struct ext_meta *)a;
+	const struct ext_meta * const y = (const struct ext_meta *)b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+
+static int ext_is_power(uint64_t g, const uint64_t base)
+{
+	while (g > 1 && g % base == 0) g /= base;
+	return g == 1;
+}
+
+
+static void ext_mark(unsigned char * const restrict bm, const uint64_t first, const uint64_t last)
+{
+	uint64_t i;
+	for (i = first; i < last; i++) bm[i >> 3] = (unsigned char)(bm[i >> 3] | (1U << (i & 7)));
+}
+
+
+static int ext_scan(struct fsfree * const restrict ff, const partition_reader read_exact,
+		void * const restrict ctx, const uint64_t part, const unsigned char * const restrict sb,
+		uint64_t * const restrict freed)
+{
+	const uint32_t compat = le32(sb + 92), incompat = le32(sb + 96), ro_compat = le32(sb + 100);
+	const uint64_t fdb = le32(sb + 20), bpg = le32(sb + 32), ipg = le32(sb + 40);
+	const uint32_t log_bs = le32(sb + 24);
+	const uint16_t state = le16(sb + 58);
+	const int uninit_ok = (ro_compat & (0x10 | 0x400)) != 0;
+	uint64_t bs, blocks, groups, gdt_blocks, itb, g, nmeta = 0;
+	uint32_t ds = 32, isize = 128;
+	unsigned char *gdt, *bm;
+	struct ext_meta *meta;
+
+	if (incompat & 0x4) {
+		fprintf(stderr, "Warning: ext filesystem at %" PRIu64 " needs journal recovery\n", part);
+		return -1;
+	}
+	if (!(state & 1) || (state & 2)) {
+		fprintf(stderr, "Warning: ext filesystem at %" PRIu64 " was not cleanly unmounted\n", part);
+		return -1;
+	}
+	/* meta_bg moves group descriptors; bigalloc changes bitmap units */
+	if ((incompat & 0x10) || (ro_compat & 0x200) || log_bs > 6) return -1;
+	bs = (uint64_t)1024 << log_bs;
+	if (incompat & 0x80) {
+		ds = le16(sb + 254);
+		if (ds < 32 || ds > 1024 || (ds & (ds - 1))) return -1;
+	}
+	if (le32(sb + 76) >= 1) isize = le16(sb + 88);
+	blocks = le32(sb + 4);
+	if (incompat & 0x80) blocks |= (uint64_t)le32(sb + 0x150) << 32;
+	if (bpg == 0 || bpg > bs * 8 || ipg == 0 || isize < 128 || blocks <= fdb) return -1;
+	groups = (blocks - fdb + bpg - 1) / bpg;
+	if (groups > ((uint64_t)1 << 24)) return -1;
+	gdt_blocks = ((groups * ds) + bs - 1) / bs;
+	itb = ((ipg * isize) + bs - 1) / bs;
+
+	gdt = (unsigned char *)ff_alloc((size_t)(gdt_blocks * bs));
+	if (read_exact(ctx, gdt, part + ((fdb + 1) * bs), (size_t)(gdt_blocks * bs)) != 0) {
+		free(gdt);
+		return -1;
+	}
+
+	/* Where every group's bitmaps and inode table live (flex_bg may put
+	 * them in other groups, including uninitialized ones) */
+	meta = (struct ext_meta *)ff_alloc((size_t)(groups * 3 * sizeof(struct ext_meta)));
+	for (g = 0; g < groups; g++) {
+		const unsigned char * const d = gdt + (g * ds);
+		uint64_t bb = le32(d), ib = le32(d + 4), it = le32(d + 8);
+
+		if (ds >= 64) {
+			bb |= (uint64_t)le32(d + 0x20) << 32;
+			ib |= (uint64_t)le32(d + 0x24) << 32;
+			it |= (uint64_t)le32(d + 0x28) << 32;
+		}
+		meta[nmeta].start = bb;
+		meta[nmeta++].end = bb + 1;
+		meta[nmeta].start = ib;
+		meta[nmeta++].end = ib + 1;
+		meta[nmeta].start = it;
+		meta[nmeta++].end = it + itb;
+	}
+	qsort(meta, (size_t)nmeta, sizeof(struct ext_meta), ext_meta_cmp);
+
+	bm = (unsigned char *)ff_alloc((size_t)bs);
+	for (g = 0; g < groups; g++) {
+		const unsigned char * const d = gdt + (g * ds);
+		const uint64_t gstart = fdb + (g * bpg);
+		const uint64_t n = blocks - gstart < bpg ? blocks - gstart : bpg;
+
+		if (uninit_ok && (le16(d + 18) & 2)) {
+			/* BLOCK_UNINIT: only this group's own metadata is in use */
+			size_t lo = 0, hi = (size_t)nmeta;
+			int has_super;
+
+			if (compat & 0x200) has_super = (g == 0 || g == le32(sb + 0x24c) || g == le32(sb + 0x250));
+			else has_super = (!(ro_compat & 1) || g <= 1 || ext_is_power(g, 3)
+					|| ext_is_power(g, 5) || ext_is_power(g, 7));
+			memset(bm, 0, (size_t)bs);
+			if (has_super) {
+				const uint64_t sb_end = 1 + gdt_blocks + le16(sb + 206);
+				ext_mark(bm, 0, sb_end < n ? sb_end : n);
+			}
+			while (lo < hi) {
+				const size_t mid = (lo + hi) / 2;
+				if (meta[mid].end <= gstart) lo = mid + 1;
+				else hi = mid;
+			}
+			for (; lo < nmeta && meta[lo].start < gstart + n; lo++) {
+				const uint64_t s = meta[lo].start > gstart ? meta[lo].start - gstart : 0;
+				const uint64_t e = meta[lo].end - gstart < n ? meta[lo].end - gstart : n;
+				ext_mark(bm, s, e);
+			}
+		} else {
+			uint64_t bb = le32(d);
+			if (ds >= 64) bb |= (uint64_t)le32(d + 0x20) << 32;
+			if (bb >= blocks || read_exact(ctx, bm, part + (bb * bs), (size_t)bs) != 0) {
+				free(bm);
+				free(meta);
+				free(gdt);
+				return -1;
+			}
+		}
+		*freed += add_bitmap(ff, bm, n, bs, part + (gstart * bs));
+	}
+	free(bm);
+	free(meta);
+	free(gdt);
+	return 0;
+}
+
+
+/* Look for a filesystem at part; returns 1 if one was recognized */
+static int probe(struct fsfree * const restrict ff, const partition_reader read_exact,
+		void * const restrict ctx, const uint64_t part)
+{
+	unsigned char sec[1024];
+	const char *type;
+	const size_t before = ff->count;
+	uint64_t freed = 0;
+	int ret;
+
+	if (read_exact(ctx, sec, part, 512) != 0) return 0;
+	if (!memcmp(sec + 3, "NTFS    ", 8)) {
+		type = "NTFS";
+		ret = ntfs_scan(ff, read_exact, ctx, part, sec, &freed);
+	} else {
+		if (read_exact(ctx, sec, part + 1024, 1024) != 0 || le16(sec + 56) != 0xef53) return 0;
+		type = "ext2/3/4";
+		ret = ext_scan(ff, read_exact, ctx, part, sec, &freed);
+	}
+	if (ret != 0) {
+		/* Drop anything a half-read bitmap added */
+		ff->count = before;
+		fprintf(stderr, "Warning: %s filesystem at %" PRIu64 " not usable; its free space is kept\n", type, part);
+		return 1;
+	}
+	fprintf(stderr, "Free space: %s filesystem at %" PRIu64 ", %" PRIu64 " bytes unallocated\n", type, part, freed);
+	ff->filesystems++;
+	return 1;
+}
+
+
+static int extent_cmp(const void *a, const void *b)
+{
+	const struct ff_extent * const x = (const struct ff_extent *)a;
+	const struct ff_extent * const y = (const struct ff_extent *)b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+
+/* Build the free space map of a disk or filesystem image */
+extern struct fsfree *fsfree_scan(const partition_reader read_exact, void * const restrict ctx)
+{
+	struct fsfree *ff = (struct fsfree *)ff_alloc(sizeof(struct fsfree));
+	struct partition parts[PART_MAX];
+	unsigned int count, i;
+	const char *scheme;
+	size_t j, k;
+
+	memset(ff, 0, sizeof(struct fsfree));
+	if (!probe(ff, read_exact, ctx, 0)
+			&& partition_table_read(read_exact, ctx, parts, &count, &scheme) == 0) {
+		for (i = 0; i < count; i++) probe(ff, read_exact, ctx, parts[i].start);
+	}
+	if (ff->filesystems == 0)
+		fprintf(stderr, "Warning: no usable NTFS or ext2/3/4 filesystem found; nothing will be skipped\n");
+
+	/* Partitions may be listed out of order */
+	if (ff->count > 1) {
+		qsort(ff->ext, ff->count, sizeof(struct ff_extent), extent_cmp);
+		for (j = 0, k = 1; k < ff->count; k++) {
+			if (ff->ext[k].start <= ff->ext[j].end) {
+				if (ff->ext[k].end > ff->ext[j].end) ff->ext[j].end = ff->ext[k].end;
+			} else ff->ext[++j] = ff->ext[k];
+		}
+		ff->count = j + 1;
+	}
+	return ff;
+}
+
+
+/* Return 1 if the byte range lies entirely in free space
+ * Lookups are fastest when positions only move forward */
+extern int fsfree_covers(struct fsfree * const restrict ff, const uint64_t pos, const uint64_t len)
+{
+	if (ff->cur > 0 && ff->cur <= ff->count && pos < ff->ext[ff->cur - 1].end) ff->cur = 0;
+	while (ff->cur < ff->count && ff->ext[ff->cur].end <= pos) ff->cur++;
+	if (ff->cur == ff->count || ff->ext[ff->cur].start > pos || pos + len > ff->ext[ff->cur].end) return 0;
+	ff->skipped += len;
+	return 1;
+}
+
+
+extern void fsfree_close(struct fsfree * const restrict ff)
+{
+	if (ff == NULL) return;
+	fprintf(stderr, "Free space: %" PRIu64 " bytes in %u filesystem%s stored as zeroes\n",
+			ff->skipped, ff->filesystems, ff->filesystems == 1 ? "" : "s");
+	free(ff->ext);
+	free(ff);
+}
@@ -0,0 +1,24 @@
+/* Filesystem free space map headers
+ * See imagepile.c for copyright information */
+
+#ifndef FSFREE_H
+#define FSFREE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "partition.h"
+
+struct fsfree;
+
+extern struct fsfree *fsfree_scan(const partition_reader read_exact, void * const restrict ctx);
+extern int fsfree_covers(struct fsfree * const restrict ff, const uint64_t pos, const uint64_t len);
+extern void fsfree_close(struct fsfree * const restrict ff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* FSFREE_H */
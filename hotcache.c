@@ -0,0 +1,201 @@
+/*
+ * Pinned hot block cache
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * A small number of DB blocks (zero-adjacent patterns, common system
+ * files) are referenced by nearly every image in the pile. This cache
+ * counts block references across all images in the pile's catalog (or
+ * in IMGDIR when there is no catalog), loads the
+ * top N blocks into memory, and locks them there so that compares and
+ * image reads of those blocks never touch the DB file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "hotcache.h"
+#include "catalog.h"
+
+#if !defined _WIN32 && !defined __CYGWIN__
+ #include <sys/mman.h>
+#else
+ #define NO_MLOCK 1
+#endif
+
+/* Number of times a cached block was used instead of a DB read */
+uint64_t stats_hotcache_hits = 0;
+
+/* Sorted offsets of cached blocks and their data */
+static uint32_t *hot_offsets = NULL;
+static char *hot_data = NULL;
+static size_t hot_count = 0;
+static int hot_locked = 0;
+
+/* Min-heap entry used to select the most-referenced blocks */
+struct hot_entry {
+	uint32_t refs;
+	uint32_t offset;
+};
+
+
+/* Restore the min-heap property downward from entry i */
+static void heap_sift_down(struct hot_entry * const restrict heap,
+		const size_t count, size_t i)
+{
+	while (1) {
+		size_t l = (i * 2) + 1, r = l + 1, min = i;
+		struct hot_entry tmp;
+
+		if (l < count && heap[l].refs < heap[min].refs) min = l;
+		if (r < count && heap[r].refs < heap[min].refs) min = r;
+		if (min == i) return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/* Count references to each DB block from every image in IMGDIR, then
+ * load and pin the max_blocks most-referenced blocks in memory */
+extern int hotcache_init(const struct files_t * const restrict files,
+		const size_t max_blocks)
+{
+	uint16_t *refs;
+	struct hot_entry *heap;
+	char **list;
+	size_t list_count, heap_count = 0, i;
+	off_t db_blocks;
+	uint64_t total_refs = 0;
+
+	if (max_blocks == 0) return 0;
+	if (fseeko(files->db, 0, SEEK_END) != 0) return -1;
+	db_blocks = ftello(files->db) / B_SIZE;
+	if (db_blocks <= 0) return 0;
+
+	/* Saturating 16-bit counters keep memory usage sane for huge piles;
+	 * anything past 65535 references is "hot" regardless */
+	refs = (uint16_t *)calloc((size_t)db_blocks, sizeof(uint16_t));
+	if (refs == NULL) goto oom;
+
+	if (catalog_image_list(files->imgdir, &list, &list_count) != 0) {
+		free(refs);
+		return -1;
+	}
+	for (i = 0; i < list_count; i++) {
+		struct ipil_t ip;
+		size_t j;
+
+		if (ipil_open(list[i], &ip) != 0) continue;
+		for (j = 0; j < ip.count; j++) {
+			const uint32_t o = ip.offsets[j];
+			if ((off_t)o >= db_blocks) continue;
+			if (refs[o] < UINT16_MAX) refs[o]++;
+			total_refs++;
+		}
+		ipil_close(&ip);
+	}
+	ipil_free_list(list, list_count);
+
+	/* Keep the max_blocks most-referenced blocks in a min-heap */
+	heap = (struct hot_entry *)malloc(max_blocks * sizeof(struct hot_entry));
+	if (heap == NULL) goto oom;
+	for (i = 0; i < (size_t)db_blocks; i++) {
+		if (refs[i] < 2) continue;
+		if (heap_count < max_blocks) {
+			size_t j = heap_count++;
+			heap[j].refs = refs[i];
+			heap[j].offset = (uint32_t)i;
+			/* Sift up */
+			while (j > 0 && heap[(j - 1) / 2].refs > heap[j].refs) {
+				struct hot_entry tmp = heap[j];
+				heap[j] = heap[(j - 1) / 2];
+				heap[(j - 1) / 2] = tmp;
+				j = (j - 1) / 2;
+			}
+		} else if (refs[i] > heap[0].refs) {
+			heap[0].refs = refs[i];
+			heap[0].offset = (uint32_t)i;
+			heap_sift_down(heap, heap_count, 0);
+		}
+	}
+	free(refs);
+	if (heap_count == 0) {
+		free(heap);
+		fprintf(stderr, "Hot cache: no shared blocks found in %s\n", files->imgdir);
+		return 0;
+	}
+
+	/* Load cached blocks in DB order to keep reads sequential */
+	hot_offsets = (uint32_t *)malloc(heap_count * sizeof(uint32_t));
+	hot_data = (char *)malloc(heap_count * B_SIZE);
+	if (hot_offsets == NULL || hot_data == NULL) goto oom;
+	for (i = 0; i < heap_count; i++) hot_offsets[i] = heap[i].offset;
+	free(heap);
+	qsort(hot_offsets, heap_count, sizeof(uint32_t), cmp_uint32);
+	for (i = 0; i < heap_count; i++)
+		read_db_block(hot_data + (i * B_SIZE), (off_t)hot_offsets[i], files);
+	hot_count = heap_count;
+
+#ifndef NO_MLOCK
+	if (mlock(hot_data, hot_count * B_SIZE) == 0) hot_locked = 1;
+	else fprintf(stderr, "Warning: cannot lock hot cache in memory; continuing unlocked\n");
+#endif
+	fprintf(stderr, "Hot cache: %ju blocks (%ju KiB) loaded from %ju references\n",
+			(uintmax_t)hot_count, (uintmax_t)(hot_count * (B_SIZE / 1024)),
+			(uintmax_t)total_refs);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Return cached data for a DB block or NULL if it isn't cached */
+extern const void *hotcache_get(const off_t offset)
+{
+	size_t lo = 0, hi = hot_count;
+
+	if (hot_count == 0 || offset < 0) return NULL;
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if ((off_t)hot_offsets[mid] < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < hot_count && (off_t)hot_offsets[lo] == offset) {
+		stats_hotcache_hits++;
+		return hot_data + (lo * B_SIZE);
+	}
+	return NULL;
+}
+
+
+/* Release the hot cache */
+extern void hotcache_free(void)
+{
+#ifndef NO_MLOCK
+	if (hot_locked) munlock(hot_data, hot_count * B_SIZE);
+#endif
+	hot_locked = 0;
+	free(hot_offsets);
+	free(hot_data);
+	hot_offsets = NULL;
+	hot_data = NULL;
+	hot_count = 0;
+	return;
+}
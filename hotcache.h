@@ -0,0 +1,26 @@
+/* Pinned hot block cache headers
+ * See imagepile.c for copyright information */
+
+#ifndef HOTCACHE_H
+#define HOTCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "imagepile.h"
+
+extern uint64_t stats_hotcache_hits;
+
+extern int hotcache_init(const struct files_t * const restrict files,
+		const size_t max_blocks);
+extern const void *hotcache_get(const off_t offset);
+extern void hotcache_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* HOTCACHE_H */
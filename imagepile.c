@@ -22,8 +22,28 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "imagepile.h"
 #include "jody_hash.h"
+#include "ipil.h"
+#include "hotcache.h"
+#include "pack.h"
+#include "sync.h"
+#include "replicate.h"
+#include "merge.h"
+#include "backup.h"
+#include "catalog.h"
+#include "compact.h"
+#include "merkle.h"
+#include "diff.h"
+#include "restore.h"
+#include "range.h"
+#include "nbd.h"
+#include "compose.h"
+#include "decomp.h"
+#include "vdisk.h"
+#include "fsfree.h"
 
 /* Detect Windows and modify as needed */
 #if defined _WIN32 || defined __CYGWIN__
@@ -117,7 +137,7 @@ not_found:
 }
 
 /* Add hash to memory hash table (and optionally to hash index file) */
-static int index_hash(const jodyhash_t hash, const off_t offset, const int write,
+extern int index_hash(const jodyhash_t hash, const off_t offset, const int write,
 		const struct files_t * const restrict files)
 {
 	struct hash_leaf *leaf;
@@ -169,7 +189,7 @@ oom:
 /* Read a block from the block database
  * This is written as a separate function so that it may be enhanced
  * with inline compression functionality later */
-static int read_db_block(void * const restrict blk,
+extern int read_db_block(void * const restrict blk,
 		const off_t offset, const struct files_t * const restrict files)
 {
 	int i;
@@ -190,26 +210,80 @@ static int read_db_block(void * const restrict blk,
 	return 0;
 }
 
+/* Read a run of consecutive blocks from the block database using one
+ * positioned read so that the DB stream position is left alone */
+extern int read_db_run(void * const restrict buf, const off_t offset,
+		const size_t count, const struct files_t * const restrict files)
+{
+	char *p = (char *)buf;
+	size_t remain = count * B_SIZE;
+	off_t pos = offset * B_SIZE;
+
+	DLOG("read_db_run, offset %jd, count %ju\n", (intmax_t)offset, (uintmax_t)count);
+#ifdef ON_WINDOWS
+	fflush(files->db);
+	if (fseeko(files->db, pos, SEEK_SET) < 0) goto error_read;
+	if (fread(p, 1, remain, files->db) != remain) goto error_read;
+#else
+	while (remain > 0) {
+		const ssize_t r = pread(fileno(files->db), p, remain, pos);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			goto error_read;
+		}
+		p += r;
+		pos += r;
+		remain -= (size_t)r;
+	}
+#endif
+	return 0;
+
+error_read:
+	fprintf(stderr, "Error: cannot read blocks %jd-%jd in database.\n",
+			(intmax_t)offset, (intmax_t)offset + (intmax_t)count - 1);
+	exit(EXIT_FAILURE);
+}
+
+
+/* Return the number of blocks currently in the block database */
+extern off_t db_block_count(const struct files_t * const restrict files)
+{
+	struct stat st;
+
+	fflush(files->db);
+	if (fstat(fileno(files->db), &st) != 0) {
+		fprintf(stderr, "Error: cannot stat DB: %s\n", files->dbfile);
+		exit(EXIT_FAILURE);
+	}
+	return st.st_size / B_SIZE;
+}
+
+
 /* Compare an input block against a block in the block database */
 static int compare_blocks(const void *blk1, const off_t offset,
 		const struct files_t * const restrict files)
 {
-	int blk2[B_SIZE / sizeof(int)];
+	int buf[B_SIZE / sizeof(int)];
 	const int * const check1 = (const int *)blk1;
-	const int * const check2 = blk2;
+	const int *check2;
 
 	DLOG("compare_blocks, offset %d\n", offset);
 
 	/* Make sure no one passes us a negative offset, grr */
 	if (offset < 0) return -1;
 
-	read_db_block(blk2, offset, files);
+	/* Use the pinned copy of hot blocks instead of reading the DB */
+	check2 = (const int *)hotcache_get(offset);
+	if (check2 == NULL) {
+		read_db_block(buf, offset, files);
+		check2 = buf;
+	}
 
 	/* Compare first machine word before calling memcmp */
 	if (*check1 != *check2) return -1;
 
 	/* Compare the entire block */
-	if (!memcmp(blk1, blk2, B_SIZE)) return 0;
+	if (!memcmp(blk1, check2, B_SIZE)) return 0;
 
 	return -1;
 }
@@ -241,7 +315,7 @@ error_write:
 }
 
 /* Add an incoming block to (or find in) the databse; return its offset */
-static uint32_t get_block_offset(const void * const restrict blk,
+extern uint32_t get_block_offset(const void * const restrict blk,
 		const struct files_t * const restrict files)
 {
 	jodyhash_t hash;
@@ -285,27 +359,109 @@ static uint32_t get_block_offset(const void * const restrict blk,
 	return (uint32_t)offset;
 }
 
-/* Add an image file to the image pile database */
+/* Virtual disk container being added, if the input is one */
+static struct vdisk *in_vdisk = NULL;
+/* Filesystem free space to store as zeroes (add --skip-free) */
+static struct fsfree *in_free = NULL;
+static uint64_t in_pos = 0, in_size = 0;
+
+/* Positioned input reads for scanning filesystem metadata */
+static int read_input_at(void * const restrict ctx, void * const restrict buf,
+		const uint64_t pos, const size_t len)
+{
+	const struct files_t * const files = (const struct files_t *)ctx;
+	size_t done = 0;
+
+	if (pos > in_size || len > in_size - pos) return -1;
+	if (in_vdisk != NULL) return vdisk_read(in_vdisk, pos, buf, len) < 0 ? -1 : 0;
+	while (done < len) {
+		const ssize_t r = pread(fileno(files->in), (char *)buf + done, len - done, (off_t)(pos + done));
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)r;
+	}
+	return 0;
+}
+
+/* Read up to len bytes of input into blk
+ * *zero is set when a container reports the range as unallocated or
+ * zero, in which case no container data was read at all */
+static size_t input_read(const struct files_t * const restrict files,
+		char * const restrict blk, const size_t len,
+		int * const restrict zero, int * const restrict eof)
+{
+	size_t cnt;
+
+	*zero = 0;
+	if (in_free != NULL) {
+		cnt = in_size - in_pos < len ? (size_t)(in_size - in_pos) : len;
+		if (cnt > 0 && fsfree_covers(in_free, in_pos, cnt)) {
+			memset(blk, 0, cnt);
+			*zero = 1;
+			in_pos += cnt;
+			*eof = (in_pos == in_size);
+			if (in_vdisk == NULL && fseeko(files->in, (off_t)in_pos, SEEK_SET) != 0) goto error_read;
+			return cnt;
+		}
+	}
+	if (in_vdisk != NULL) {
+		const uint64_t remain = in_size - in_pos;
+		int ret;
+
+		cnt = remain < len ? (size_t)remain : len;
+		ret = cnt ? vdisk_read(in_vdisk, in_pos, blk, cnt) : 0;
+		if (ret < 0) goto error_read;
+		*zero = ret;
+		in_pos += cnt;
+		*eof = (in_pos == in_size);
+		return cnt;
+	}
+	cnt = fread(blk, 1, len, files->in);
+	if (ferror(files->in)) goto error_read;
+	in_pos += cnt;
+	*eof = feof(files->in) || (in_free != NULL && in_pos == in_size);
+	return cnt;
+
+error_read:
+	fprintf(stderr, "Error reading %s\n", files->infile);
+	exit(EXIT_FAILURE);
+}
+
+/* Add an image file to the image pile database
+ * The image size, block count and data digest are returned in info */
 static int input_image(const struct files_t * const restrict files,
-		uint32_t start_offset)
+		uint32_t start_offset, struct catalog_entry * const restrict info)
 {
 	const uint32_t z = B_SIZE;
 	char blk[B_SIZE];
 	size_t cnt = 1;
 	off_t size = 1, temp;
+	uint64_t zdone, ztotal;
+	uint32_t zero_offset = UINT32_MAX;
+	int zero, eof = 0;
 
 	DLOG("input_image\n");
+	memset(info, 0, sizeof(struct catalog_entry));
 	/* Output magic number and first/last sector offsets */
 	fwrite("IPIL", 4, 1, files->out);
 	fwrite(&start_offset, 4, 1, files->out);
 	fwrite(&z, 4, 1, files->out);
-	/* Set up status indicator */
-	if (files->in != stdin) {
+	/* Set up status indicator; compressed input reports compressed bytes */
+	if (in_vdisk != NULL) {
+		size = (off_t)(in_size / 100);
+		if (size == 0) size = 1;
+	} else if (decomp_progress(files->in, &zdone, &ztotal) == 0) {
+		size = (off_t)ztotal / 100;
+		if (size == 0) size = 1;
+	} else if (files->in != stdin) {
 		temp = ftello(files->in);
 		fseeko(files->in, 0, SEEK_END);
 		size = ftello(files->in);
 		fseeko(files->in, temp, SEEK_SET);
 		size /= 100;	/* Get 1% value */
+		if (size == 0) size = 1;
 	} else fprintf(stderr, "Reading from stdin; progress display unavailable\n");
 
 	/* Read entire input file and hash the blocks, padding if necessary */
@@ -313,15 +469,13 @@ static int input_image(const struct files_t * const restrict files,
 		uint32_t offset;
 		static off_t percent = 0;
 
-		if (start_offset > 0) cnt = fread(blk, 1, (B_SIZE - start_offset), files->in);
-		else cnt = fread(blk, 1, B_SIZE, files->in);
-		DLOG("fread() got %ju bytes\n", (uintmax_t)cnt);
-		if (ferror(files->in)) {
-			fprintf(stderr, "Error reading %s\n", files->infile);
-			exit(EXIT_FAILURE);
-		}
+		if (start_offset > 0) cnt = input_read(files, blk, (B_SIZE - start_offset), &zero, &eof);
+		else cnt = input_read(files, blk, B_SIZE, &zero, &eof);
+		DLOG("input_read() got %ju bytes\n", (uintmax_t)cnt);
 		if (files->in != stdin) {
-			temp = ftello(files->in);
+			if (in_vdisk != NULL) temp = (off_t)in_pos;
+			else if (decomp_progress(files->in, &zdone, &ztotal) == 0) temp = (off_t)zdone;
+			else temp = ftello(files->in);
 			temp /= size;
 			if (temp > percent) {
 				fprintf(stderr, "\r%u%% complete (%jd hash fails) ",
@@ -332,6 +486,9 @@ static int input_image(const struct files_t * const restrict files,
 		
 		/* Stop processing if no data was read */
 		if (cnt == 0) break;
+		info->size += cnt;
+		info->blocks++;
+		info->digest = jody_block_hash((const jodyhash_t *)blk, info->digest, cnt);
 		/* If read is not B_SIZE long, pad remaining data
 		 * Some images have stray data at the end; we pad that data
 		 * with zeroes and store it as a B_SIZE block. */
@@ -339,7 +496,7 @@ static int input_image(const struct files_t * const restrict files,
 			DLOG("Stopping: read count %ju < %d\n", (uintmax_t)cnt, B_SIZE);
 			memset((blk + cnt), 0, (B_SIZE - cnt));
 			/* Write size of final sector(s) and quit */
-			if (feof(files->in)) {
+			if (eof) {
 				/* Output final offset */
 				offset = get_block_offset(blk, files);
 				fwrite(&offset, sizeof(offset), 1, files->out);
@@ -354,12 +511,16 @@ static int input_image(const struct files_t * const restrict files,
 		}
 		/* Handle any start_offset */
 		start_offset = 0;
-		offset = get_block_offset(blk, files);
+		/* Unallocated container blocks all share the zero block */
+		if (zero) {
+			if (zero_offset == UINT32_MAX) zero_offset = get_block_offset(blk, files);
+			offset = zero_offset;
+		} else offset = get_block_offset(blk, files);
 
 		/* Output offset to image file */
 		fwrite(&offset, sizeof(offset), 1, files->out);
 
-		if (feof(files->in)) break;
+		if (eof) break;
 	}
 
 	if (files->in != stdin) fprintf(stderr, "\n");	/* Compensate for status indicator */
@@ -374,20 +535,35 @@ static int output_original(const struct files_t * const restrict files)
 	uint32_t start_offset, end_size;
 	char blk[B_SIZE];
 	char data[B_SIZE];
+	const char *src;
 	uint32_t *p;
 	off_t size = 1, temp;
+	struct ipil_t tree;
+	size_t tree_pos = 0;
+	int is_tree = 0, last;
 
 	DLOG("output_original\n");
 	/* Verify magic number at start of file */
 	i = fread(blk, 1, HDR_SIZE, files->in);
 	if (i != HDR_SIZE) goto error_in;
-	if (strncmp(blk, "IPIL", 4)) {
+	if (!strncmp(blk, "IPIT", 4)) {
+		/* Tree images are expanded from the pile up front */
+		if (files->in == stdin) {
+			fprintf(stderr, "Error: tree image files cannot be read from stdin\n");
+			exit(EXIT_FAILURE);
+		}
+		if (ipil_open(files->infile, &tree) != 0) exit(EXIT_FAILURE);
+		is_tree = 1;
+	} else if (strncmp(blk, "IPIL", 4)) {
 		fprintf(stderr, "Error: bad magic number at start of %s\n", files->infile);
 		exit(EXIT_FAILURE);
 	}
 
 	/* Set up status indicator */
-	if (files->in != stdin) {
+	if (is_tree) {
+		size = (off_t)tree.count / 100;
+		if (size == 0) size = 1;
+	} else if (files->in != stdin) {
 		temp = ftello(files->in);
 		fseeko(files->in, 0, SEEK_END);
 		size = ftello(files->in);
@@ -404,14 +580,26 @@ static int output_original(const struct files_t * const restrict files)
 	if (end_size > B_SIZE) goto error_endsize;
 
 	/* Read image file and write out original data */
-	while((i = fread(blk, 4, (B_SIZE / 4), files->in))) {
+	while (1) {
 		off_t offset;
 		static off_t percent = 0;
 
+		if (is_tree) {
+			i = tree.count - tree_pos;
+			if (i > (B_SIZE / 4)) i = B_SIZE / 4;
+			memcpy(blk, tree.offsets + tree_pos, i * sizeof(uint32_t));
+			tree_pos += i;
+			last = (tree_pos == tree.count);
+		} else {
+			i = fread(blk, 4, (B_SIZE / 4), files->in);
+			last = feof(files->in);
+		}
+		if (i == 0) break;
+
 		/* Iterate through block of offsets */
 		if (ferror(files->in)) goto error_in;
 		if (files->in != stdin) {
-			temp = ftello(files->in);
+			temp = is_tree ? (off_t)tree_pos : ftello(files->in);
 			temp /= size;
 			if (temp > percent) {
 				fprintf(stderr, "\r%u%% complete", (unsigned int)temp);
@@ -422,25 +610,29 @@ static int output_original(const struct files_t * const restrict files)
 		/* TODO: Queue, reschedule, and merge reads to minimize seeking */
 		while (i > 0) {
 			/* Read the data block specified by the offset */
-			offset = (off_t)(B_SIZE * (off_t)*p);
-			DLOG("seeking to block %jd\n", offset);
-			if (fseeko(files->db, offset, SEEK_SET)) goto error_db;
-			DLOG("reading a block\n");
-			if (!fread(data, B_SIZE, 1, files->db)) goto error_db;
-			if (ferror(files->db)) goto error_db;
+			src = (const char *)hotcache_get((off_t)*p);
+			if (src == NULL) {
+				offset = (off_t)(B_SIZE * (off_t)*p);
+				DLOG("seeking to block %jd\n", offset);
+				if (fseeko(files->db, offset, SEEK_SET)) goto error_db;
+				DLOG("reading a block\n");
+				if (!fread(data, B_SIZE, 1, files->db)) goto error_db;
+				if (ferror(files->db)) goto error_db;
+				src = data;
+			}
 
 			/* Handle the last block */
-			if ((i == 1) && feof(files->in)) {
+			if ((i == 1) && last) {
 				DLOG("writing final block of size %jd\n", (intmax_t)end_size);
-				w = fwrite(data, 1, end_size, files->out);
+				w = fwrite(src, 1, end_size, files->out);
 				written += w;
 				break;
 			}
 			/* Write data block, compensating for any offset */
 			if (start_offset > 0) {
-				w = fwrite(data, 1, (B_SIZE - start_offset), files->out);
+				w = fwrite(src, 1, (B_SIZE - start_offset), files->out);
 				start_offset = 0;
-			} else w = fwrite(data, 1, B_SIZE, files->out);
+			} else w = fwrite(src, 1, B_SIZE, files->out);
 			if (ferror(files->out)) goto error_out;
 			written += w;
 
@@ -449,6 +641,7 @@ static int output_original(const struct files_t * const restrict files)
 		}
 	}
 
+	if (is_tree) ipil_close(&tree);
 	if (files->in != stdin) fprintf(stderr, "\n");	/* Compensate for status indicator */
 	return 0;
 
@@ -472,27 +665,101 @@ error_endsize:
 }
 
 
+/* Open the DB hash index and read it into the in-memory hash table
+ * Returns the number of hashes read */
+extern off_t load_hash_index(struct files_t * const restrict files)
+{
+	jodyhash_t hashes[B_SIZE / sizeof(jodyhash_t)];
+	struct hash_leaf **start;
+	struct hash_leaf *leaf;
+	off_t hashcount = 0;
+	size_t i, offset;
+
+	/* Initialize hash leaves */
+	leaf = (struct hash_leaf *)malloc(sizeof(struct hash_leaf) * 65536);
+	if (!leaf) goto oom;
+	start = &hash_top[0];
+	for (i=0; i < 65536; i++) {
+		*start = leaf;
+		leaf->entries = 0;
+		leaf->next = NULL;
+		start++;
+		leaf++;
+	}
+
+	/* Open DB hash index and read it in */
+	if (!(files->hashindex = fopen(files->indexfile, "a+b"))) {
+		fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	while ((i = fread(hashes, sizeof(jodyhash_t), (B_SIZE / sizeof(jodyhash_t)), files->hashindex))) {
+		if (ferror(files->hashindex)) {
+			fprintf(stderr, "Error: can't read index: %s\n", files->indexfile);
+			exit(EXIT_FAILURE);
+		}
+		/* Add each B_SIZE wide block of hashes to the in-memory hash index */
+		offset = 0;
+		while (offset < i) {
+			index_hash(hashes[offset], hashcount, 0, files);
+			offset++;
+			hashcount++;
+		}
+	}
+	fprintf(stderr, "Read in %jd hashes from hash index\n", (intmax_t)hashcount);
+	return hashcount;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Verbs implemented outside of the basic add/read path */
+static const struct verb_t {
+	const char *name;
+	int (*func)(struct files_t * const restrict files, int argc, char **argv);
+} verbs[] = {
+	{ "export-pack", pack_export },
+	{ "import-pack", pack_import },
+	{ "sync", sync_pile },
+	{ "replicate", replicate_pile },
+	{ "merge", merge_pile },
+	{ "backup", backup_pile },
+	{ "restore-backup", restore_backup },
+	{ "list", catalog_list },
+	{ "delete", catalog_delete_verb },
+	{ "compact", compact_images },
+	{ "merkle", merkle_verb },
+	{ "diff", diff_verb },
+	{ "read-range", read_range_verb },
+	{ "serve-nbd", serve_nbd },
+	{ "clone", clone_image },
+	{ "splice", splice_image },
+	{ NULL, NULL }
+};
+
+
 int main(int argc, char **argv)
 {
 	struct files_t file_vars;
 	struct files_t * const restrict files = &file_vars;
-	char blk[B_SIZE];
+	const struct verb_t *verb;
+	struct catalog_entry info;
 	char path[PATH_MAX + 1];
 	size_t i;
 	char *p;
-	int hashcount = 0;
-	struct hash_leaf **start;
-	struct hash_leaf *leaf;
 	uint32_t start_offset = 0;
-	size_t offset = 0;
+	int skip_free = 0, raw = 0;
 #ifndef NO_SIGACTION
 	struct sigaction act;
 #endif
 
 	fprintf(stderr, "Imagepile disk image database utility %s (%s)\n", VER, VERDATE);
 	/* Handle arguments */
-	if (argc < 4) goto usage;
+	if (argc < 2 || (argc < 3 && strcmp(argv[1], "list"))) goto usage;
+	memset(files, 0, sizeof(struct files_t));
 	if ((p = getenv("IMGDIR"))) {
+		strncpy(files->imgdir, p, PATH_MAX);
 		strncpy(path, p, PATH_MAX);
 		strncat(path, "/imagepile.db", PATH_MAX);
 		strncpy(files->dbfile, path, PATH_MAX);
@@ -503,17 +770,6 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Error: IMGDIR environment variable not set\n");
 		exit(EXIT_FAILURE);
 	}
-	strncpy(files->infile, argv[argc - 2], PATH_MAX);
-	strncpy(files->outfile, argv[argc - 1], PATH_MAX);
-
-	DLOG("Using: db %s, idx %s,\nin %s, out %s\n",
-			files->dbfile, files->indexfile,
-			files->infile, files->outfile);
-
-	if (!strncmp(files->infile, files->outfile, PATH_MAX)) {
-		fprintf(stderr, "Input and output files must be different. Aborting.\n");
-		exit(EXIT_FAILURE);
-	}
 
 #ifndef NO_SIGACTION
 	/* Set up signal handler */
@@ -531,6 +787,58 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	/* Tree image files are expanded from this DB */
+	ipil_set_db(fileno(files->db));
+
+	/* Optionally pin the most-referenced blocks in memory */
+	if ((p = getenv("IMGHOTCACHE"))) {
+		char *check;
+		errno = 0;
+		i = (size_t)strtoul(p, &check, 10);
+		if (errno || (check == p)) {
+			fprintf(stderr, "Error: IMGHOTCACHE must be a number of blocks\n");
+			exit(EXIT_FAILURE);
+		}
+		hotcache_init(files, i);
+	}
+
+	/* Verbs with their own argument handling */
+	for (verb = verbs; verb->name != NULL; verb++) {
+		if (strcmp(argv[1], verb->name)) continue;
+		if (verb->func(files, argc - 2, argv + 2) != 0) goto usage;
+		goto finish;
+	}
+
+	/* Restore modes that write in place */
+	if (!strcmp(argv[1], "read") && !strncmp(argv[2], "--", 2)) {
+		if (restore_read(files, argc - 2, argv + 2) != 0) goto usage;
+		goto finish;
+	}
+
+	/* add --skip-free: store filesystem free space as zeroes
+	 * add --raw: store the input bytes as-is, never decoding it */
+	while (!strcmp(argv[1], "add") && argc > 2) {
+		if (!strcmp(argv[2], "--skip-free")) skip_free = 1;
+		else if (!strcmp(argv[2], "--raw")) raw = 1;
+		else break;
+		argv[2] = argv[1];
+		argv++;
+		argc--;
+	}
+
+	if (argc < 4) goto usage;
+	strncpy(files->infile, argv[argc - 2], PATH_MAX);
+	strncpy(files->outfile, argv[argc - 1], PATH_MAX);
+
+	DLOG("Using: db %s, idx %s,\nin %s, out %s\n",
+			files->dbfile, files->indexfile,
+			files->infile, files->outfile);
+
+	if (!strncmp(files->infile, files->outfile, PATH_MAX)) {
+		fprintf(stderr, "Input and output files must be different. Aborting.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	/* Open input file */
 	if (!strncmp(files->infile, "-", PATH_MAX)) {
 		/* fprintf(stderr, "Reading from stdin\n"); */
@@ -538,6 +846,15 @@ int main(int argc, char **argv)
 		_setmode(_fileno(stdin), _O_BINARY);
 #endif
 		files->in = stdin;
+	} else if (!strncmp(argv[1], "add", PATH_MAX) && !raw) {
+		/* Virtual disk containers are read through their allocation
+		 * tables; compressed images are decoded on the fly */
+		in_vdisk = vdisk_open(files->infile);
+		if (!(files->in = in_vdisk ? fopen(files->infile, "rb") : decomp_open(files->infile))) {
+			fprintf(stderr, "Error: cannot open infile: %s\n", files->infile);
+			exit(EXIT_FAILURE);
+		}
+		if (in_vdisk != NULL) in_size = vdisk_size(in_vdisk);
 	} else if (!(files->in = fopen(files->infile, "rb"))) {
 		fprintf(stderr, "Error: cannot open infile: %s\n", files->infile);
 		exit(EXIT_FAILURE);
@@ -562,39 +879,29 @@ int main(int argc, char **argv)
 			if (start_offset >= B_SIZE) goto usage;
 		}
 
-		/* Initialize hash leaves */
-		leaf = (struct hash_leaf *)malloc(sizeof(struct hash_leaf) * 65536);
-		if (!leaf) goto oom;
-		start = &hash_top[0];
-		for (i=0; i < 65536; i++) {
-			*start = leaf;
-			leaf->entries = 0;
-			leaf->next = NULL;
-			start++;
-			leaf++;
-		}
+		/* Free space is found by reading filesystem metadata in place */
+		if (skip_free) {
+			struct stat st;
+			uint64_t zdone, ztotal;
 
-		/* Open DB hash index and read it in */
-		if (!(files->hashindex = fopen(files->indexfile, "a+b"))) {
-			fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
-			exit(EXIT_FAILURE);
-		}
-		while ((i = fread(blk, sizeof(jodyhash_t), (B_SIZE / sizeof(jodyhash_t)), files->hashindex))) {
-			if (ferror(files->hashindex)) {
-				fprintf(stderr, "Error: can't read index: %s\n", files->indexfile);
+			if (files->in == stdin || decomp_progress(files->in, &zdone, &ztotal) == 0) {
+				fprintf(stderr, "Error: --skip-free needs an uncompressed image or virtual disk file\n");
 				exit(EXIT_FAILURE);
 			}
-			/* Add each B_SIZE wide block of hashes to the in-memory hash index */
-			offset = 0;
-			while (offset < i) {
-				index_hash((jodyhash_t)*((jodyhash_t *)blk + offset), hashcount, 0, files);
-				offset++;
-				hashcount++;
+			if (in_vdisk == NULL) {
+				if (fstat(fileno(files->in), &st) != 0 || !S_ISREG(st.st_mode)) {
+					fprintf(stderr, "Error: --skip-free needs a regular input file\n");
+					exit(EXIT_FAILURE);
+				}
+				in_size = (uint64_t)st.st_size;
 			}
+			in_free = fsfree_scan(read_input_at, files);
 		}
-		fprintf(stderr, "Read in %d hashes from hash index\n", hashcount);
-	
-		input_image(files, start_offset);
+
+		load_hash_index(files);
+		input_image(files, start_offset, &info);
+		fsfree_close(in_free);
+		vdisk_close(in_vdisk);
 		fflush(files->hashindex);
 		fclose(files->hashindex);
 		/* Output final statistics */
@@ -606,21 +913,28 @@ int main(int argc, char **argv)
 		output_original(files);
 	} else goto usage;
 
-	fflush(files->db);
 	fflush(files->in);
 	fflush(files->out);
+	decomp_close(files->in);
+	if (fclose(files->out) != 0) {
+		fprintf(stderr, "Error writing %s\n", files->outfile);
+		exit(EXIT_FAILURE);
+	}
 
-	fclose(files->in);
-	fclose(files->out);
+	/* Record new images in the catalog once they are completely written */
+	if (!strncmp(argv[1], "add", PATH_MAX) && files->out != stdout)
+		catalog_add(files->imgdir, files->outfile, &info, NULL);
+
+finish:
+	if (stats_hotcache_hits > 0)
+		fprintf(stderr, "Hot cache: %ju block reads absorbed\n", (uintmax_t)stats_hotcache_hits);
+	hotcache_free();
+
+	fflush(files->db);
 	fclose(files->db);
 
 	exit(EXIT_SUCCESS);
 
-oom:
-	/* If any malloc() fails, end up here. */
-	fprintf(stderr, "Error: out of memory\n");
-	exit(EXIT_FAILURE);
-
 #ifndef NO_SIGACTION
 signal_error:
 	fprintf(stderr, "Cannot catch signals, aborting.\n");
@@ -630,8 +944,62 @@ signal_error:
 usage:
 	fprintf(stderr, "\nSpecify a verb and file (use - for stdin/stdout). List of verbs:\n\n");
 	fprintf(stderr, "   add <offset> input_file image_file  - Add to database, produce image_file\n");
-	fprintf(stderr, "         ^-- offset in bytes to shorten the first block (DOS/2K/XP compat)\n\n");
+	fprintf(stderr, "         ^-- offset in bytes to shorten the first block (DOS/2K/XP compat)\n");
+	fprintf(stderr, "   add --skip-free <offset> input_file image_file - Store NTFS/ext free space\n");
+	fprintf(stderr, "         as zeroes instead of its stale contents (discards deleted data)\n\n");
+	fprintf(stderr, "   add --raw <offset> input_file image_file - Store the input file byte for\n");
+	fprintf(stderr, "         byte without decompressing it or decoding virtual disk containers\n\n");
 	fprintf(stderr, "   read image_file output_file - Read original data for image_file\n\n");
-	fprintf(stderr, "The IMGDIR environment variable determines where the image pile is located\n\n");
+	fprintf(stderr, "   read --base base_image image_file target - Restore onto a target that\n");
+	fprintf(stderr, "         holds base_image, writing only the blocks that differ\n\n");
+	fprintf(stderr, "   read --direct image_file target - Restore with large O_DIRECT writes that\n");
+	fprintf(stderr, "         bypass the page cache (for raw disks)\n\n");
+	fprintf(stderr, "   read --compare image_file target - Restore onto a target with unknown\n");
+	fprintf(stderr, "         contents, writing only blocks whose hashes don't match\n\n");
+	fprintf(stderr, "   read --partition N image_file output_file - Extract only partition N\n");
+	fprintf(stderr, "         (MBR or GPT numbering as on Linux) from a disk image\n\n");
+	fprintf(stderr, "   read --fanout image_file target... - Restore one image to many targets\n");
+	fprintf(stderr, "         at once, reading each DB block only once\n\n");
+	fprintf(stderr, "   read --batch image_file target [image_file target]... - Restore several\n");
+	fprintf(stderr, "         images at once, sharing reads of the DB blocks they have in common\n\n");
+	fprintf(stderr, "   read --qcow2|--vhdx image_file output_file - Restore into a sparse\n");
+	fprintf(stderr, "         QCOW2 or dynamic VHDX file with zero regions left unallocated\n\n");
+	fprintf(stderr, "   read --zstd|--gzip [-T threads] [-L level] image_file output_file\n");
+	fprintf(stderr, "         Restore as a compressed stream, compressing frames in parallel\n\n");
+	fprintf(stderr, "   read-range image_file offset length output_file - Read only the given\n");
+	fprintf(stderr, "         byte range of the original data (K/M/G/T suffixes allowed)\n\n");
+	fprintf(stderr, "   serve-nbd image_file --socket path [--cache blocks] [--overlay new_image]\n");
+	fprintf(stderr, "         - Export the image over NBD on a Unix socket until interrupted;\n");
+	fprintf(stderr, "         read-only unless --overlay saves writes as a thin clone\n\n");
+	fprintf(stderr, "   clone source_image new_image - Copy (or reflink) an image file\n\n");
+	fprintf(stderr, "   splice base_image new_image dst_offset source_image src_offset length\n");
+	fprintf(stderr, "   splice base_image new_image --partition N source_image\n");
+	fprintf(stderr, "         - Make a new image from base_image with a byte range (or partition)\n");
+	fprintf(stderr, "         replaced from source_image by editing offsets, not moving data\n\n");
+	fprintf(stderr, "   export-pack image_file... > pack_file - Write the listed images and only\n");
+	fprintf(stderr, "         the blocks they use to stdout as a self-contained pack\n\n");
+	fprintf(stderr, "   import-pack pack_file dest_dir - Add a pack's blocks to the database and\n");
+	fprintf(stderr, "         write its image files into dest_dir\n\n");
+	fprintf(stderr, "   sync dest_dir image_file... - Copy images to the pile in dest_dir,\n");
+	fprintf(stderr, "         sending only blocks that the destination does not have\n\n");
+	fprintf(stderr, "   replicate [--follow] [--interval secs] replica_dir - Copy data appended\n");
+	fprintf(stderr, "         to the pile since the last pass; --follow keeps watching\n\n");
+	fprintf(stderr, "   merge [--threads N] pile_dir out_dir [image_file...] - Fold the pile in\n");
+	fprintf(stderr, "         pile_dir into this one, writing its remapped images to out_dir\n\n");
+	fprintf(stderr, "   backup [--since old_mark] new_mark backup_file - Back up the pile, or\n");
+	fprintf(stderr, "         only what changed since old_mark; new_mark records this point\n\n");
+	fprintf(stderr, "   restore-backup base_file [increment_file...] - Rebuild a pile from a\n");
+	fprintf(stderr, "         base backup and its increments, applied in order\n\n");
+	fprintf(stderr, "   list [name_prefix] - List cataloged images, optionally by name prefix\n\n");
+	fprintf(stderr, "   delete image_file... - Delete images and remove them from the catalog\n\n");
+	fprintf(stderr, "   compact [--flat] image_file... - Store image offset lists in the pile\n");
+	fprintf(stderr, "         as shared chunks; --flat converts them back to plain files\n\n");
+	fprintf(stderr, "   merkle build image_file... - Build Merkle trees over image offset lists\n");
+	fprintf(stderr, "   merkle diff image_a image_b - Print changed block ranges using the trees\n");
+	fprintf(stderr, "   merkle verify image_file [first_block [count]] - Check part of an image\n\n");
+	fprintf(stderr, "   diff [--json | --binary] image_a image_b - Print the ranges of image\n");
+	fprintf(stderr, "         blocks that differ between two images\n\n");
+	fprintf(stderr, "The IMGDIR environment variable determines where the image pile is located\n");
+	fprintf(stderr, "Set IMGHOTCACHE to a block count to pin the most-referenced blocks in RAM\n\n");
 	exit(EXIT_FAILURE);
 }
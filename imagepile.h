@@ -11,6 +11,7 @@ extern "C" {
 #include <stdio.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/types.h>
 #include "jody_hash.h"
 
 #define VER "0.1"
@@ -46,6 +47,7 @@ typedef uint16_t hash_head_t;
 
 /* Master block database */
 struct files_t {
+	char imgdir[PATH_MAX];
 	char dbfile[PATH_MAX];
 	FILE * restrict db;
 	char indexfile[PATH_MAX];
@@ -69,6 +71,22 @@ struct hash_leaf {
 	struct hash_node node[HASH_ALLOC_SIZE];
 };
 
+/* Statistics and global hash prefix starting array */
+extern uint64_t stats_total_searches;
+extern uint64_t stats_hash_failures;
+extern struct hash_leaf *hash_top[65536];
+
+extern int index_hash(const jodyhash_t hash, const off_t offset, const int write,
+		const struct files_t * const restrict files);
+extern off_t load_hash_index(struct files_t * const restrict files);
+extern uint32_t get_block_offset(const void * const restrict blk,
+		const struct files_t * const restrict files);
+extern int read_db_block(void * const restrict blk,
+		const off_t offset, const struct files_t * const restrict files);
+extern int read_db_run(void * const restrict buf, const off_t offset,
+		const size_t count, const struct files_t * const restrict files);
+extern off_t db_block_count(const struct files_t * const restrict files);
+
 #ifdef __cplusplus
 }
 #endif
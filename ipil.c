@@ -0,0 +1,498 @@
+/*
+ * Image (.ipil) file access
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * The sequential "read" path streams an image file, but most other
+ * operations need random access to the whole offset list. This maps
+ * an image file into memory (or reads it in where mmap() is not
+ * available) and exposes the header values and offset array. Tree
+ * images are expanded by walking their offset chunks in the pile's DB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "ipil.h"
+
+#if defined _WIN32 || defined __CYGWIN__
+ #define NO_MMAP 1
+#else
+ #include <sys/mman.h>
+#endif
+
+/* DB used to expand tree images opened with ipil_open() */
+static int ipil_db_fd = -1;
+
+
+/* Set the DB that ipil_open() reads tree chunks from */
+extern void ipil_set_db(const int db_fd)
+{
+	ipil_db_fd = db_fd;
+	return;
+}
+
+
+/* Read count chunks into out, one level down the tree. All chunk reads
+ * are announced to the kernel first so they can be fetched in parallel. */
+static int ipil_read_chunks(const int db_fd, const uint32_t * const restrict chunks,
+		const size_t count, uint32_t * const restrict out, const size_t out_count,
+		uint32_t * const restrict meta_max)
+{
+	size_t i;
+
+#ifdef POSIX_FADV_WILLNEED
+	for (i = 0; i < count; i++) {
+		size_t run = 1;
+		while (i + run < count && chunks[i + run] == chunks[i] + run) run++;
+		posix_fadvise(db_fd, (off_t)chunks[i] * B_SIZE, (off_t)run * B_SIZE, POSIX_FADV_WILLNEED);
+		i += run - 1;
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		uint32_t buf[IPIL_FANOUT];
+		size_t n = out_count - (i * IPIL_FANOUT), done = 0;
+
+		if (n > IPIL_FANOUT) n = IPIL_FANOUT;
+		while (done < B_SIZE) {
+			const ssize_t r = pread(db_fd, (char *)buf + done, B_SIZE - done,
+					((off_t)chunks[i] * B_SIZE) + (off_t)done);
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR) continue;
+				return -1;
+			}
+			done += (size_t)r;
+		}
+		memcpy(out + (i * IPIL_FANOUT), buf, n * sizeof(uint32_t));
+		if (chunks[i] > *meta_max) *meta_max = chunks[i];
+	}
+	return 0;
+}
+
+
+/* Expand a mapped tree image into a malloc()ed offset list */
+static int ipil_expand_tree(const int db_fd, struct ipil_t * const restrict ip,
+		const size_t maplen)
+{
+	const uint32_t *hdr = (const uint32_t *)ip->map;
+	size_t levels[33];
+	uint32_t *cur, *next;
+	uint64_t count;
+	uint32_t d;
+
+	memcpy(&count, (const char *)ip->map + 16, sizeof(uint64_t));
+	ip->depth = hdr[3];
+	if (ip->depth < 1 || ip->depth > 32 || count > SIZE_MAX / sizeof(uint32_t)) return -1;
+
+	/* Entries at each level, from the data offsets up to the root */
+	levels[0] = (size_t)count;
+	for (d = 1; d <= ip->depth; d++)
+		levels[d] = (levels[d - 1] + IPIL_FANOUT - 1) / IPIL_FANOUT;
+	if (levels[ip->depth] != (maplen - IPIT_HDR_SIZE) / sizeof(uint32_t)) return -1;
+
+	cur = (uint32_t *)malloc((levels[ip->depth] + 1) * sizeof(uint32_t));
+	if (cur == NULL) goto oom;
+	memcpy(cur, hdr + (IPIT_HDR_SIZE / sizeof(uint32_t)), levels[ip->depth] * sizeof(uint32_t));
+	for (d = ip->depth; d > 0; d--) {
+		next = (uint32_t *)malloc((levels[d] * IPIL_FANOUT + 1) * sizeof(uint32_t));
+		if (next == NULL) goto oom;
+		if (ipil_read_chunks(db_fd, cur, levels[d], next, levels[d - 1], &ip->meta_max) != 0) {
+			free(cur);
+			free(next);
+			return -1;
+		}
+		free(cur);
+		cur = next;
+	}
+
+#ifndef NO_MMAP
+	munmap(ip->map, ip->maplen);
+#else
+	free(ip->map);
+#endif
+	ip->map = cur;
+	ip->maplen = 0;
+	ip->offsets = cur;
+	ip->count = levels[0];
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Open an image file and load its header and offset list
+ * Returns 0 on success, -1 on failure (with an error printed) */
+extern int ipil_open(const char * const restrict path,
+		struct ipil_t * const restrict ip)
+{
+	return ipil_open_db(path, ipil_db_fd, ip);
+}
+
+
+/* Open an image file whose tree chunks (if any) live in the DB at db_fd */
+extern int ipil_open_db(const char * const restrict path, const int db_fd,
+		struct ipil_t * const restrict ip)
+{
+	struct stat st;
+	const uint32_t *hdr;
+	int fd;
+
+	memset(ip, 0, sizeof(struct ipil_t));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) goto error_open;
+	if (fstat(fd, &st) != 0) goto error_read;
+	if (st.st_size < HDR_SIZE || (((size_t)st.st_size - HDR_SIZE) % sizeof(uint32_t))) goto error_size;
+
+#ifndef NO_MMAP
+	ip->maplen = (size_t)st.st_size;
+	ip->map = mmap(NULL, ip->maplen, PROT_READ, MAP_SHARED, fd, 0);
+	if (ip->map == MAP_FAILED) {
+		ip->map = NULL;
+		goto error_read;
+	}
+	madvise(ip->map, ip->maplen, MADV_SEQUENTIAL);
+#else
+	ip->map = malloc((size_t)st.st_size);
+	if (ip->map == NULL) goto error_read;
+	if (read(fd, ip->map, (size_t)st.st_size) != (ssize_t)st.st_size) goto error_read;
+#endif
+	close(fd);
+	fd = -1;
+
+	hdr = (const uint32_t *)ip->map;
+	if (memcmp(hdr, "IPIL", 4) && memcmp(hdr, "IPIT", 4)) goto error_magic;
+	ip->start_offset = hdr[1];
+	ip->end_size = hdr[2];
+	if (ip->start_offset >= B_SIZE || ip->end_size > B_SIZE) goto error_magic;
+	if (!memcmp(hdr, "IPIT", 4)) {
+		if (db_fd < 0) goto error_tree;
+		if (st.st_size < IPIT_HDR_SIZE) goto error_magic;
+		if (ipil_expand_tree(db_fd, ip, (size_t)st.st_size) != 0) goto error_tree;
+		return 0;
+	}
+	ip->count = (size_t)(st.st_size - HDR_SIZE) / sizeof(uint32_t);
+	ip->offsets = hdr + (HDR_SIZE / sizeof(uint32_t));
+	return 0;
+
+error_open:
+	fprintf(stderr, "Error: cannot open image file: %s\n", path);
+	return -1;
+error_read:
+	fprintf(stderr, "Error reading %s\n", path);
+	if (fd >= 0) close(fd);
+	ipil_close(ip);
+	return -1;
+error_size:
+	fprintf(stderr, "Error: %s is not a valid image file\n", path);
+	close(fd);
+	return -1;
+error_magic:
+	fprintf(stderr, "Error: bad magic number or header at start of %s\n", path);
+	ipil_close(ip);
+	return -1;
+error_tree:
+	fprintf(stderr, "Error: cannot expand tree image %s from its pile\n", path);
+	ipil_close(ip);
+	return -1;
+}
+
+
+/* Release an image file loaded by ipil_open() */
+extern void ipil_close(struct ipil_t * const restrict ip)
+{
+	if (ip->map == NULL) return;
+#ifndef NO_MMAP
+	if (ip->maplen > 0) munmap(ip->map, ip->maplen);
+	else free(ip->map);
+#else
+	free(ip->map);
+#endif
+	memset(ip, 0, sizeof(struct ipil_t));
+	return;
+}
+
+
+/* Build a list of full paths to all image files in a directory
+ * Returns 0 on success, -1 if the directory cannot be read */
+extern int ipil_scan_dir(const char * const restrict dir,
+		char *** const restrict list, size_t * const restrict count)
+{
+	DIR *d;
+	struct dirent *de;
+	char **names = NULL;
+	size_t n = 0, alloc = 0;
+
+	*list = NULL;
+	*count = 0;
+	if (!(d = opendir(dir))) {
+		fprintf(stderr, "Error: cannot read directory: %s\n", dir);
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+		char *path;
+
+		if (len < 6 || strcmp(de->d_name + len - 5, ".ipil")) continue;
+		if (n == alloc) {
+			char **tmp;
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = (char **)realloc(names, alloc * sizeof(char *));
+			if (tmp == NULL) goto oom;
+			names = tmp;
+		}
+		path = (char *)malloc(strlen(dir) + len + 2);
+		if (path == NULL) goto oom;
+		sprintf(path, "%s/%s", dir, de->d_name);
+		names[n++] = path;
+	}
+	closedir(d);
+	*list = names;
+	*count = n;
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Size in bytes of the original data an image reconstructs to */
+extern uint64_t ipil_image_size(const struct ipil_t * const restrict ip)
+{
+	if (ip->count == 0) return 0;
+	if (ip->count == 1) return ip->end_size;
+	return ((uint64_t)(ip->count - 1) * B_SIZE) - ip->start_offset + ip->end_size;
+}
+
+
+/* Byte position in the original data where image block "block" starts */
+extern uint64_t ipil_block_pos(const struct ipil_t * const restrict ip, const uint64_t block)
+{
+	if (block == 0) return 0;
+	return (block * B_SIZE) - ip->start_offset;
+}
+
+
+/* Number of bytes of original data held by image block "block"; they
+ * are always the first bytes of the DB block */
+extern uint32_t ipil_block_len(const struct ipil_t * const restrict ip, const uint64_t block)
+{
+	if (block + 1 == ip->count) return ip->end_size;
+	if (block == 0) return B_SIZE - ip->start_offset;
+	return B_SIZE;
+}
+
+
+/* Remove leading directories from an image file path */
+extern const char *ipil_base_name(const char * const restrict path)
+{
+	const char *p = strrchr(path, '/');
+	return p ? p + 1 : path;
+}
+
+
+/* Free a list returned by ipil_scan_dir() */
+extern void ipil_free_list(char ** const restrict list, const size_t count)
+{
+	size_t i;
+
+	if (list == NULL) return;
+	for (i = 0; i < count; i++) free(list[i]);
+	free(list);
+	return;
+}
+
+
+/* Build the sorted list of unique DB blocks referenced by a set of images
+ * The caller must free() the list; *refs receives the total reference count */
+extern uint32_t *ipil_collect_blocks(const struct ipil_t * const restrict images,
+		const size_t image_count, const off_t db_blocks,
+		size_t * const restrict count, uint64_t * const restrict refs)
+{
+	uint64_t *used;
+	uint32_t *blocks;
+	size_t i, j, n = 0;
+
+	*refs = 0;
+	used = (uint64_t *)calloc(((size_t)db_blocks / 64) + 1, sizeof(uint64_t));
+	if (used == NULL) goto oom;
+	for (i = 0; i < image_count; i++) {
+		for (j = 0; j < images[i].count; j++) {
+			const uint32_t o = images[i].offsets[j];
+			if ((off_t)o >= db_blocks) {
+				fprintf(stderr, "Error: image references block %" PRIu32 " beyond end of DB\n", o);
+				exit(EXIT_FAILURE);
+			}
+			used[o / 64] |= (uint64_t)1 << (o % 64);
+			(*refs)++;
+		}
+	}
+
+	for (i = 0; i <= (size_t)db_blocks / 64; i++)
+		n += (size_t)__builtin_popcountll(used[i]);
+	blocks = (uint32_t *)malloc((n ? n : 1) * sizeof(uint32_t));
+	if (blocks == NULL) goto oom;
+	for (i = 0, j = 0; i < (size_t)db_blocks; i++)
+		if (used[i / 64] & ((uint64_t)1 << (i % 64))) blocks[j++] = (uint32_t)i;
+	free(used);
+	*count = n;
+	return blocks;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Return the index of offset in a sorted block list from ipil_collect_blocks() */
+extern size_t ipil_block_index(const uint32_t * const restrict blocks,
+		const size_t count, const uint32_t offset)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if (blocks[mid] < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+/* Write an image file from header values and an offset list
+ * The file is written under a temporary name and renamed into place */
+extern int ipil_write(const char * const restrict path,
+		const uint32_t start_offset, const uint32_t end_size,
+		const uint32_t * const restrict offsets, const size_t count)
+{
+	return ipil_write_remapped(path, start_offset, end_size, offsets, count, NULL, 0, NULL);
+}
+
+
+/* Write an image file, optionally translating each offset through a
+ * sorted block list (from ipil_collect_blocks()) and a parallel map;
+ * with no block list, map is indexed directly by the old offset */
+extern int ipil_write_remapped(const char * const restrict path,
+		const uint32_t start_offset, const uint32_t end_size,
+		const uint32_t * const restrict offsets, const size_t count,
+		const uint32_t * const restrict blocks, const size_t block_count,
+		const uint32_t * const restrict map)
+{
+	char tmp[PATH_MAX + 8];
+	uint32_t buf[B_SIZE / sizeof(uint32_t)];
+	FILE *out;
+	size_t i = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(out = fopen(tmp, "wb"))) {
+		fprintf(stderr, "Error: cannot open outfile: %s\n", tmp);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(buf, "IPIL", 4);
+	buf[1] = start_offset;
+	buf[2] = end_size;
+	if (fwrite(buf, 1, HDR_SIZE, out) != HDR_SIZE) goto error_write;
+	while (i < count) {
+		size_t k, n = count - i;
+		if (n > (B_SIZE / sizeof(uint32_t))) n = B_SIZE / sizeof(uint32_t);
+		for (k = 0; k < n; k++) {
+			if (map == NULL) buf[k] = offsets[i + k];
+			else if (blocks == NULL) buf[k] = map[offsets[i + k]];
+			else buf[k] = map[ipil_block_index(blocks, block_count, offsets[i + k])];
+		}
+		if (fwrite(buf, sizeof(uint32_t), n, out) != n) goto error_write;
+		i += n;
+	}
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0) goto error_write;
+	if (fclose(out) != 0) goto error_write;
+	if (rename(tmp, path) != 0) goto error_write;
+	return 0;
+
+error_write:
+	fprintf(stderr, "Error writing %s\n", path);
+	exit(EXIT_FAILURE);
+}
+
+
+/* Write an image file as a tree: the offset list is stored in the DB as
+ * chunks (deduplicated like data blocks) and only the top level of the
+ * tree goes into the file. The chunks are synced before the file is
+ * renamed into place. The hash index must be loaded. */
+extern int ipil_write_tree(const char * const restrict path,
+		const uint32_t start_offset, const uint32_t end_size,
+		const uint32_t * const restrict offsets, const size_t count,
+		const struct files_t * const restrict files)
+{
+	char tmp[PATH_MAX + 8];
+	uint32_t buf[IPIL_FANOUT];
+	uint32_t *level, *next;
+	uint64_t count64 = count;
+	uint32_t depth = 0;
+	size_t n = count, i;
+	FILE *out;
+
+	level = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+	if (level == NULL) goto oom;
+	memcpy(level, offsets, count * sizeof(uint32_t));
+	/* Store chunks level by level until the top fits in one chunk */
+	do {
+		const size_t chunks = (n + IPIL_FANOUT - 1) / IPIL_FANOUT;
+
+		next = (uint32_t *)malloc((chunks + 1) * sizeof(uint32_t));
+		if (next == NULL) goto oom;
+		for (i = 0; i < chunks; i++) {
+			size_t k = n - (i * IPIL_FANOUT);
+			if (k > IPIL_FANOUT) k = IPIL_FANOUT;
+			memset(buf, 0, sizeof(buf));
+			memcpy(buf, level + (i * IPIL_FANOUT), k * sizeof(uint32_t));
+			next[i] = get_block_offset(buf, files);
+		}
+		free(level);
+		level = next;
+		n = chunks;
+		depth++;
+	} while (n > IPIL_FANOUT);
+
+	if (fflush(files->db) != 0 || fsync(fileno(files->db)) != 0
+			|| fflush(files->hashindex) != 0 || fsync(fileno(files->hashindex)) != 0) {
+		fprintf(stderr, "Error: cannot sync %s\n", files->dbfile);
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(out = fopen(tmp, "wb"))) {
+		fprintf(stderr, "Error: cannot open outfile: %s\n", tmp);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(buf, "IPIT", 4);
+	buf[1] = start_offset;
+	buf[2] = end_size;
+	buf[3] = depth;
+	memcpy(buf + 4, &count64, sizeof(uint64_t));
+	if (fwrite(buf, 1, IPIT_HDR_SIZE, out) != IPIT_HDR_SIZE) goto error_write;
+	if (fwrite(level, sizeof(uint32_t), n, out) != n) goto error_write;
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0) goto error_write;
+	if (fclose(out) != 0) goto error_write;
+	if (rename(tmp, path) != 0) goto error_write;
+	free(level);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_write:
+	fprintf(stderr, "Error writing %s\n", path);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,78 @@
+/* Image (.ipil) file access headers
+ * See imagepile.c for copyright information */
+
+#ifndef IPIL_H
+#define IPIL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "imagepile.h"
+
+/*
+ * Tree image files store the offset list inside the pile itself, so the
+ * offset lists of similar images deduplicate like any other data:
+ * 0-3:   'IPIT' signature
+ * 4-7:   Truncate first block size (bytes)
+ * 8-11:  Last block total size (bytes)
+ * 12-15: Tree depth (levels of offset chunks, at least 1)
+ * 16-23: Number of data block offsets in the image
+ * 24-:   DB offsets of the top-level chunks
+ * Each chunk is one DB block of IPIL_FANOUT offsets, zero-padded at the
+ * end; level 1 chunks hold data block offsets and each higher level holds
+ * the offsets of the chunks below it.
+ */
+#define IPIT_HDR_SIZE 24
+#define IPIL_FANOUT (B_SIZE / sizeof(uint32_t))
+
+/* A loaded image file: header values plus the array of DB block offsets */
+struct ipil_t {
+	uint32_t start_offset;	/* Truncate first block size (bytes) */
+	uint32_t end_size;	/* Last block total size (bytes) */
+	size_t count;		/* Number of block offsets */
+	const uint32_t *offsets;	/* DB block offsets, in image order */
+	void *map;		/* Private: mapping or buffer backing offsets */
+	size_t maplen;		/* Private: length of map (0 if malloc()ed) */
+	uint32_t depth;		/* Tree depth, or 0 for a flat image file */
+	uint32_t meta_max;	/* Highest DB block holding tree chunks */
+};
+
+extern int ipil_open(const char * const restrict path,
+		struct ipil_t * const restrict ip);
+extern int ipil_open_db(const char * const restrict path, const int db_fd,
+		struct ipil_t * const restrict ip);
+extern void ipil_set_db(const int db_fd);
+extern void ipil_close(struct ipil_t * const restrict ip);
+extern int ipil_scan_dir(const char * const restrict dir,
+		char *** const restrict list, size_t * const restrict count);
+extern uint64_t ipil_image_size(const struct ipil_t * const restrict ip);
+extern uint64_t ipil_block_pos(const struct ipil_t * const restrict ip, const uint64_t block);
+extern uint32_t ipil_block_len(const struct ipil_t * const restrict ip, const uint64_t block);
+extern const char *ipil_base_name(const char * const restrict path);
+extern void ipil_free_list(char ** const restrict list, const size_t count);
+extern uint32_t *ipil_collect_blocks(const struct ipil_t * const restrict images,
+		const size_t image_count, const off_t db_blocks,
+		size_t * const restrict count, uint64_t * const restrict refs);
+extern int ipil_write(const char * const restrict path,
+		const uint32_t start_offset, const uint32_t end_size,
+		const uint32_t * const restrict offsets, const size_t count);
+extern int ipil_write_remapped(const char * const restrict path,
+		const uint32_t start_offset, const uint32_t end_size,
+		const uint32_t * const restrict offsets, const size_t count,
+		const uint32_t * const restrict blocks, const size_t block_count,
+		const uint32_t * const restrict map);
+extern int ipil_write_tree(const char * const restrict path,
+		const uint32_t start_offset, const uint32_t end_size,
+		const uint32_t * const restrict offsets, const size_t count,
+		const struct files_t * const restrict files);
+extern size_t ipil_block_index(const uint32_t * const restrict blocks,
+		const size_t count, const uint32_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IPIL_H */
@@ -0,0 +1,285 @@
+/*
+ * Pile merge with offset remapping
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Folds another pile ("B") into the pile in IMGDIR ("A"). A's hash index
+ * is loaded as it would be for "add"; B's index is streamed in chunks and
+ * never held in memory. Each chunk is first matched against A in parallel
+ * (read-only hash lookups plus block compares), then the blocks with no
+ * match are appended serially through the normal add path, which also
+ * catches duplicates within B itself. The B-to-A offset map is kept in a
+ * scratch file and memory-mapped only to rewrite B's image files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "merge.h"
+#include "catalog.h"
+
+/* B index entries resolved per parallel pass */
+#define MERGE_CHUNK 65536
+
+/* Upper bound for --threads */
+#define MERGE_MAX_THREADS 64
+
+#define MERGE_UNMAPPED UINT32_MAX
+
+struct merge_chunk {
+	const jodyhash_t *hashes;
+	uint32_t *map;
+	off_t first;		/* B offset of hashes[0] */
+	size_t count;
+	int a_fd, b_fd;
+};
+
+struct merge_worker {
+	pthread_t thread;
+	const struct merge_chunk *chunk;
+	size_t start, end;
+	uint64_t hash_fails;
+};
+
+
+static int pread_block(const int fd, void * const restrict blk, const off_t offset)
+{
+	size_t done = 0;
+
+	while (done < B_SIZE) {
+		const ssize_t r = pread(fd, (char *)blk + done, B_SIZE - done,
+				(offset * B_SIZE) + (off_t)done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)r;
+	}
+	return 0;
+}
+
+
+/* Match a slice of a B chunk against A's in-memory hash table. Only
+ * reads the table, so any number of workers can run at once. */
+static void *merge_worker_main(void *arg)
+{
+	struct merge_worker * const w = (struct merge_worker *)arg;
+	const struct merge_chunk * const c = w->chunk;
+	char ablk[B_SIZE], bblk[B_SIZE];
+	size_t i;
+
+	for (i = w->start; i < w->end; i++) {
+		const jodyhash_t hash = c->hashes[i];
+		const struct hash_leaf *leaf = hash_top[HASH_HEAD(hash)];
+		int have_b = 0;
+
+		c->map[i] = MERGE_UNMAPPED;
+		for (; leaf != NULL && c->map[i] == MERGE_UNMAPPED; leaf = leaf->next) {
+			unsigned int n;
+			for (n = 0; n < leaf->entries; n++) {
+				if (leaf->node[n].hash != hash) continue;
+				if (!have_b) {
+					if (pread_block(c->b_fd, bblk, c->first + (off_t)i) != 0) goto error_read;
+					have_b = 1;
+				}
+				if (pread_block(c->a_fd, ablk, leaf->node[n].offset) != 0) goto error_read;
+				if (memcmp(ablk, bblk, B_SIZE)) {
+					w->hash_fails++;
+					continue;
+				}
+				c->map[i] = (uint32_t)leaf->node[n].offset;
+				break;
+			}
+		}
+	}
+	return NULL;
+
+error_read:
+	fprintf(stderr, "Error: cannot read a block while merging: %s\n", strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+
+/* merge [--threads N] pile_b_dir out_dir [image_file...] */
+extern int merge_pile(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct merge_worker workers[MERGE_MAX_THREADS];
+	struct merge_chunk chunk;
+	const char *bdir = NULL, *outdir = NULL;
+	char path[PATH_MAX + 32];
+	char blk[B_SIZE];
+	char **list = NULL;
+	struct catalog_entry *catalog;
+	size_t catalog_count;
+	size_t list_count = 0, i;
+	jodyhash_t *hashes;
+	uint32_t *map;
+	FILE *bidx;
+	int bdb, mapfd;
+	off_t b_blocks, done = 0, appended = 0, a_before;
+	uint64_t hash_fails = 0;
+	long threads;
+	int t;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (t = 0; t < argc && outdir == NULL; t++) {
+		if (!strcmp(argv[t], "--threads") && t + 1 < argc) threads = atol(argv[++t]);
+		else if (bdir == NULL) bdir = argv[t];
+		else outdir = argv[t];
+	}
+	if (outdir == NULL) return 1;
+	if (threads < 1) threads = 1;
+	if (threads > MERGE_MAX_THREADS) threads = MERGE_MAX_THREADS;
+	argc -= t;
+	argv += t;
+	if (!strcmp(bdir, files->imgdir)) {
+		fprintf(stderr, "Error: cannot merge a pile into itself\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Default to every image in pile B */
+	if (argc == 0) {
+		if (catalog_image_list(bdir, &list, &list_count) != 0) exit(EXIT_FAILURE);
+	} else {
+		list = argv;
+		list_count = (size_t)argc;
+	}
+
+	snprintf(path, sizeof(path), "%s/imagepile.db", bdir);
+	if ((bdb = open(path, O_RDONLY)) < 0) goto error_open;
+	b_blocks = lseek(bdb, 0, SEEK_END) / B_SIZE;
+	snprintf(path, sizeof(path), "%s/imagepile.hash_index", bdir);
+	if (!(bidx = fopen(path, "rb"))) goto error_open;
+
+	/* The B-to-A map lives on disk, not in RAM */
+	snprintf(path, sizeof(path), "%s/.merge_map.tmp", files->imgdir);
+	if ((mapfd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) goto error_open;
+	unlink(path);
+
+	load_hash_index(files);
+	a_before = db_block_count(files);
+	fprintf(stderr, "Merging %jd blocks from %s using %ld threads\n",
+			(intmax_t)b_blocks, bdir, threads);
+
+	hashes = (jodyhash_t *)malloc(MERGE_CHUNK * sizeof(jodyhash_t));
+	map = (uint32_t *)malloc(MERGE_CHUNK * sizeof(uint32_t));
+	if (hashes == NULL || map == NULL) goto oom;
+	chunk.hashes = hashes;
+	chunk.map = map;
+	chunk.a_fd = fileno(files->db);
+	chunk.b_fd = bdb;
+
+	while (done < b_blocks) {
+		size_t n = MERGE_CHUNK;
+
+		if ((off_t)n > b_blocks - done) n = (size_t)(b_blocks - done);
+		if (fread(hashes, sizeof(jodyhash_t), n, bidx) != n) {
+			fprintf(stderr, "Error: hash index of %s is shorter than its DB\n", bdir);
+			exit(EXIT_FAILURE);
+		}
+		chunk.first = done;
+		chunk.count = n;
+
+		/* Parallel phase: match against A as it stood before this chunk */
+		fflush(files->db);
+		for (t = 0; t < threads; t++) {
+			workers[t].chunk = &chunk;
+			workers[t].start = (n * (size_t)t) / (size_t)threads;
+			workers[t].end = (n * (size_t)(t + 1)) / (size_t)threads;
+			workers[t].hash_fails = 0;
+			if (pthread_create(&workers[t].thread, NULL, merge_worker_main, &workers[t]) != 0) {
+				fprintf(stderr, "Error: cannot create merge thread\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (t = 0; t < threads; t++) {
+			pthread_join(workers[t].thread, NULL);
+			hash_fails += workers[t].hash_fails;
+		}
+
+		/* Serial phase: add unmatched blocks (dedups within B too) */
+		for (i = 0; i < n; i++) {
+			if (map[i] != MERGE_UNMAPPED) continue;
+			if (pread_block(bdb, blk, done + (off_t)i) != 0) goto error_read;
+			map[i] = get_block_offset(blk, files);
+		}
+		if (write(mapfd, map, n * sizeof(uint32_t)) != (ssize_t)(n * sizeof(uint32_t))) goto error_map;
+		done += (off_t)n;
+		fprintf(stderr, "\r%u%% merged ", (unsigned int)((done * 100) / b_blocks));
+	}
+	if (b_blocks > 0) fprintf(stderr, "\n");
+	free(hashes);
+	free(map);
+	fclose(bidx);
+	fflush(files->db);
+	fflush(files->hashindex);
+	appended = db_block_count(files) - a_before;
+
+	/* Rewrite B's images with offsets remapped into A */
+	if (b_blocks > 0) {
+		map = (uint32_t *)mmap(NULL, (size_t)b_blocks * sizeof(uint32_t), PROT_READ, MAP_SHARED, mapfd, 0);
+		if (map == MAP_FAILED) goto error_map;
+	}
+	catalog_load(bdir, &catalog, &catalog_count);
+	for (i = 0; i < list_count; i++) {
+		const struct catalog_entry *src = catalog_find(catalog, catalog_count, bdir, list[i]);
+		struct catalog_entry info;
+		struct ipil_t ip;
+		size_t k;
+
+		if (ipil_open_db(list[i], bdb, &ip) != 0) exit(EXIT_FAILURE);
+		for (k = 0; k < ip.count; k++) {
+			if ((off_t)ip.offsets[k] >= b_blocks) {
+				fprintf(stderr, "Error: %s references block %" PRIu32 " beyond end of %s\n",
+						list[i], ip.offsets[k], bdir);
+				exit(EXIT_FAILURE);
+			}
+		}
+		snprintf(path, sizeof(path), "%s/%s", outdir, ipil_base_name(list[i]));
+		ipil_write_remapped(path, ip.start_offset, ip.end_size, ip.offsets, ip.count, NULL, 0, map);
+		memset(&info, 0, sizeof(info));
+		info.size = ipil_image_size(&ip);
+		info.blocks = ip.count;
+		if (src != NULL) info.digest = src->digest;
+		catalog_add(files->imgdir, path, &info, NULL);
+		ipil_close(&ip);
+		fprintf(stderr, "Merged image %s\n", path);
+	}
+	catalog_free(catalog, catalog_count);
+	close(bdb);
+	if (b_blocks > 0) munmap(map, (size_t)b_blocks * sizeof(uint32_t));
+	close(mapfd);
+	if (argc == 0) ipil_free_list(list, list_count);
+	fclose(files->hashindex);
+
+	fprintf(stderr, "Stats: %jd blocks merged, %jd appended, %jd deduplicated, %ju hash failures\n",
+			(intmax_t)b_blocks, (intmax_t)appended, (intmax_t)(b_blocks - appended),
+			(uintmax_t)(hash_fails + stats_hash_failures));
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_open:
+	fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+	exit(EXIT_FAILURE);
+error_read:
+	fprintf(stderr, "Error: cannot read DB of %s\n", bdir);
+	exit(EXIT_FAILURE);
+error_map:
+	fprintf(stderr, "Error: cannot write merge map in %s\n", files->imgdir);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,19 @@
+/* Pile merge headers
+ * See imagepile.c for copyright information */
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int merge_pile(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* MERGE_H */
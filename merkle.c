@@ -0,0 +1,456 @@
+/*
+ * Image Merkle trees
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * An optional Merkle tree over an image's offset list lets two images be
+ * compared by walking down only the subtrees whose hashes differ, and
+ * lets a range of an image be verified by rehashing only the leaves that
+ * cover it and the path from them to the root. Leaves cover the same
+ * offset chunks as tree image files. Trees are stored next to the image
+ * and are considered stale once the image file changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "merkle.h"
+
+/* Compute the level sizes for a tree over count offsets */
+static int merkle_shape(struct merkle_t * const restrict mt, const uint64_t count)
+{
+	size_t n = (size_t)((count + MERKLE_LEAF - 1) / MERKLE_LEAF);
+
+	if (n == 0) n = 1;
+	mt->count = count;
+	mt->levels = 0;
+	mt->node_count = 0;
+	while (1) {
+		if (mt->levels == MERKLE_MAX_LEVELS) return -1;
+		mt->level_start[mt->levels] = mt->node_count;
+		mt->level_count[mt->levels] = n;
+		mt->node_count += n;
+		mt->levels++;
+		if (n == 1) break;
+		n = (n + 1) / 2;
+	}
+	return 0;
+}
+
+
+/* Hash one leaf's worth of offsets */
+static jodyhash_t merkle_leaf_hash(const struct ipil_t * const restrict ip, const size_t leaf)
+{
+	jodyhash_t buf[MERKLE_LEAF * sizeof(uint32_t) / sizeof(jodyhash_t)];
+	const size_t first = leaf * MERKLE_LEAF;
+	size_t n = 0;
+
+	if (first < ip->count) n = ip->count - first;
+	if (n > MERKLE_LEAF) n = MERKLE_LEAF;
+	/* Copy to an aligned buffer; mapped offsets start at byte 12 */
+	memcpy(buf, ip->offsets + first, n * sizeof(uint32_t));
+	return jody_block_hash(buf, 0, n * sizeof(uint32_t));
+}
+
+
+/* Hash node i of a level from its children on the level below */
+static jodyhash_t merkle_node_hash(const struct merkle_t * const restrict mt,
+		const uint32_t level, const size_t i)
+{
+	const jodyhash_t *child = mt->nodes + mt->level_start[level - 1] + (i * 2);
+
+	if ((i * 2) + 1 >= mt->level_count[level - 1]) return child[0];
+	return jody_block_hash(child, 0, 2 * sizeof(jodyhash_t));
+}
+
+
+/* Build the tree for a loaded image */
+extern void merkle_build(const struct ipil_t * const restrict ip,
+		struct merkle_t * const restrict mt)
+{
+	uint32_t l;
+	size_t i;
+
+	memset(mt, 0, sizeof(struct merkle_t));
+	if (merkle_shape(mt, ip->count) != 0) goto error_size;
+	mt->start_offset = ip->start_offset;
+	mt->end_size = ip->end_size;
+	mt->nodes = (jodyhash_t *)malloc(mt->node_count * sizeof(jodyhash_t));
+	if (mt->nodes == NULL) goto oom;
+	for (i = 0; i < mt->level_count[0]; i++) mt->nodes[i] = merkle_leaf_hash(ip, i);
+	for (l = 1; l < mt->levels; l++)
+		for (i = 0; i < mt->level_count[l]; i++)
+			mt->nodes[mt->level_start[l] + i] = merkle_node_hash(mt, l, i);
+	return;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_size:
+	fprintf(stderr, "Error: image too large for a Merkle tree\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Write the tree for an image next to it */
+extern int merkle_write(const char * const restrict image,
+		const struct merkle_t * const restrict mt)
+{
+	char path[PATH_MAX + 16], tmp[PATH_MAX + 24];
+	char hdr[MERKLE_HDR_SIZE];
+	struct stat st;
+	uint32_t u32;
+	uint64_t u64;
+	FILE *out;
+
+	if (stat(image, &st) != 0) goto error_write;
+	snprintf(path, sizeof(path), "%s.merkle", image);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "IPMK", 4);
+	u32 = MERKLE_VERSION; memcpy(hdr + 4, &u32, 4);
+	memcpy(hdr + 8, &mt->start_offset, 4);
+	memcpy(hdr + 12, &mt->end_size, 4);
+	memcpy(hdr + 16, &mt->count, 8);
+	u64 = (uint64_t)st.st_size; memcpy(hdr + 24, &u64, 8);
+	u64 = (uint64_t)st.st_mtim.tv_sec; memcpy(hdr + 32, &u64, 8);
+	u32 = (uint32_t)st.st_mtim.tv_nsec; memcpy(hdr + 40, &u32, 4);
+	memcpy(hdr + 44, &mt->levels, 4);
+
+	if (!(out = fopen(tmp, "wb"))) goto error_write;
+	if (fwrite(hdr, 1, MERKLE_HDR_SIZE, out) != MERKLE_HDR_SIZE) goto error_write;
+	if (fwrite(mt->nodes, sizeof(jodyhash_t), mt->node_count, out) != mt->node_count) goto error_write;
+	if (fclose(out) != 0) goto error_write;
+	if (rename(tmp, path) != 0) goto error_write;
+	return 0;
+
+error_write:
+	fprintf(stderr, "Error: cannot write Merkle tree for %s\n", image);
+	exit(EXIT_FAILURE);
+}
+
+
+/* Load the tree for an image
+ * Returns 0 on success, -1 if there is no tree or it is stale */
+extern int merkle_load(const char * const restrict image,
+		struct merkle_t * const restrict mt)
+{
+	char path[PATH_MAX + 16];
+	char hdr[MERKLE_HDR_SIZE];
+	struct stat st, mst;
+	uint32_t u32, levels;
+	uint64_t size, sec, count;
+	FILE *in;
+
+	memset(mt, 0, sizeof(struct merkle_t));
+	snprintf(path, sizeof(path), "%s.merkle", image);
+	if (!(in = fopen(path, "rb"))) return -1;
+	if (stat(image, &st) != 0 || fstat(fileno(in), &mst) != 0) goto error_bad;
+	if (fread(hdr, 1, MERKLE_HDR_SIZE, in) != MERKLE_HDR_SIZE) goto error_bad;
+	memcpy(&u32, hdr + 4, 4);
+	if (memcmp(hdr, "IPMK", 4) || u32 != MERKLE_VERSION) goto error_bad;
+	memcpy(&count, hdr + 16, 8);
+	memcpy(&size, hdr + 24, 8);
+	memcpy(&sec, hdr + 32, 8);
+	memcpy(&u32, hdr + 40, 4);
+	memcpy(&levels, hdr + 44, 4);
+	if (size != (uint64_t)st.st_size || sec != (uint64_t)st.st_mtim.tv_sec
+			|| u32 != (uint32_t)st.st_mtim.tv_nsec) {
+		fprintf(stderr, "Warning: Merkle tree for %s is stale; rebuild it\n", image);
+		fclose(in);
+		return -1;
+	}
+	if (merkle_shape(mt, count) != 0 || levels != mt->levels
+			|| (uint64_t)mst.st_size != MERKLE_HDR_SIZE + (mt->node_count * sizeof(jodyhash_t))) goto error_bad;
+	memcpy(&mt->start_offset, hdr + 8, 4);
+	memcpy(&mt->end_size, hdr + 12, 4);
+	mt->nodes = (jodyhash_t *)malloc(mt->node_count * sizeof(jodyhash_t));
+	if (mt->nodes == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fread(mt->nodes, sizeof(jodyhash_t), mt->node_count, in) != mt->node_count) goto error_bad;
+	fclose(in);
+	return 0;
+
+error_bad:
+	fprintf(stderr, "Warning: Merkle tree %s is damaged; rebuild it\n", path);
+	fclose(in);
+	merkle_free(mt);
+	return -1;
+}
+
+
+extern void merkle_free(struct merkle_t * const restrict mt)
+{
+	free(mt->nodes);
+	memset(mt, 0, sizeof(struct merkle_t));
+	return;
+}
+
+
+/* Append a leaf index to a growing list */
+static void leaf_push(size_t ** const restrict list, size_t * const restrict count,
+		size_t * const restrict alloc, const size_t leaf)
+{
+	if (*count == *alloc) {
+		size_t *tmp;
+		*alloc = *alloc ? *alloc * 2 : 64;
+		tmp = (size_t *)realloc(*list, *alloc * sizeof(size_t));
+		if (tmp == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		*list = tmp;
+	}
+	(*list)[(*count)++] = leaf;
+	return;
+}
+
+
+/* Add a leaf index to a sorted list unless it is already there */
+static void leaf_insert(size_t ** const restrict list, size_t * const restrict count,
+		size_t * const restrict alloc, const size_t leaf)
+{
+	size_t i = *count;
+
+	while (i > 0 && (*list)[i - 1] > leaf) i--;
+	if (i > 0 && (*list)[i - 1] == leaf) return;
+	leaf_push(list, count, alloc, leaf);
+	memmove(*list + i + 1, *list + i, (*count - i - 1) * sizeof(size_t));
+	(*list)[i] = leaf;
+	return;
+}
+
+
+/* Data length of a block, as ipil_block_len() computes it */
+static uint32_t merkle_block_len(const struct merkle_t * const restrict mt, const uint64_t block)
+{
+	if (block + 1 == mt->count) return mt->end_size;
+	if (block == 0) return B_SIZE - mt->start_offset;
+	return B_SIZE;
+}
+
+
+/* Header differences change the length of the first or last shared
+ * block without changing any offset; add the leaves holding them */
+static void leaf_headers(const struct merkle_t * const restrict a,
+		const struct merkle_t * const restrict b, size_t ** const restrict list,
+		size_t * const restrict count, size_t * const restrict alloc)
+{
+	const uint64_t common = a->count < b->count ? a->count : b->count;
+
+	if (common == 0) return;
+	if (merkle_block_len(a, 0) != merkle_block_len(b, 0)) leaf_insert(list, count, alloc, 0);
+	if (merkle_block_len(a, common - 1) != merkle_block_len(b, common - 1))
+		leaf_insert(list, count, alloc, (size_t)((common - 1) / MERKLE_LEAF));
+	return;
+}
+
+
+/* List the leaves that differ between two trees, in order. Trees of the
+ * same shape are walked from the root, descending only into differing
+ * subtrees; otherwise the leaf levels are compared directly. Leaves
+ * whose blocks differ only in length (start offset or end size) are
+ * listed too. */
+extern size_t *merkle_diff(const struct merkle_t * const restrict a,
+		const struct merkle_t * const restrict b, size_t * const restrict count,
+		uint64_t * const restrict visited)
+{
+	size_t stack_level[MERKLE_MAX_LEVELS * 2], stack_node[MERKLE_MAX_LEVELS * 2];
+	size_t *list = NULL, n = 0, alloc = 0, sp = 0, i;
+
+	*visited = 0;
+	if (a->count != b->count) {
+		const size_t la = a->level_count[0], lb = b->level_count[0];
+		const size_t common = la < lb ? la : lb;
+		for (i = 0; i < common; i++) {
+			(*visited)++;
+			if (a->nodes[i] != b->nodes[i]) leaf_push(&list, &n, &alloc, i);
+		}
+		for (; i < (la > lb ? la : lb); i++) leaf_push(&list, &n, &alloc, i);
+		leaf_headers(a, b, &list, &n, &alloc);
+		*count = n;
+		return list;
+	}
+
+	/* Depth-first, left child last on the stack so leaves come out in order */
+	stack_level[sp] = a->levels - 1;
+	stack_node[sp++] = 0;
+	while (sp > 0) {
+		const size_t l = stack_level[--sp], node = stack_node[sp];
+		const size_t idx = a->level_start[l] + node;
+
+		(*visited)++;
+		if (a->nodes[idx] == b->nodes[idx]) continue;
+		if (l == 0) {
+			leaf_push(&list, &n, &alloc, node);
+			continue;
+		}
+		if ((node * 2) + 1 < a->level_count[l - 1]) {
+			stack_level[sp] = l - 1;
+			stack_node[sp++] = (node * 2) + 1;
+		}
+		stack_level[sp] = l - 1;
+		stack_node[sp++] = node * 2;
+	}
+	leaf_headers(a, b, &list, &n, &alloc);
+	*count = n;
+	return list;
+}
+
+
+/* Print the changed block extents between two images */
+static int merkle_diff_verb(int argc, char **argv)
+{
+	struct merkle_t ma, mb;
+	struct ipil_t a, b;
+	size_t *leaves, count, i;
+	uint64_t visited, changed = 0, run_start = 0, run_end = 0;
+	int in_run = 0;
+
+	if (argc != 2) return 1;
+	if (merkle_load(argv[0], &ma) != 0 || merkle_load(argv[1], &mb) != 0) {
+		fprintf(stderr, "Error: both images need a current tree; run \"merkle build\" first\n");
+		exit(EXIT_FAILURE);
+	}
+	if (ipil_open(argv[0], &a) != 0 || ipil_open(argv[1], &b) != 0) exit(EXIT_FAILURE);
+	if (a.start_offset != b.start_offset) {
+		fprintf(stderr, "Error: %s and %s have different start offsets; their blocks don't line up\n",
+				argv[0], argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	leaves = merkle_diff(&ma, &mb, &count, &visited);
+
+	/* Narrow each differing leaf down to the offsets that changed */
+	for (i = 0; i < count; i++) {
+		uint64_t k = (uint64_t)leaves[i] * MERKLE_LEAF;
+		const uint64_t end = k + MERKLE_LEAF;
+
+		for (; k < end && (k < a.count || k < b.count); k++) {
+			const int diff = (k >= a.count || k >= b.count || a.offsets[k] != b.offsets[k]
+					|| ipil_block_len(&a, k) != ipil_block_len(&b, k));
+			if (diff && in_run && k == run_end) run_end++;
+			else if (diff) {
+				if (in_run) printf("%" PRIu64 "-%" PRIu64 "\n", run_start, run_end - 1);
+				run_start = k;
+				run_end = k + 1;
+				in_run = 1;
+			}
+			changed += (uint64_t)diff;
+		}
+	}
+	if (in_run) printf("%" PRIu64 "-%" PRIu64 "\n", run_start, run_end - 1);
+	fprintf(stderr, "Stats: %ju changed blocks in %ju of %ju leaves, %ju tree nodes compared\n",
+			(uintmax_t)changed, (uintmax_t)count, (uintmax_t)ma.level_count[0],
+			(uintmax_t)visited);
+	free(leaves);
+	ipil_close(&a);
+	ipil_close(&b);
+	merkle_free(&ma);
+	merkle_free(&mb);
+	return 0;
+}
+
+
+/* Check an image range: rehash the leaves that cover it and their path
+ * to the root, then check each data block against the hash index */
+static int merkle_verify_verb(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct merkle_t mt;
+	struct ipil_t ip;
+	jodyhash_t blk[B_SIZE / sizeof(jodyhash_t)];
+	FILE *idx;
+	uint64_t first = 0, last, k, bad_blocks = 0, bad_nodes = 0;
+	size_t lo, hi, i;
+	uint32_t l;
+
+	if (argc < 1 || argc > 3) return 1;
+	if (merkle_load(argv[0], &mt) != 0) {
+		fprintf(stderr, "Error: %s has no current tree; run \"merkle build\" first\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (ipil_open(argv[0], &ip) != 0) exit(EXIT_FAILURE);
+	last = ip.count;
+	if (argc > 1) first = strtoull(argv[1], NULL, 10);
+	if (argc > 2) last = first + strtoull(argv[2], NULL, 10);
+	if (last > ip.count) last = ip.count;
+	if (first >= last || ip.count != mt.count) {
+		fprintf(stderr, "Error: nothing to verify in that range of %s\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Touched leaves, then each ancestor level */
+	lo = (size_t)(first / MERKLE_LEAF);
+	hi = (size_t)((last - 1) / MERKLE_LEAF);
+	for (i = lo; i <= hi; i++)
+		if (merkle_leaf_hash(&ip, i) != mt.nodes[i]) bad_nodes++;
+	for (l = 1; l < mt.levels; l++) {
+		lo /= 2;
+		hi /= 2;
+		for (i = lo; i <= hi; i++)
+			if (merkle_node_hash(&mt, l, i) != mt.nodes[mt.level_start[l] + i]) bad_nodes++;
+	}
+
+	/* Data blocks against the hash index */
+	if (!(idx = fopen(files->indexfile, "rb"))) {
+		fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	for (k = first; k < last; k++) {
+		jodyhash_t want;
+		if (fseeko(idx, (off_t)ip.offsets[k] * (off_t)sizeof(jodyhash_t), SEEK_SET) != 0
+				|| fread(&want, sizeof(jodyhash_t), 1, idx) != 1
+				|| read_db_block(blk, (off_t)ip.offsets[k], files) != 0
+				|| jody_block_hash(blk, 0, B_SIZE) != want) {
+			fprintf(stderr, "Bad block: image block %" PRIu64 " (DB block %" PRIu32 ")\n", k, ip.offsets[k]);
+			bad_blocks++;
+		}
+	}
+	fclose(idx);
+
+	fprintf(stderr, "Verified %s blocks %" PRIu64 "-%" PRIu64 ": %ju bad tree nodes, %ju bad blocks\n",
+			argv[0], first, last - 1, (uintmax_t)bad_nodes, (uintmax_t)bad_blocks);
+	ipil_close(&ip);
+	merkle_free(&mt);
+	if (bad_nodes > 0 || bad_blocks > 0) exit(EXIT_FAILURE);
+	return 0;
+}
+
+
+/* merkle build image_file...
+ * merkle diff image_a image_b
+ * merkle verify image_file [first_block [block_count]] */
+extern int merkle_verb(struct files_t * const restrict files, int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2) return 1;
+	if (!strcmp(argv[0], "diff")) return merkle_diff_verb(argc - 1, argv + 1);
+	if (!strcmp(argv[0], "verify")) return merkle_verify_verb(files, argc - 1, argv + 1);
+	if (strcmp(argv[0], "build")) return 1;
+
+	for (i = 1; i < argc; i++) {
+		struct merkle_t mt;
+		struct ipil_t ip;
+
+		if (ipil_open(argv[i], &ip) != 0) exit(EXIT_FAILURE);
+		merkle_build(&ip, &mt);
+		ipil_close(&ip);
+		merkle_write(argv[i], &mt);
+		fprintf(stderr, "Built tree for %s: %ju leaves, %" PRIu32 " levels, root %016" PRIx64 "\n",
+				argv[i], (uintmax_t)mt.level_count[0], mt.levels,
+				(uint64_t)mt.nodes[mt.node_count - 1]);
+		merkle_free(&mt);
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+/* Image Merkle tree headers
+ * See imagepile.c for copyright information */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "imagepile.h"
+#include "ipil.h"
+
+/*
+ * Merkle tree files sit next to their image as <image>.merkle
+ * 0-3:   'IPMK' signature
+ * 4-7:   Version
+ * 8-11:  Start offset of the image
+ * 12-15: End size of the image
+ * 16-23: Number of data block offsets in the image
+ * 24-31: Size of the image file when the tree was built
+ * 32-39: Modification time of the image file (seconds)
+ * 40-43: Modification time of the image file (nanoseconds)
+ * 44-47: Number of levels
+ * 48-:   Node hashes, leaf level first, root last
+ * Each leaf is the hash of MERKLE_LEAF consecutive offsets (the last leaf
+ * may be short); each node above hashes its two children, or passes a
+ * lone child up unchanged.
+ */
+#define MERKLE_VERSION 1
+#define MERKLE_HDR_SIZE 48
+#define MERKLE_LEAF IPIL_FANOUT
+#define MERKLE_MAX_LEVELS 48
+
+struct merkle_t {
+	uint32_t start_offset;
+	uint32_t end_size;
+	uint64_t count;		/* Data block offsets covered */
+	uint32_t levels;
+	size_t level_start[MERKLE_MAX_LEVELS];	/* First node of each level */
+	size_t level_count[MERKLE_MAX_LEVELS];	/* Nodes in each level */
+	jodyhash_t *nodes;
+	size_t node_count;
+};
+
+extern void merkle_build(const struct ipil_t * const restrict ip,
+		struct merkle_t * const restrict mt);
+extern int merkle_write(const char * const restrict image,
+		const struct merkle_t * const restrict mt);
+extern int merkle_load(const char * const restrict image,
+		struct merkle_t * const restrict mt);
+extern void merkle_free(struct merkle_t * const restrict mt);
+extern size_t *merkle_diff(const struct merkle_t * const restrict a,
+		const struct merkle_t * const restrict b, size_t * const restrict count,
+		uint64_t * const restrict visited);
+extern int merkle_verb(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* MERKLE_H */
@@ -0,0 +1,1087 @@
+/*
+ * Read-only NBD server for images
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Exports one image over a Unix socket using the fixed newstyle NBD
+ * handshake, so qemu-img, qemu, nbd-client and friends can read it
+ * straight out of the pile. DB blocks are kept in a CLOCK-evicted block
+ * cache shared by all connections; the cache misses of each request are
+ * sorted and read from the DB in runs of consecutive blocks with one
+ * preadv() per run, and sequential readers get readahead. Service time
+ * per 4 KiB read is recorded in a log2 histogram and reported when a
+ * client disconnects and when the server is stopped.
+ *
+ * With --overlay the export is writable. Written blocks go to a delta
+ * file private to the server; on flush (and on FUA writes, disconnect
+ * and shutdown) each delta block is deduplicated into the pile through
+ * the normal add path and a new image file is written that shares every
+ * unchanged offset with the parent image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "hotcache.h"
+#include "range.h"
+#include "catalog.h"
+#include "nbd.h"
+
+/* Protocol constants (see the NBD protocol specification) */
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513U
+#define NBD_REPLY_MAGIC		0x67446698U
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1U << 0)
+#define NBD_FLAG_NO_ZEROES	(1U << 1)
+#define NBD_FLAG_HAS_FLAGS	(1U << 0)
+#define NBD_FLAG_READ_ONLY	(1U << 1)
+#define NBD_FLAG_SEND_FLUSH	(1U << 2)
+#define NBD_FLAG_SEND_FUA	(1U << 3)
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1U << 6)
+#define NBD_FLAG_CAN_MULTI_CONN	(1U << 8)
+
+#define NBD_CMD_FLAG_FUA	(1U << 0)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	(0x80000000U | 1)
+#define NBD_REP_ERR_INVALID	(0x80000000U | 3)
+#define NBD_REP_ERR_UNKNOWN	(0x80000000U | 6)
+
+#define NBD_INFO_EXPORT		0
+#define NBD_INFO_BLOCK_SIZE	3
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_WRITE_ZEROES	6
+
+#define NBD_EPERM		1
+#define NBD_EIO			5
+#define NBD_ENOMEM		12
+#define NBD_EINVAL		22
+#define NBD_ENOSPC		28
+#define NBD_ENOTSUP		95
+
+/* Largest request served; clients are told this in NBD_INFO_BLOCK_SIZE */
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+
+/* Longest option payload accepted during the handshake */
+#define NBD_MAX_OPTION 4096
+
+/* Default block cache size in DB blocks (64 MiB) */
+#define NBD_CACHE_DEFAULT 16384
+
+/* Longest DB run read with one preadv() */
+#define NBD_RUN_BLOCKS 64
+
+/* Readahead window (image blocks) for sequential readers */
+#define NBD_READAHEAD 64
+
+/* Latency histogram buckets: bucket i holds [2^i, 2^(i+1)) microseconds */
+#define NBD_LAT_BUCKETS 32
+
+#define NBD_EMPTY UINT32_MAX
+
+struct nbd_cache {
+	pthread_mutex_t lock;
+	char *data;
+	uint32_t *tag;		/* DB offset held by each slot */
+	uint32_t *next;		/* Hash chain link */
+	uint32_t *head;		/* Hash buckets */
+	unsigned char *ref;	/* CLOCK reference bits */
+	uint32_t slots, hash_mask, hand, used;
+	uint64_t hits, misses, runs;
+};
+
+struct nbd_stats {
+	pthread_mutex_t lock;
+	uint64_t reads, units, bytes, total_us, max_us;
+	uint64_t hist[NBD_LAT_BUCKETS];
+};
+
+/* Copy-on-write state; protected by the cache lock */
+struct nbd_overlay {
+	const char *path;	/* Image file written on flush */
+	const char *parent;
+	uint32_t *offsets;	/* Writable copy of the parent's offsets */
+	uint32_t *slot;		/* Delta slot + 1 per image block, 0 if clean */
+	uint32_t *block;	/* Image block held by each delta slot */
+	uint32_t used, alloc;
+	int fd;			/* Delta file (unlinked) */
+	uint64_t writes, flushes, flushed, appended;
+};
+
+struct nbd_server {
+	const struct files_t *files;
+	struct ipil_t ip;
+	uint64_t size;
+	const char *name;
+	struct nbd_cache cache;
+	struct nbd_stats stats;
+	struct nbd_overlay *ov;		/* NULL for a read-only export */
+	pthread_mutex_t conn_lock;	/* Protects nbd_conn.done */
+	struct nbd_conn *conns;		/* Connection threads not yet joined */
+};
+
+struct nbd_conn {
+	struct nbd_server *srv;
+	int fd;			/* Closed by the server once the thread is joined */
+	unsigned int id;
+	int done;
+	pthread_t thread;
+	struct nbd_conn *next;
+};
+
+struct nbd_miss {
+	uint32_t offset;
+	uint32_t block;		/* Index into the request's block range */
+};
+
+static volatile sig_atomic_t nbd_stop = 0;
+
+
+static void nbd_sig_handler(const int signo)
+{
+	(void)signo;
+	nbd_stop = 1;
+}
+
+
+static int read_full(const int fd, void * const restrict buf, const size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t r = read(fd, (char *)buf + done, len - done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)r;
+	}
+	return 0;
+}
+
+
+static int write_full(const int fd, const void * const restrict buf, const size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t r = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)r;
+	}
+	return 0;
+}
+
+
+static uint64_t nbd_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+
+/* Block cache */
+
+static int nbd_cache_init(struct nbd_cache * const restrict c, const uint32_t slots)
+{
+	uint32_t hsize = 1, i;
+
+	while (hsize < slots) hsize <<= 1;
+	memset(c, 0, sizeof(struct nbd_cache));
+	c->slots = slots;
+	c->hash_mask = hsize - 1;
+	c->data = (char *)malloc((size_t)slots * B_SIZE);
+	c->tag = (uint32_t *)malloc(slots * sizeof(uint32_t));
+	c->next = (uint32_t *)malloc(slots * sizeof(uint32_t));
+	c->head = (uint32_t *)malloc(hsize * sizeof(uint32_t));
+	c->ref = (unsigned char *)calloc(slots, 1);
+	if (!c->data || !c->tag || !c->next || !c->head || !c->ref) return -1;
+	for (i = 0; i < slots; i++) c->tag[i] = NBD_EMPTY;
+	for (i = 0; i < hsize; i++) c->head[i] = NBD_EMPTY;
+	pthread_mutex_init(&c->lock, NULL);
+	return 0;
+}
+
+
+static uint32_t nbd_cache_hash(const struct nbd_cache * const restrict c, const uint32_t offset)
+{
+	return (offset * 2654435761U) & c->hash_mask;
+}
+
+
+static const char *nbd_cache_lookup(struct nbd_cache * const restrict c, const uint32_t offset)
+{
+	uint32_t s;
+
+	for (s = c->head[nbd_cache_hash(c, offset)]; s != NBD_EMPTY; s = c->next[s]) {
+		if (c->tag[s] == offset) {
+			c->ref[s] = 1;
+			return c->data + ((size_t)s * B_SIZE);
+		}
+	}
+	return NULL;
+}
+
+
+/* Claim a slot with CLOCK replacement and unlink whatever it held */
+static uint32_t nbd_cache_claim(struct nbd_cache * const restrict c)
+{
+	uint32_t s, *link;
+
+	if (c->used < c->slots) {
+		c->ref[c->used] = 1;
+		return c->used++;
+	}
+	while (1) {
+		s = c->hand;
+		c->hand = (c->hand + 1) % c->slots;
+		if (c->ref[s]) c->ref[s] = 0;
+		else break;
+	}
+	c->ref[s] = 1;
+	if (c->tag[s] != NBD_EMPTY) {
+		for (link = &c->head[nbd_cache_hash(c, c->tag[s])]; *link != s; link = &c->next[*link]);
+		*link = c->next[s];
+		c->tag[s] = NBD_EMPTY;
+	}
+	return s;
+}
+
+
+static void nbd_cache_insert(struct nbd_cache * const restrict c, const uint32_t s, const uint32_t offset)
+{
+	const uint32_t h = nbd_cache_hash(c, offset);
+
+	c->tag[s] = offset;
+	c->ref[s] = 1;
+	c->next[s] = c->head[h];
+	c->head[h] = s;
+}
+
+
+static int cmp_miss(const void *a, const void *b)
+{
+	const struct nbd_miss *x = (const struct nbd_miss *)a, *y = (const struct nbd_miss *)b;
+	if (x->offset != y->offset) return (x->offset > y->offset) - (x->offset < y->offset);
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+
+/* Copy the part of image block k that overlaps [pos, pos + len) */
+static void nbd_copy_block(const struct ipil_t * const restrict ip, const uint64_t k,
+		const char * const restrict src, char * const restrict out,
+		const uint64_t pos, const uint64_t len)
+{
+	const uint64_t bpos = ipil_block_pos(ip, k);
+	uint64_t from = 0, to = ipil_block_len(ip, k);
+
+	if (bpos < pos) from = pos - bpos;
+	if (bpos + to > pos + len) to = pos + len - bpos;
+	memcpy(out + (bpos + from - pos), src + from, (size_t)(to - from));
+}
+
+
+/* Bring image blocks [first, end) into the cache, copying the overlap
+ * with [pos, pos + len) into out if out is not NULL. Misses are sorted
+ * by DB offset and read in runs of consecutive blocks. Called with the
+ * cache lock held. Returns 0 or -1 on a DB read error. */
+static int nbd_fetch(struct nbd_server * const restrict srv,
+		struct nbd_miss * const restrict miss,
+		const uint64_t first, const uint64_t end,
+		char * const restrict out, const uint64_t pos, const uint64_t len)
+{
+	struct nbd_cache * const c = &srv->cache;
+	const struct ipil_t * const ip = &srv->ip;
+	const int dbfd = fileno(srv->files->db);
+	size_t nmiss = 0, i;
+	uint64_t k;
+
+	for (k = first; k < end; k++) {
+		const uint32_t o = ip->offsets[k];
+		const char *src;
+
+		if (srv->ov != NULL && srv->ov->slot[k] != 0) {
+			char blk[B_SIZE];
+			if (out == NULL) continue;
+			if (pread(srv->ov->fd, blk, B_SIZE, (off_t)(srv->ov->slot[k] - 1) * B_SIZE) != B_SIZE) return -1;
+			nbd_copy_block(ip, k, blk, out, pos, len);
+			continue;
+		}
+		src = nbd_cache_lookup(c, o);
+		if (src == NULL) src = (const char *)hotcache_get((off_t)o);
+		if (src != NULL) {
+			if (out != NULL) nbd_copy_block(ip, k, src, out, pos, len);
+			c->hits++;
+			continue;
+		}
+		miss[nmiss].offset = o;
+		miss[nmiss].block = (uint32_t)(k - first);
+		nmiss++;
+	}
+	if (nmiss == 0) return 0;
+	qsort(miss, nmiss, sizeof(struct nbd_miss), cmp_miss);
+
+	for (i = 0; i < nmiss; ) {
+		struct iovec iov[NBD_RUN_BLOCKS];
+		uint32_t slot[NBD_RUN_BLOCKS];
+		size_t ends[NBD_RUN_BLOCKS];
+		size_t n = 0, j = i, want, done = 0;
+
+		/* Gather distinct consecutive offsets; duplicates share a slot */
+		while (j < nmiss && n < NBD_RUN_BLOCKS) {
+			if (n > 0 && miss[j].offset != miss[j - 1].offset + 1) break;
+			slot[n] = nbd_cache_claim(c);
+			iov[n].iov_base = c->data + ((size_t)slot[n] * B_SIZE);
+			iov[n].iov_len = B_SIZE;
+			for (j++; j < nmiss && miss[j].offset == miss[j - 1].offset; j++);
+			ends[n++] = j;
+		}
+
+		want = n * B_SIZE;
+		while (done < want) {
+			ssize_t r;
+			size_t v = 0, skip = done;
+
+			while (skip >= B_SIZE) { skip -= B_SIZE; v++; }
+			iov[v].iov_base = (char *)iov[v].iov_base + skip;
+			iov[v].iov_len -= skip;
+			r = preadv(dbfd, iov + v, (int)(n - v), ((off_t)miss[i].offset * B_SIZE) + (off_t)done);
+			iov[v].iov_base = (char *)iov[v].iov_base - skip;
+			iov[v].iov_len += skip;
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR) continue;
+				for (v = 0; v < n; v++) c->ref[slot[v]] = 0;
+				return -1;
+			}
+			done += (size_t)r;
+		}
+		c->runs++;
+		c->misses += n;
+
+		/* Register the slots and serve every block that wanted them */
+		for (j = 0; j < n; j++) {
+			const size_t start = (j == 0) ? i : ends[j - 1];
+			size_t m;
+
+			nbd_cache_insert(c, slot[j], miss[start].offset);
+			if (out == NULL) continue;
+			for (m = start; m < ends[j]; m++)
+				nbd_copy_block(ip, first + miss[m].block, (const char *)iov[j].iov_base, out, pos, len);
+		}
+		i = ends[n - 1];
+	}
+	return 0;
+}
+
+
+/* Current contents of image block k (delta, cache or DB) */
+static int nbd_get_block(struct nbd_server * const restrict srv, const uint64_t k,
+		char * const restrict blk)
+{
+	const uint32_t o = srv->ip.offsets[k];
+	const char *src;
+
+	if (srv->ov->slot[k] != 0)
+		return pread(srv->ov->fd, blk, B_SIZE, (off_t)(srv->ov->slot[k] - 1) * B_SIZE) == B_SIZE ? 0 : -1;
+	src = nbd_cache_lookup(&srv->cache, o);
+	if (src == NULL) src = (const char *)hotcache_get((off_t)o);
+	if (src != NULL) {
+		memcpy(blk, src, B_SIZE);
+		return 0;
+	}
+	return pread(fileno(srv->files->db), blk, B_SIZE, (off_t)o * B_SIZE) == B_SIZE ? 0 : -1;
+}
+
+
+/* Write [pos, pos + len) into the delta; data == NULL writes zeroes.
+ * Returns 0 or an NBD error code. Called with the cache lock held. */
+static uint32_t nbd_overlay_write(struct nbd_server * const restrict srv,
+		const char * const restrict data, const uint64_t pos, const uint64_t len)
+{
+	struct nbd_overlay * const ov = srv->ov;
+	const struct ipil_t * const ip = &srv->ip;
+	const uint64_t first = (pos < (uint64_t)(B_SIZE - ip->start_offset)) ? 0
+			: (pos + ip->start_offset) / B_SIZE;
+	const uint64_t last = (pos + len - 1 < (uint64_t)(B_SIZE - ip->start_offset)) ? 0
+			: (pos + len - 1 + ip->start_offset) / B_SIZE;
+	uint64_t k;
+
+	for (k = first; k <= last; k++) {
+		char blk[B_SIZE];
+		const uint64_t bpos = ipil_block_pos(ip, k);
+		const uint32_t blen = ipil_block_len(ip, k);
+		uint64_t from = 0, to = blen;
+		uint32_t s;
+
+		if (bpos < pos) from = pos - bpos;
+		if (bpos + to > pos + len) to = pos + len - bpos;
+
+		/* Whole-block writes need no read; padding stays zero */
+		if (from == 0 && to == blen) memset(blk, 0, B_SIZE);
+		else if (nbd_get_block(srv, k, blk) != 0) return NBD_EIO;
+		if (data != NULL) memcpy(blk + from, data + (bpos + from - pos), (size_t)(to - from));
+		else memset(blk + from, 0, (size_t)(to - from));
+
+		if (ov->slot[k] == 0) {
+			if (ov->used == ov->alloc) {
+				const uint32_t n = ov->alloc ? ov->alloc * 2 : 4096;
+				uint32_t * const b = (uint32_t *)realloc(ov->block, n * sizeof(uint32_t));
+				if (b == NULL) return NBD_ENOMEM;
+				ov->block = b;
+				ov->alloc = n;
+			}
+			ov->block[ov->used] = (uint32_t)k;
+			ov->slot[k] = ++ov->used;
+		}
+		s = ov->slot[k] - 1;
+		if (pwrite(ov->fd, blk, B_SIZE, (off_t)s * B_SIZE) != B_SIZE) return NBD_ENOSPC;
+	}
+	ov->writes++;
+	return 0;
+}
+
+
+/* Deduplicate the delta into the pile and write the overlay image.
+ * Called with the cache lock held. Returns 0 or -1. */
+static int nbd_overlay_flush(struct nbd_server * const restrict srv, const int force)
+{
+	struct nbd_overlay * const ov = srv->ov;
+	const struct files_t * const files = srv->files;
+	struct catalog_entry info;
+	off_t before;
+	uint32_t s;
+
+	if (ov->used == 0 && !force) return 0;
+	before = db_block_count(files);
+	for (s = 0; s < ov->used; s++) {
+		char blk[B_SIZE];
+		const uint32_t k = ov->block[s];
+
+		if (pread(ov->fd, blk, B_SIZE, (off_t)s * B_SIZE) != B_SIZE) return -1;
+		ov->offsets[k] = get_block_offset(blk, files);
+	}
+	if (fflush(files->db) != 0 || fflush(files->hashindex) != 0) return -1;
+	if (fsync(fileno(files->db)) != 0 || fsync(fileno(files->hashindex)) != 0) return -1;
+
+	/* New offsets are visible to readers once the delta is cleared */
+	for (s = 0; s < ov->used; s++) ov->slot[ov->block[s]] = 0;
+	ov->flushed += ov->used;
+	ov->appended += (uint64_t)(db_block_count(files) - before);
+	ov->used = 0;
+	if (ftruncate(ov->fd, 0) != 0) return -1;
+
+	if (srv->ip.depth > 0) {
+		if (ipil_write_tree(ov->path, srv->ip.start_offset, srv->ip.end_size,
+				ov->offsets, srv->ip.count, files) != 0) return -1;
+	} else if (ipil_write(ov->path, srv->ip.start_offset, srv->ip.end_size,
+			ov->offsets, srv->ip.count) != 0) return -1;
+	memset(&info, 0, sizeof(info));
+	info.size = srv->size;
+	info.blocks = srv->ip.count;
+	catalog_add(files->imgdir, ov->path, &info, ov->parent);
+	ov->flushes++;
+	return 0;
+}
+
+
+static void nbd_record(struct nbd_stats * const restrict st, const uint64_t len, const uint64_t us)
+{
+	const uint64_t units = (len + 4095) / 4096;
+	uint64_t per = units ? us / units : us;
+	unsigned int b = 0;
+
+	while (per > 1 && b < NBD_LAT_BUCKETS - 1) { per >>= 1; b++; }
+	pthread_mutex_lock(&st->lock);
+	st->reads++;
+	st->units += units;
+	st->bytes += len;
+	st->total_us += us;
+	if (units && us / units > st->max_us) st->max_us = us / units;
+	st->hist[b] += units;
+	pthread_mutex_unlock(&st->lock);
+}
+
+
+/* Upper edge of the bucket holding the given percentile of 4 KiB reads */
+static uint64_t nbd_percentile(const struct nbd_stats * const restrict st, const unsigned int pct)
+{
+	const uint64_t want = ((st->units * pct) + 99) / 100;
+	uint64_t seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < NBD_LAT_BUCKETS; b++) {
+		seen += st->hist[b];
+		if (seen >= want && seen > 0) return (uint64_t)1 << (b + 1);
+	}
+	return 0;
+}
+
+
+static void nbd_report(struct nbd_server * const restrict srv)
+{
+	struct nbd_stats * const st = &srv->stats;
+	struct nbd_cache * const c = &srv->cache;
+	unsigned int b;
+
+	pthread_mutex_lock(&c->lock);
+	pthread_mutex_lock(&st->lock);
+	fprintf(stderr, "Stats: %ju reads, %ju bytes, cache %ju hits / %ju misses in %ju DB runs\n",
+			(uintmax_t)st->reads, (uintmax_t)st->bytes, (uintmax_t)c->hits,
+			(uintmax_t)c->misses, (uintmax_t)c->runs);
+	if (st->units > 0) {
+		fprintf(stderr, "Latency per 4 KiB: mean %.1f us, p50 < %ju us, p99 < %ju us, max %ju us\n",
+				(double)st->total_us / (double)st->units,
+				(uintmax_t)nbd_percentile(st, 50), (uintmax_t)nbd_percentile(st, 99),
+				(uintmax_t)st->max_us);
+		for (b = 0; b < NBD_LAT_BUCKETS; b++) {
+			if (st->hist[b] == 0) continue;
+			fprintf(stderr, "  %8ju - %8ju us: %ju\n", (uintmax_t)(b ? (uint64_t)1 << b : 0),
+					(uintmax_t)((uint64_t)1 << (b + 1)), (uintmax_t)st->hist[b]);
+		}
+	}
+	if (srv->ov != NULL)
+		fprintf(stderr, "Overlay %s: %ju writes, %ju flushes, %ju blocks flushed (%ju new in DB), %u pending\n",
+				srv->ov->path, (uintmax_t)srv->ov->writes, (uintmax_t)srv->ov->flushes,
+				(uintmax_t)srv->ov->flushed, (uintmax_t)srv->ov->appended, srv->ov->used);
+	pthread_mutex_unlock(&st->lock);
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/* Handshake */
+
+static int nbd_opt_reply(const int fd, const uint32_t opt, const uint32_t type,
+		const void * const restrict data, const uint32_t len)
+{
+	unsigned char hdr[20];
+	uint64_t magic = htobe64(NBD_REP_MAGIC);
+	uint32_t v;
+
+	memcpy(hdr, &magic, 8);
+	v = htobe32(opt);
+	memcpy(hdr + 8, &v, 4);
+	v = htobe32(type);
+	memcpy(hdr + 12, &v, 4);
+	v = htobe32(len);
+	memcpy(hdr + 16, &v, 4);
+	if (write_full(fd, hdr, sizeof(hdr)) != 0) return -1;
+	if (len > 0 && write_full(fd, data, len) != 0) return -1;
+	return 0;
+}
+
+
+static uint16_t nbd_tx_flags(const struct nbd_server * const restrict srv)
+{
+	if (srv->ov != NULL) return (uint16_t)(NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH
+			| NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN);
+	return (uint16_t)(NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY
+			| NBD_FLAG_SEND_FLUSH | NBD_FLAG_CAN_MULTI_CONN);
+}
+
+
+/* Answer NBD_OPT_INFO / NBD_OPT_GO; returns 1 to enter transmission */
+static int nbd_opt_go(const struct nbd_server * const restrict srv, const int fd,
+		const uint32_t opt, const unsigned char * const restrict data, const uint32_t len)
+{
+	unsigned char info[14];
+	uint32_t namelen;
+	uint64_t size;
+	uint16_t v16;
+	uint32_t v32;
+
+	if (len < 6) return nbd_opt_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0) ? -1 : 0;
+	memcpy(&namelen, data, 4);
+	namelen = be32toh(namelen);
+	if ((uint64_t)namelen + 6 > len) return nbd_opt_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0) ? -1 : 0;
+	if (namelen > 0 && (namelen != strlen(srv->name) || memcmp(data + 4, srv->name, namelen)))
+		return nbd_opt_reply(fd, opt, NBD_REP_ERR_UNKNOWN, NULL, 0) ? -1 : 0;
+
+	v16 = htobe16(NBD_INFO_EXPORT);
+	memcpy(info, &v16, 2);
+	size = htobe64(srv->size);
+	memcpy(info + 2, &size, 8);
+	v16 = htobe16(nbd_tx_flags(srv));
+	memcpy(info + 10, &v16, 2);
+	if (nbd_opt_reply(fd, opt, NBD_REP_INFO, info, 12) != 0) return -1;
+
+	v16 = htobe16(NBD_INFO_BLOCK_SIZE);
+	memcpy(info, &v16, 2);
+	v32 = htobe32(1);
+	memcpy(info + 2, &v32, 4);
+	v32 = htobe32(B_SIZE);
+	memcpy(info + 6, &v32, 4);
+	v32 = htobe32(NBD_MAX_REQUEST);
+	memcpy(info + 10, &v32, 4);
+	if (nbd_opt_reply(fd, opt, NBD_REP_INFO, info, 14) != 0) return -1;
+
+	if (nbd_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0) != 0) return -1;
+	return opt == NBD_OPT_GO ? 1 : 0;
+}
+
+
+/* Fixed newstyle negotiation; returns 0 when transmission should start */
+static int nbd_handshake(const struct nbd_server * const restrict srv, const int fd)
+{
+	unsigned char hello[18], opthdr[16];
+	unsigned char *data;
+	uint64_t v64;
+	uint32_t cflags;
+	uint16_t v16;
+	int no_zeroes, ret = -1;
+
+	v64 = htobe64(NBD_MAGIC);
+	memcpy(hello, &v64, 8);
+	v64 = htobe64(NBD_OPTS_MAGIC);
+	memcpy(hello + 8, &v64, 8);
+	v16 = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	memcpy(hello + 16, &v16, 2);
+	if (write_full(fd, hello, sizeof(hello)) != 0) return -1;
+	if (read_full(fd, &cflags, 4) != 0) return -1;
+	cflags = be32toh(cflags);
+	no_zeroes = (cflags & NBD_FLAG_NO_ZEROES) != 0;
+
+	data = (unsigned char *)malloc(NBD_MAX_OPTION);
+	if (data == NULL) return -1;
+	while (1) {
+		uint32_t opt, len;
+
+		if (read_full(fd, opthdr, 16) != 0) break;
+		memcpy(&v64, opthdr, 8);
+		if (be64toh(v64) != NBD_OPTS_MAGIC) break;
+		memcpy(&opt, opthdr + 8, 4);
+		memcpy(&len, opthdr + 12, 4);
+		opt = be32toh(opt);
+		len = be32toh(len);
+		if (len > NBD_MAX_OPTION) break;
+		if (len > 0 && read_full(fd, data, len) != 0) break;
+
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME: {
+			unsigned char reply[10 + 124];
+			v64 = htobe64(srv->size);
+			memcpy(reply, &v64, 8);
+			v16 = htobe16(nbd_tx_flags(srv));
+			memcpy(reply + 8, &v16, 2);
+			memset(reply + 10, 0, 124);
+			if (write_full(fd, reply, no_zeroes ? 10 : sizeof(reply)) == 0) ret = 0;
+			goto done;
+		}
+		case NBD_OPT_ABORT:
+			nbd_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+			goto done;
+		case NBD_OPT_LIST: {
+			const uint32_t nlen = (uint32_t)strlen(srv->name);
+			unsigned char entry[4 + PATH_MAX];
+			const uint32_t be = htobe32(nlen);
+			memcpy(entry, &be, 4);
+			memcpy(entry + 4, srv->name, nlen);
+			if (nbd_opt_reply(fd, opt, NBD_REP_SERVER, entry, nlen + 4) != 0) goto done;
+			if (nbd_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0) != 0) goto done;
+			break;
+		}
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO: {
+			const int r = nbd_opt_go(srv, fd, opt, data, len);
+			if (r < 0) goto done;
+			if (r > 0) {
+				ret = 0;
+				goto done;
+			}
+			break;
+		}
+		default:
+			if (nbd_opt_reply(fd, opt, NBD_REP_ERR_UNSUP, NULL, 0) != 0) goto done;
+			break;
+		}
+	}
+done:
+	free(data);
+	return ret;
+}
+
+
+/* Transmission phase */
+
+static int nbd_reply(const int fd, const uint32_t error, const unsigned char * const restrict handle,
+		const void * const restrict data, const size_t len)
+{
+	unsigned char hdr[16];
+	uint32_t v;
+
+	v = htobe32(NBD_REPLY_MAGIC);
+	memcpy(hdr, &v, 4);
+	v = htobe32(error);
+	memcpy(hdr + 4, &v, 4);
+	memcpy(hdr + 8, handle, 8);
+	if (write_full(fd, hdr, 16) != 0) return -1;
+	if (len > 0 && write_full(fd, data, len) != 0) return -1;
+	return 0;
+}
+
+
+static void *nbd_conn_main(void *arg)
+{
+	struct nbd_conn * const conn = (struct nbd_conn *)arg;
+	struct nbd_server * const srv = conn->srv;
+	const struct ipil_t * const ip = &srv->ip;
+	struct nbd_miss *miss;
+	char *buf, *discard;
+	uint64_t seq_end = UINT64_MAX, ra_end = 0;
+
+	buf = (char *)malloc(NBD_MAX_REQUEST);
+	discard = (char *)malloc(B_SIZE * 16);
+	miss = (struct nbd_miss *)malloc(((NBD_MAX_REQUEST / B_SIZE) + NBD_READAHEAD + 2) * sizeof(struct nbd_miss));
+	if (buf == NULL || discard == NULL || miss == NULL) {
+		fprintf(stderr, "Error: out of memory for NBD connection %u\n", conn->id);
+		goto close;
+	}
+	if (nbd_handshake(srv, conn->fd) != 0) {
+		fprintf(stderr, "NBD client %u: negotiation ended without an export\n", conn->id);
+		goto close;
+	}
+	fprintf(stderr, "NBD client %u: connected\n", conn->id);
+
+	while (1) {
+		unsigned char req[28];
+		uint32_t magic, len;
+		uint16_t cflags, type;
+		uint64_t pos;
+
+		if (read_full(conn->fd, req, sizeof(req)) != 0) break;
+		memcpy(&magic, req, 4);
+		if (be32toh(magic) != NBD_REQUEST_MAGIC) {
+			fprintf(stderr, "NBD client %u: bad request magic\n", conn->id);
+			break;
+		}
+		memcpy(&cflags, req + 4, 2);
+		memcpy(&type, req + 6, 2);
+		memcpy(&pos, req + 16, 8);
+		memcpy(&len, req + 24, 4);
+		cflags = be16toh(cflags);
+		type = be16toh(type);
+		pos = be64toh(pos);
+		len = be32toh(len);
+
+		if (type == NBD_CMD_DISC) break;
+		if (type == NBD_CMD_FLUSH) {
+			uint32_t error = 0;
+			if (srv->ov != NULL) {
+				pthread_mutex_lock(&srv->cache.lock);
+				if (nbd_overlay_flush(srv, 0) != 0) error = NBD_EIO;
+				pthread_mutex_unlock(&srv->cache.lock);
+			}
+			if (nbd_reply(conn->fd, error, req + 8, NULL, 0) != 0) break;
+			continue;
+		}
+		if (srv->ov != NULL && (type == NBD_CMD_WRITE || type == NBD_CMD_WRITE_ZEROES)) {
+			uint32_t error = 0;
+
+			if (type == NBD_CMD_WRITE) {
+				if (len > NBD_MAX_REQUEST) {
+					fprintf(stderr, "NBD client %u: write of %" PRIu32 " bytes is too large\n", conn->id, len);
+					break;
+				}
+				if (read_full(conn->fd, buf, len) != 0) break;
+			}
+			if (pos > srv->size || len > srv->size - pos) error = NBD_ENOSPC;
+			else if (len > 0) {
+				pthread_mutex_lock(&srv->cache.lock);
+				error = nbd_overlay_write(srv, type == NBD_CMD_WRITE ? buf : NULL, pos, len);
+				/* The delta is not recoverable, so FUA needs a full flush */
+				if (error == 0 && (cflags & NBD_CMD_FLAG_FUA) && nbd_overlay_flush(srv, 0) != 0) error = NBD_EIO;
+				pthread_mutex_unlock(&srv->cache.lock);
+			}
+			seq_end = UINT64_MAX;
+			if (nbd_reply(conn->fd, error, req + 8, NULL, 0) != 0) break;
+			continue;
+		}
+		if (type == NBD_CMD_WRITE) {
+			/* Drain the payload so the stream stays in sync */
+			uint32_t left = len;
+			while (left > 0) {
+				const uint32_t n = left > B_SIZE * 16 ? B_SIZE * 16 : left;
+				if (read_full(conn->fd, discard, n) != 0) goto close;
+				left -= n;
+			}
+			if (nbd_reply(conn->fd, NBD_EPERM, req + 8, NULL, 0) != 0) break;
+			continue;
+		}
+		if (type != NBD_CMD_READ) {
+			if (nbd_reply(conn->fd, NBD_ENOTSUP, req + 8, NULL, 0) != 0) break;
+			continue;
+		}
+		if (len > NBD_MAX_REQUEST || pos > srv->size || len > srv->size - pos) {
+			if (nbd_reply(conn->fd, NBD_EINVAL, req + 8, NULL, 0) != 0) break;
+			continue;
+		}
+
+		{
+			const uint64_t t0 = nbd_now_us();
+			uint32_t error = 0;
+
+			if (len > 0) {
+				const uint64_t first = (pos < (uint64_t)(B_SIZE - ip->start_offset)) ? 0
+						: (pos + ip->start_offset) / B_SIZE;
+				const uint64_t last = (pos + len - 1 < (uint64_t)(B_SIZE - ip->start_offset)) ? 0
+						: (pos + len - 1 + ip->start_offset) / B_SIZE;
+
+				pthread_mutex_lock(&srv->cache.lock);
+				if (nbd_fetch(srv, miss, first, last + 1, buf, pos, len) != 0) error = NBD_EIO;
+				pthread_mutex_unlock(&srv->cache.lock);
+
+				/* Sequential reader: fetch the next window before it asks */
+				if (error == 0 && pos == seq_end && last + 1 < ip->count && ra_end <= last + 1 + (NBD_READAHEAD / 2)) {
+					const uint64_t ra_first = ra_end > last + 1 ? ra_end : last + 1;
+					uint64_t ra_last = last + 1 + NBD_READAHEAD;
+					if (ra_last > ip->count) ra_last = ip->count;
+					if (ra_first < ra_last) {
+						pthread_mutex_lock(&srv->cache.lock);
+						nbd_fetch(srv, miss, ra_first, ra_last, NULL, 0, 0);
+						pthread_mutex_unlock(&srv->cache.lock);
+						ra_end = ra_last;
+					}
+				}
+				seq_end = pos + len;
+			}
+			if (nbd_reply(conn->fd, error, req + 8, buf, error ? 0 : len) != 0) break;
+			if (error == 0) nbd_record(&srv->stats, len, nbd_now_us() - t0);
+		}
+	}
+	fprintf(stderr, "NBD client %u: disconnected\n", conn->id);
+	if (srv->ov != NULL) {
+		pthread_mutex_lock(&srv->cache.lock);
+		if (nbd_overlay_flush(srv, 0) != 0)
+			fprintf(stderr, "Error: cannot flush overlay %s: %s\n", srv->ov->path, strerror(errno));
+		pthread_mutex_unlock(&srv->cache.lock);
+	}
+	nbd_report(srv);
+
+close:
+	free(buf);
+	free(discard);
+	free(miss);
+	pthread_mutex_lock(&srv->conn_lock);
+	conn->done = 1;
+	pthread_mutex_unlock(&srv->conn_lock);
+	return NULL;
+}
+
+
+/* Join finished connection threads, or with all set, disconnect every
+ * client and join them all */
+static void nbd_reap(struct nbd_server * const restrict srv, const int all)
+{
+	struct nbd_conn **pp = &srv->conns, *c;
+
+	if (all) {
+		pthread_mutex_lock(&srv->conn_lock);
+		for (c = srv->conns; c != NULL; c = c->next)
+			if (!c->done) shutdown(c->fd, SHUT_RDWR);
+		pthread_mutex_unlock(&srv->conn_lock);
+	}
+	while ((c = *pp) != NULL) {
+		int done;
+
+		pthread_mutex_lock(&srv->conn_lock);
+		done = c->done;
+		pthread_mutex_unlock(&srv->conn_lock);
+		if (!done && !all) {
+			pp = &c->next;
+			continue;
+		}
+		pthread_join(c->thread, NULL);
+		close(c->fd);
+		*pp = c->next;
+		free(c);
+	}
+	return;
+}
+
+
+/* serve-nbd image_file --socket path [--cache blocks] [--overlay new_image] */
+extern int serve_nbd(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct nbd_server srv;
+	struct sockaddr_un addr;
+	struct sigaction act;
+	struct stat st;
+	struct nbd_overlay ov;
+	const char *image = NULL, *sockpath = NULL, *overlay = NULL;
+	unsigned long cache_blocks = NBD_CACHE_DEFAULT;
+	unsigned int next_id = 1;
+	int lfd, i;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--socket") && i + 1 < argc) sockpath = argv[++i];
+		else if (!strcmp(argv[i], "--cache") && i + 1 < argc) cache_blocks = strtoul(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--overlay") && i + 1 < argc) overlay = argv[++i];
+		else if (image == NULL) image = argv[i];
+		else return 1;
+	}
+	if (image == NULL || sockpath == NULL) return 1;
+	if (cache_blocks < NBD_RUN_BLOCKS * 4) cache_blocks = NBD_RUN_BLOCKS * 4;
+	if (cache_blocks > UINT32_MAX / 2) cache_blocks = UINT32_MAX / 2;
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: socket path too long: %s\n", sockpath);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&srv, 0, sizeof(srv));
+	srv.files = files;
+	srv.name = ipil_base_name(image);
+	if (ipil_open(image, &srv.ip) != 0) exit(EXIT_FAILURE);
+	srv.size = ipil_image_size(&srv.ip);
+	if (nbd_cache_init(&srv.cache, (uint32_t)cache_blocks) != 0) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&srv.stats.lock, NULL);
+	pthread_mutex_init(&srv.conn_lock, NULL);
+
+	if (overlay != NULL) {
+		char path[PATH_MAX + 32];
+
+		if (!strcmp(overlay, image)) {
+			fprintf(stderr, "Error: the overlay must be a new image file, not %s\n", image);
+			exit(EXIT_FAILURE);
+		}
+		memset(&ov, 0, sizeof(ov));
+		ov.path = overlay;
+		ov.parent = image;
+		ov.offsets = (uint32_t *)malloc((srv.ip.count ? srv.ip.count : 1) * sizeof(uint32_t));
+		ov.slot = (uint32_t *)calloc(srv.ip.count ? srv.ip.count : 1, sizeof(uint32_t));
+		if (ov.offsets == NULL || ov.slot == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(ov.offsets, srv.ip.offsets, srv.ip.count * sizeof(uint32_t));
+		srv.ip.offsets = ov.offsets;
+		snprintf(path, sizeof(path), "%s/.overlay_delta.%ld.tmp", files->imgdir, (long)getpid());
+		if ((ov.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+			fprintf(stderr, "Error: cannot create overlay delta %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		unlink(path);
+		load_hash_index(files);
+		srv.ov = &ov;
+
+		/* The clone exists (sharing every block) before any client connects */
+		if (nbd_overlay_flush(&srv, 1) != 0) {
+			fprintf(stderr, "Error: cannot write overlay image %s\n", overlay);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Replace a stale socket from an earlier run, but nothing else */
+	if (lstat(sockpath, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "Error: %s exists and is not a socket\n", sockpath);
+			exit(EXIT_FAILURE);
+		}
+		unlink(sockpath);
+	}
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) goto error_socket;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto error_socket;
+	if (listen(lfd, 16) != 0) goto error_socket;
+
+	/* Stop cleanly on INT/TERM so the stats get reported */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = nbd_sig_handler;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (overlay != NULL) fprintf(stderr, "Serving %s (%ju bytes) as export '%s' on %s, writing changes to %s\n",
+			image, (uintmax_t)srv.size, srv.name, sockpath, overlay);
+	else fprintf(stderr, "Serving %s (%ju bytes) read-only as export '%s' on %s\n",
+			image, (uintmax_t)srv.size, srv.name, sockpath);
+	fprintf(stderr, "Block cache: %lu blocks (%lu MiB)\n", cache_blocks, (cache_blocks * B_SIZE) >> 20);
+
+	while (!nbd_stop) {
+		struct nbd_conn *conn;
+		const int cfd = accept(lfd, NULL, NULL);
+
+		nbd_reap(&srv, 0);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			goto error_socket;
+		}
+		conn = (struct nbd_conn *)calloc(1, sizeof(struct nbd_conn));
+		if (conn == NULL) {
+			close(cfd);
+			continue;
+		}
+		conn->srv = &srv;
+		conn->fd = cfd;
+		conn->id = next_id++;
+		if (pthread_create(&conn->thread, NULL, nbd_conn_main, conn) != 0) {
+			fprintf(stderr, "Error: cannot create NBD connection thread\n");
+			close(cfd);
+			free(conn);
+			continue;
+		}
+		conn->next = srv.conns;
+		srv.conns = conn;
+	}
+
+	fprintf(stderr, "\nStopping NBD server\n");
+	close(lfd);
+	unlink(sockpath);
+	/* Connections use srv and the DB; they must end before both go away */
+	nbd_reap(&srv, 1);
+	if (srv.ov != NULL) {
+		pthread_mutex_lock(&srv.cache.lock);
+		if (nbd_overlay_flush(&srv, 0) != 0) {
+			fprintf(stderr, "Error: cannot flush overlay %s: %s\n", overlay, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		pthread_mutex_unlock(&srv.cache.lock);
+	}
+	nbd_report(&srv);
+	if (srv.ov != NULL) fclose(files->hashindex);
+	return 0;
+
+error_socket:
+	fprintf(stderr, "Error: NBD socket %s: %s\n", sockpath, strerror(errno));
+	unlink(sockpath);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,19 @@
+/* Read-only NBD server headers
+ * See imagepile.c for copyright information */
+
+#ifndef NBD_H
+#define NBD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int serve_nbd(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* NBD_H */
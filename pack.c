@@ -0,0 +1,277 @@
+/*
+ * Subset pack export/import
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * A pack is a self-contained stream holding a set of images and only
+ * the DB blocks those images reference, with each block stored once.
+ * Image offsets inside a pack are indices into the pack's own block
+ * list; importing a pack adds its blocks to the local pile (reusing
+ * any blocks the pile already has) and remaps the offsets to match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "hotcache.h"
+#include "pack.h"
+#include "catalog.h"
+
+/* Blocks to read from the DB at once while exporting */
+#define PACK_RUN_BLOCKS 256
+
+/* Offsets to remap at once while importing */
+#define PACK_OFFSET_CHUNK (B_SIZE / sizeof(uint32_t))
+
+
+static void pack_write(const void * const restrict data, const size_t len,
+		FILE * const restrict out)
+{
+	if (fwrite(data, 1, len, out) != len) {
+		fprintf(stderr, "Error: short write to pack output\n");
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+
+static void pack_read(void * const restrict data, const size_t len,
+		FILE * const restrict in, const char * const restrict name)
+{
+	if (fread(data, 1, len, in) != len) {
+		fprintf(stderr, "Error: pack %s is truncated or unreadable\n", name);
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+
+/* export-pack image_file... > pack_file */
+extern int pack_export(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct ipil_t *images;
+	uint32_t *blocks;
+	char *buf;
+	size_t block_count;
+	uint64_t refs, u64;
+	uint32_t u32;
+	size_t i, j;
+	FILE *out = stdout;
+
+	if (argc < 1) return 1;
+	if (isatty(fileno(out))) {
+		fprintf(stderr, "Error: refusing to write a pack to a terminal; redirect stdout\n");
+		exit(EXIT_FAILURE);
+	}
+
+	images = (struct ipil_t *)calloc((size_t)argc, sizeof(struct ipil_t));
+	if (images == NULL) goto oom;
+	for (i = 0; i < (size_t)argc; i++)
+		if (ipil_open(argv[i], &images[i]) != 0) exit(EXIT_FAILURE);
+
+	/* The sorted list of used blocks defines the pack block order */
+	blocks = ipil_collect_blocks(images, (size_t)argc, db_block_count(files),
+			&block_count, &refs);
+
+	fprintf(stderr, "Exporting %d images: %ju unique blocks for %ju references\n",
+			argc, (uintmax_t)block_count, (uintmax_t)refs);
+
+	/* Header */
+	pack_write("IPAK", 4, out);
+	u32 = PACK_VERSION; pack_write(&u32, 4, out);
+	u32 = B_SIZE; pack_write(&u32, 4, out);
+	u32 = (uint32_t)argc; pack_write(&u32, 4, out);
+	u64 = block_count; pack_write(&u64, 8, out);
+
+	/* Block data, read in runs of consecutive DB blocks */
+	buf = (char *)malloc(PACK_RUN_BLOCKS * B_SIZE);
+	if (buf == NULL) goto oom;
+	for (i = 0; i < block_count; ) {
+		size_t run = 1;
+		const void *cached = hotcache_get((off_t)blocks[i]);
+
+		if (cached != NULL) {
+			pack_write(cached, B_SIZE, out);
+			i++;
+			continue;
+		}
+		while (run < PACK_RUN_BLOCKS && (i + run) < block_count
+				&& blocks[i + run] == blocks[i] + run) run++;
+		read_db_run(buf, (off_t)blocks[i], run, files);
+		pack_write(buf, run * B_SIZE, out);
+		i += run;
+	}
+
+	/* Image metadata with offsets remapped to pack block indices */
+	for (i = 0; i < (size_t)argc; i++) {
+		const char *name = ipil_base_name(argv[i]);
+		uint32_t *remap = (uint32_t *)buf;
+		uint64_t count = images[i].count;
+
+		u32 = (uint32_t)strlen(name); pack_write(&u32, 4, out);
+		pack_write(name, u32, out);
+		pack_write(&images[i].start_offset, 4, out);
+		pack_write(&images[i].end_size, 4, out);
+		pack_write(&count, 8, out);
+		for (j = 0; j < images[i].count; ) {
+			size_t k, n = images[i].count - j;
+			if (n > PACK_OFFSET_CHUNK) n = PACK_OFFSET_CHUNK;
+			for (k = 0; k < n; k++)
+				remap[k] = (uint32_t)ipil_block_index(blocks, block_count, images[i].offsets[j + k]);
+			pack_write(remap, n * sizeof(uint32_t), out);
+			j += n;
+		}
+		ipil_close(&images[i]);
+	}
+	pack_write("KAPI", 4, out);
+	if (fflush(out) != 0) {
+		fprintf(stderr, "Error: short write to pack output\n");
+		exit(EXIT_FAILURE);
+	}
+
+	free(buf);
+	free(blocks);
+	free(images);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* import-pack pack_file dest_dir */
+extern int pack_import(struct files_t * const restrict files, int argc, char **argv)
+{
+	const char *packname;
+	FILE *in;
+	char magic[4];
+	char blk[B_SIZE];
+	char path[PATH_MAX];
+	uint32_t version, bsize, image_count, *map;
+	uint64_t block_count, i, percent = 0;
+	uint64_t blocks_before;
+
+	if (argc != 2) return 1;
+	packname = argv[0];
+	if (!strcmp(packname, "-")) in = stdin;
+	else if (!(in = fopen(packname, "rb"))) {
+		fprintf(stderr, "Error: cannot open pack: %s\n", packname);
+		exit(EXIT_FAILURE);
+	}
+
+	pack_read(magic, 4, in, packname);
+	pack_read(&version, 4, in, packname);
+	pack_read(&bsize, 4, in, packname);
+	pack_read(&image_count, 4, in, packname);
+	pack_read(&block_count, 8, in, packname);
+	if (memcmp(magic, "IPAK", 4)) {
+		fprintf(stderr, "Error: bad magic number at start of %s\n", packname);
+		exit(EXIT_FAILURE);
+	}
+	if (version != PACK_VERSION || bsize != B_SIZE) {
+		fprintf(stderr, "Error: unsupported pack version %" PRIu32 " or block size %" PRIu32 "\n",
+				version, bsize);
+		exit(EXIT_FAILURE);
+	}
+
+	load_hash_index(files);
+	blocks_before = (uint64_t)db_block_count(files);
+
+	/* Add pack blocks to the pile, deduplicating against the index */
+	map = (uint32_t *)malloc((size_t)(block_count ? block_count : 1) * sizeof(uint32_t));
+	if (map == NULL) goto oom;
+	for (i = 0; i < block_count; i++) {
+		pack_read(blk, B_SIZE, in, packname);
+		map[i] = get_block_offset(blk, files);
+		if (((i + 1) * 100) / block_count > percent) {
+			percent = ((i + 1) * 100) / block_count;
+			fprintf(stderr, "\r%u%% of blocks imported (%jd hash fails) ",
+					(unsigned int)percent, (intmax_t)stats_hash_failures);
+		}
+	}
+	if (block_count > 0) fprintf(stderr, "\n");
+	fflush(files->db);
+	fflush(files->hashindex);
+
+	/* Write out each image with offsets remapped into this pile */
+	for (; image_count > 0; image_count--) {
+		struct catalog_entry info;
+		uint32_t hdr[3], len;
+		uint64_t count;
+		uint32_t *offsets = (uint32_t *)blk;
+		FILE *out;
+
+		pack_read(&len, 4, in, packname);
+		if (len == 0 || len >= 256) goto error_name;
+		pack_read(path, len, in, packname);
+		path[len] = '\0';
+		if (strchr(path, '/') || !strcmp(path, ".") || !strcmp(path, "..")) goto error_name;
+		memcpy(hdr, "IPIL", 4);
+		pack_read(&hdr[1], 4, in, packname);
+		pack_read(&hdr[2], 4, in, packname);
+		pack_read(&count, 8, in, packname);
+		if (hdr[1] >= B_SIZE || hdr[2] > B_SIZE) goto error_name;
+		memset(&info, 0, sizeof(info));
+		info.blocks = count;
+		if (count > 1) info.size = ((count - 1) * B_SIZE) - hdr[1] + hdr[2];
+		else if (count == 1) info.size = hdr[2];
+
+		if (strlen(argv[1]) + len + 2 > PATH_MAX) goto error_name;
+		memmove(path + strlen(argv[1]) + 1, path, len + 1);
+		memcpy(path, argv[1], strlen(argv[1]));
+		path[strlen(argv[1])] = '/';
+		if (!(out = fopen(path, "wb"))) {
+			fprintf(stderr, "Error: cannot open outfile: %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(hdr, 1, HDR_SIZE, out) != HDR_SIZE) goto error_write;
+		while (count > 0) {
+			size_t k, n = (count > PACK_OFFSET_CHUNK) ? PACK_OFFSET_CHUNK : (size_t)count;
+			pack_read(offsets, n * sizeof(uint32_t), in, packname);
+			for (k = 0; k < n; k++) {
+				if (offsets[k] >= block_count) {
+					fprintf(stderr, "Error: pack %s has an out-of-range block index\n", packname);
+					exit(EXIT_FAILURE);
+				}
+				offsets[k] = map[offsets[k]];
+			}
+			if (fwrite(offsets, sizeof(uint32_t), n, out) != n) goto error_write;
+			count -= n;
+		}
+		if (fclose(out) != 0) goto error_write;
+		catalog_add(files->imgdir, path, &info, NULL);
+		fprintf(stderr, "Imported image %s\n", path);
+	}
+
+	pack_read(magic, 4, in, packname);
+	if (memcmp(magic, "KAPI", 4)) {
+		fprintf(stderr, "Error: pack %s has a bad trailer\n", packname);
+		exit(EXIT_FAILURE);
+	}
+	if (in != stdin) fclose(in);
+	fclose(files->hashindex);
+	fprintf(stderr, "Stats: %ju pack blocks, %ju new in pile, %ju hash failures\n",
+			(uintmax_t)block_count,
+			(uintmax_t)((uint64_t)db_block_count(files) - blocks_before),
+			(uintmax_t)stats_hash_failures);
+	free(map);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_name:
+	fprintf(stderr, "Error: pack %s has an invalid image entry\n", packname);
+	exit(EXIT_FAILURE);
+error_write:
+	fprintf(stderr, "Error writing %s\n", path);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,31 @@
+/* Subset pack export/import headers
+ * See imagepile.c for copyright information */
+
+#ifndef PACK_H
+#define PACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+/*
+ * Pack stream layout (all integers in native byte order, as in .ipil files)
+ * Header:  'IPAK', version (u32), B_SIZE (u32), image count (u32),
+ *          block count (u64)
+ * Blocks:  block count * B_SIZE bytes of unique block data
+ * Images:  name length (u32), name, start_offset (u32), end_size (u32),
+ *          offset count (u64), offset count * u32 pack block indices
+ * Trailer: 'KAPI'
+ */
+#define PACK_VERSION 1
+
+extern int pack_export(struct files_t * const restrict files, int argc, char **argv);
+extern int pack_import(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* PACK_H */
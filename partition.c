@@ -0,0 +1,288 @@
+/*
+ * Partition table parsing and partition extraction
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Reads the MBR (including the extended partition's EBR chain) or GPT
+ * of an image through the range reader, so only the few DB blocks that
+ * hold the tables are fetched, then extracts a single partition's byte
+ * range without restoring the rest of the disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "range.h"
+#include "partition.h"
+
+#define SECTOR 512
+
+/* GPT may use 512- or 4096-byte logical sectors */
+#define GPT_SECTOR_4K 4096
+
+/* Partition data read per pass, with readahead one pass ahead */
+#define PART_CHUNK (8 * 1024 * 1024)
+
+/* Longest EBR chain followed before assuming a loop */
+#define EBR_MAX 256
+
+
+static uint32_t get_le32(const unsigned char * const restrict p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static uint64_t get_le64(const unsigned char * const restrict p)
+{
+	return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+
+/* Pile images are read through the range reader */
+struct image_ctx {
+	const struct files_t *files;
+	const struct ipil_t *ip;
+};
+
+static int read_image(void * const restrict ctx, void * const restrict buf,
+		const uint64_t pos, const size_t len)
+{
+	const struct image_ctx * const ic = (const struct image_ctx *)ctx;
+	return image_read_range(ic->files, ic->ip, buf, pos, len) == (ssize_t)len ? 0 : -1;
+}
+
+
+static int is_extended(const unsigned char type)
+{
+	return (type == 0x05 || type == 0x0f || type == 0x85);
+}
+
+
+/* Format a GPT type GUID in its usual mixed-endian text form */
+static void gpt_guid(char * const restrict out, const size_t outlen,
+		const unsigned char * const restrict g)
+{
+	snprintf(out, outlen, "%08" PRIx32 "-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+			get_le32(g), (unsigned int)(g[4] | (g[5] << 8)),
+			(unsigned int)(g[6] | (g[7] << 8)), g[8], g[9],
+			g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+
+static int gpt_table(const partition_reader read_exact, void * const restrict ctx,
+		struct partition * const restrict parts, unsigned int * const restrict count)
+{
+	static const unsigned char zero_guid[16];
+	unsigned char hdr[SECTOR], *entries;
+	uint64_t sector, table, nent, esize, i;
+
+	for (sector = SECTOR; sector <= GPT_SECTOR_4K; sector *= 8) {
+		if (read_exact(ctx, hdr, sector, SECTOR) != 0) return -1;
+		if (!memcmp(hdr, "EFI PART", 8)) break;
+	}
+	if (sector > GPT_SECTOR_4K) return -1;
+
+	table = get_le64(hdr + 72) * sector;
+	nent = get_le32(hdr + 80);
+	esize = get_le32(hdr + 84);
+	if (esize < 128 || esize > 4096 || nent > 4096) return -1;
+	entries = (unsigned char *)malloc((size_t)(nent * esize));
+	if (entries == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	if (read_exact(ctx, entries, table, (size_t)(nent * esize)) != 0) {
+		free(entries);
+		return -1;
+	}
+	for (i = 0; i < nent && *count < PART_MAX; i++) {
+		const unsigned char * const e = entries + (i * esize);
+		const uint64_t first = get_le64(e + 32), last = get_le64(e + 40);
+		struct partition * const p = &parts[*count];
+
+		if (!memcmp(e, zero_guid, 16) || last < first) continue;
+		p->number = (unsigned int)(i + 1);
+		p->start = first * sector;
+		p->size = (last - first + 1) * sector;
+		gpt_guid(p->type, sizeof(p->type), e);
+		(*count)++;
+	}
+	free(entries);
+	return 0;
+}
+
+
+/* Parse the partition table at the start of a disk read through read_exact
+ * Returns 0 with the partitions found, or -1 if there is no usable table */
+extern int partition_table_read(const partition_reader read_exact, void * const restrict ctx,
+		struct partition * const restrict parts, unsigned int * const restrict count,
+		const char ** const restrict scheme)
+{
+	unsigned char mbr[SECTOR];
+	uint64_t ext_start = 0;
+	unsigned int i;
+
+	*count = 0;
+	if (read_exact(ctx, mbr, 0, SECTOR) != 0) return -1;
+	if (mbr[510] != 0x55 || mbr[511] != 0xaa) return -1;
+
+	for (i = 0; i < 4; i++) {
+		if (mbr[446 + (i * 16) + 4] == 0xee) {
+			*scheme = "GPT";
+			return gpt_table(read_exact, ctx, parts, count);
+		}
+	}
+
+	*scheme = "MBR";
+	for (i = 0; i < 4; i++) {
+		const unsigned char * const e = mbr + 446 + (i * 16);
+		struct partition * const p = &parts[*count];
+
+		if (e[4] == 0 || get_le32(e + 12) == 0) continue;
+		p->number = i + 1;
+		p->start = (uint64_t)get_le32(e + 8) * SECTOR;
+		p->size = (uint64_t)get_le32(e + 12) * SECTOR;
+		snprintf(p->type, sizeof(p->type), "0x%02x", e[4]);
+		(*count)++;
+		if (is_extended(e[4]) && ext_start == 0) ext_start = p->start;
+	}
+
+	/* Logical partitions: each EBR holds one partition (relative to the
+	 * EBR) and a link to the next EBR (relative to the extended one) */
+	if (ext_start != 0) {
+		uint64_t ebr = ext_start;
+		unsigned int number = 5, hops;
+
+		for (hops = 0; hops < EBR_MAX && *count < PART_MAX; hops++) {
+			unsigned char sec[SECTOR];
+			const unsigned char *e = sec + 446;
+			struct partition * const p = &parts[*count];
+
+			if (read_exact(ctx, sec, ebr, SECTOR) != 0) break;
+			if (sec[510] != 0x55 || sec[511] != 0xaa) break;
+			if (e[4] != 0 && get_le32(e + 12) != 0) {
+				p->number = number++;
+				p->start = ebr + ((uint64_t)get_le32(e + 8) * SECTOR);
+				p->size = (uint64_t)get_le32(e + 12) * SECTOR;
+				snprintf(p->type, sizeof(p->type), "0x%02x", e[4]);
+				(*count)++;
+			}
+			e += 16;
+			if (!is_extended(e[4]) || get_le32(e + 8) == 0) break;
+			ebr = ext_start + ((uint64_t)get_le32(e + 8) * SECTOR);
+		}
+	}
+	return 0;
+}
+
+
+/* Parse the partition table of a pile image */
+extern int partition_table(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip,
+		struct partition * const restrict parts, unsigned int * const restrict count,
+		const char ** const restrict scheme)
+{
+	struct image_ctx ic;
+
+	ic.files = files;
+	ic.ip = ip;
+	return partition_table_read(read_image, &ic, parts, count, scheme);
+}
+
+
+/* read --partition N image_file output_file */
+extern void partition_read(const struct files_t * const restrict files,
+		const unsigned int number, const char * const restrict image,
+		const char * const restrict outpath)
+{
+	struct partition parts[PART_MAX];
+	const struct partition *part = NULL;
+	struct ipil_t ip;
+	const char *scheme = NULL;
+	unsigned int count, i;
+	uint64_t done = 0, size;
+	char *buf;
+	int fd;
+
+	if (ipil_open(image, &ip) != 0) exit(EXIT_FAILURE);
+	if (partition_table(files, &ip, parts, &count, &scheme) != 0) {
+		fprintf(stderr, "Error: no readable partition table in %s\n", image);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < count; i++) if (parts[i].number == number) part = &parts[i];
+	if (part == NULL) {
+		fprintf(stderr, "Error: %s has no partition %u; its %s table holds:\n",
+				image, number, scheme);
+		for (i = 0; i < count; i++)
+			fprintf(stderr, "  %3u  start %12ju  size %12ju  type %s\n", parts[i].number,
+					(uintmax_t)parts[i].start, (uintmax_t)parts[i].size, parts[i].type);
+		exit(EXIT_FAILURE);
+	}
+	size = part->size;
+	if (part->start >= ipil_image_size(&ip)) size = 0;
+	else if (size > ipil_image_size(&ip) - part->start) {
+		size = ipil_image_size(&ip) - part->start;
+		fprintf(stderr, "Warning: partition %u runs past the end of the image; truncating to %ju bytes\n",
+				number, (uintmax_t)size);
+	}
+
+	if (!strcmp(outpath, "-")) fd = STDOUT_FILENO;
+	else if ((fd = open(outpath, O_WRONLY | O_CREAT, 0644)) < 0) goto error_out;
+	buf = (char *)malloc(PART_CHUNK);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "Extracting %s partition %u (%ju bytes at offset %ju)\n",
+			scheme, number, (uintmax_t)size, (uintmax_t)part->start);
+	image_prefetch_range(files, &ip, part->start, PART_CHUNK);
+	while (done < size) {
+		size_t want = PART_CHUNK, w = 0;
+		ssize_t got;
+
+		if (want > size - done) want = (size_t)(size - done);
+		/* Advise the next chunk while this one is copied */
+		if (done + want < size) image_prefetch_range(files, &ip, part->start + done + want, PART_CHUNK);
+		got = image_read_range(files, &ip, buf, part->start + done, want);
+		if (got != (ssize_t)want) {
+			fprintf(stderr, "Error reading %s\n", files->dbfile);
+			exit(EXIT_FAILURE);
+		}
+		while (w < want) {
+			const ssize_t r = write(fd, buf + w, want - w);
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				goto error_out;
+			}
+			w += (size_t)r;
+		}
+		done += want;
+		fprintf(stderr, "\r%u%% extracted ", (unsigned int)((done * 100) / size));
+	}
+	if (size > 0) fprintf(stderr, "\n");
+	free(buf);
+	if (fd != STDOUT_FILENO) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(fd, (off_t)size) != 0) goto error_out;
+		if (fsync(fd) != 0 || close(fd) != 0) goto error_out;
+	}
+	fprintf(stderr, "Stats: %ju of %ju image blocks read from the DB\n",
+			(uintmax_t)stats_range_blocks, (uintmax_t)ip.count);
+	ipil_close(&ip);
+	return;
+
+error_out:
+	fprintf(stderr, "Error writing %s: %s\n", outpath, strerror(errno));
+	exit(EXIT_FAILURE);
+}
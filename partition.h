@@ -0,0 +1,44 @@
+/* Partition table parsing headers
+ * See imagepile.c for copyright information */
+
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "imagepile.h"
+#include "ipil.h"
+
+/* Upper limit on partitions returned from one table */
+#define PART_MAX 128
+
+struct partition {
+	unsigned int number;	/* Linux-style: MBR 1-4 primary, 5+ logical; GPT entry + 1 */
+	uint64_t start;		/* Byte offset in the image */
+	uint64_t size;		/* Length in bytes */
+	char type[40];		/* MBR type byte or GPT type GUID */
+};
+
+/* Reads len bytes at pos of a disk; returns 0, or -1 if they are not all there */
+typedef int (*partition_reader)(void * const restrict ctx, void * const restrict buf,
+		const uint64_t pos, const size_t len);
+
+extern int partition_table_read(const partition_reader read_exact, void * const restrict ctx,
+		struct partition * const restrict parts, unsigned int * const restrict count,
+		const char ** const restrict scheme);
+extern int partition_table(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip,
+		struct partition * const restrict parts, unsigned int * const restrict count,
+		const char ** const restrict scheme);
+extern void partition_read(const struct files_t * const restrict files,
+		const unsigned int number, const char * const restrict image,
+		const char * const restrict outpath);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* PARTITION_H */
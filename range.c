@@ -0,0 +1,216 @@
+/*
+ * Random access to image data
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Maps a byte range of an image's original data to the image blocks that
+ * hold it (accounting for the shortened first block and the partial last
+ * block) and fetches only those DB blocks, reading runs of consecutive
+ * DB blocks with single reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "hotcache.h"
+#include "range.h"
+
+/* Longest run of consecutive DB blocks fetched with one read */
+#define RANGE_RUN_BLOCKS 64
+
+/* Output chunk for the read-range verb */
+#define RANGE_CHUNK (1024 * 1024)
+
+uint64_t stats_range_blocks = 0;
+
+
+/* Image block holding byte pos of the original data */
+static uint64_t range_block(const struct ipil_t * const restrict ip, const uint64_t pos)
+{
+	if (pos < (uint64_t)(B_SIZE - ip->start_offset)) return 0;
+	return (pos + ip->start_offset) / B_SIZE;
+}
+
+
+static int cmp_u32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/* Tell the kernel which DB blocks a coming range read will need. The
+ * offsets are sorted and merged into runs first so that readahead
+ * sweeps the DB in one direction instead of seeking back and forth
+ * in image order. Returns the number of runs advised. */
+extern size_t image_prefetch_range(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip, const uint64_t pos,
+		const uint64_t len)
+{
+	const uint64_t size = ipil_image_size(ip);
+	uint32_t *offs;
+	uint64_t first, end;
+	size_t count, i, runs = 0;
+
+	if (pos >= size || len == 0) return 0;
+	first = range_block(ip, pos);
+	end = range_block(ip, (len > size - pos ? size : pos + len) - 1) + 1;
+	count = (size_t)(end - first);
+	offs = (uint32_t *)malloc(count * sizeof(uint32_t));
+	if (offs == NULL) return 0;
+	memcpy(offs, ip->offsets + first, count * sizeof(uint32_t));
+	qsort(offs, count, sizeof(uint32_t), cmp_u32);
+	for (i = 0; i < count; ) {
+		size_t n = 1;
+		while (i + n < count && offs[i + n] <= offs[i + n - 1] + 1) n++;
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fileno(files->db), (off_t)offs[i] * B_SIZE,
+				(off_t)(offs[i + n - 1] - offs[i] + 1) * B_SIZE, POSIX_FADV_WILLNEED);
+#else
+		(void)files;
+#endif
+		runs++;
+		i += n;
+	}
+	free(offs);
+	return runs;
+}
+
+
+/* Read up to len bytes of an image's original data starting at pos
+ * Returns the number of bytes read (short only at the end of the image),
+ * or -1 on a DB read error */
+extern ssize_t image_read_range(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip, void * const restrict buf,
+		const uint64_t pos, const size_t len)
+{
+	char run[RANGE_RUN_BLOCKS * B_SIZE];
+	const uint64_t size = ipil_image_size(ip);
+	uint64_t k, end;
+	size_t out = 0, want = len;
+
+	if (pos >= size || len == 0) return 0;
+	if (want > size - pos) want = (size_t)(size - pos);
+	k = range_block(ip, pos);
+	end = range_block(ip, pos + want - 1) + 1;
+
+	while (k < end) {
+		size_t n = 1, i, done = 0;
+
+		/* Gather a run of consecutive DB blocks, unless the first is cached */
+		const void *cached = hotcache_get((off_t)ip->offsets[k]);
+		if (cached == NULL) {
+			while (n < RANGE_RUN_BLOCKS && k + n < end
+					&& ip->offsets[k + n] == ip->offsets[k] + n) n++;
+			while (done < n * B_SIZE) {
+				const ssize_t r = pread(fileno(files->db), run + done, (n * B_SIZE) - done,
+						((off_t)ip->offsets[k] * B_SIZE) + (off_t)done);
+				if (r <= 0) {
+					if (r < 0 && errno == EINTR) continue;
+					return -1;
+				}
+				done += (size_t)r;
+			}
+		}
+		stats_range_blocks += n;
+
+		for (i = 0; i < n; i++, k++) {
+			const char *src = cached ? (const char *)cached : run + (i * B_SIZE);
+			const uint64_t bpos = ipil_block_pos(ip, k);
+			const uint32_t blen = ipil_block_len(ip, k);
+			uint64_t from = 0, to = blen;
+
+			if (bpos < pos) from = pos - bpos;
+			if (bpos + to > pos + want) to = pos + want - bpos;
+			memcpy((char *)buf + out, src + from, (size_t)(to - from));
+			out += (size_t)(to - from);
+		}
+	}
+	return (ssize_t)out;
+}
+
+
+/* Parse a byte count with an optional K/M/G/T (binary) suffix */
+extern int parse_size(const char * const restrict str, uint64_t * const restrict value)
+{
+	char *end;
+	uint64_t v;
+
+	errno = 0;
+	v = strtoull(str, &end, 0);
+	if (errno || end == str) return -1;
+	switch (*end) {
+		case 'T': case 't': v <<= 10; /* Falls through */
+		case 'G': case 'g': v <<= 10; /* Falls through */
+		case 'M': case 'm': v <<= 10; /* Falls through */
+		case 'K': case 'k': v <<= 10; end++; break;
+		case '\0': break;
+		default: return -1;
+	}
+	if (*end != '\0') return -1;
+	*value = v;
+	return 0;
+}
+
+
+/* read-range image_file offset length output_file */
+extern int read_range_verb(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct ipil_t ip;
+	uint64_t pos, len, done = 0;
+	char *buf;
+	FILE *out;
+
+	if (argc != 4) return 1;
+	if (parse_size(argv[1], &pos) != 0 || parse_size(argv[2], &len) != 0) return 1;
+	if (ipil_open(argv[0], &ip) != 0) exit(EXIT_FAILURE);
+	if (pos >= ipil_image_size(&ip)) {
+		fprintf(stderr, "Error: offset %ju is past the end of %s (%ju bytes)\n",
+				(uintmax_t)pos, argv[0], (uintmax_t)ipil_image_size(&ip));
+		exit(EXIT_FAILURE);
+	}
+	if (!strcmp(argv[3], "-")) out = stdout;
+	else if (!(out = fopen(argv[3], "wb"))) {
+		fprintf(stderr, "Error: cannot open outfile: %s\n", argv[3]);
+		exit(EXIT_FAILURE);
+	}
+	buf = (char *)malloc(RANGE_CHUNK);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (done < len) {
+		size_t want = RANGE_CHUNK;
+		ssize_t got;
+
+		if (want > len - done) want = (size_t)(len - done);
+		got = image_read_range(files, &ip, buf, pos + done, want);
+		if (got < 0) {
+			fprintf(stderr, "Error reading %s\n", files->dbfile);
+			exit(EXIT_FAILURE);
+		}
+		if (got == 0) break;
+		if (fwrite(buf, 1, (size_t)got, out) != (size_t)got) goto error_out;
+		done += (uint64_t)got;
+	}
+	if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) goto error_out;
+	if (done < len) fprintf(stderr, "Warning: image ends after %ju bytes of the range\n", (uintmax_t)done);
+	fprintf(stderr, "Stats: %ju bytes from %ju DB blocks (image has %ju blocks)\n",
+			(uintmax_t)done, (uintmax_t)stats_range_blocks, (uintmax_t)ip.count);
+	free(buf);
+	ipil_close(&ip);
+	return 0;
+
+error_out:
+	fprintf(stderr, "Error writing %s\n", argv[3]);
+	exit(EXIT_FAILURE);
+}
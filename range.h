@@ -0,0 +1,32 @@
+/* Image byte range access headers
+ * See imagepile.c for copyright information */
+
+#ifndef RANGE_H
+#define RANGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "imagepile.h"
+#include "ipil.h"
+
+/* Number of DB blocks fetched by image_read_range() calls */
+extern uint64_t stats_range_blocks;
+
+extern ssize_t image_read_range(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip, void * const restrict buf,
+		const uint64_t pos, const size_t len);
+extern size_t image_prefetch_range(const struct files_t * const restrict files,
+		const struct ipil_t * const restrict ip, const uint64_t pos,
+		const uint64_t len);
+extern int parse_size(const char * const restrict str, uint64_t * const restrict value);
+extern int read_range_verb(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* RANGE_H */
@@ -0,0 +1,398 @@
+/*
+ * Tail-follow replication of a pile
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * The block DB and hash index are only ever appended to, so a replica
+ * can be kept current by copying whatever was appended since the last
+ * pass. A block is "committed" once both its data and its hash are on
+ * disk; only committed blocks are copied, data before hashes, and image
+ * files are copied only after the blocks they may reference are synced.
+ * The image catalog is also append-only and its tail is shipped last.
+ * With --follow, the pile directory is watched (inotify on Linux, polling
+ * elsewhere) and new data is shipped as it appears.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "replicate.h"
+#include "catalog.h"
+
+#ifdef __linux__
+ #include <poll.h>
+ #include <sys/inotify.h>
+#endif
+
+/* Bytes copied between fsync() calls on the replica */
+#define REPL_BATCH_BYTES (64 * 1024 * 1024)
+
+/* Copy buffer size */
+#define REPL_BUF_SIZE (1024 * 1024)
+
+/* Default seconds between polls (and the inotify wait timeout) */
+#define REPL_INTERVAL 1
+
+struct repl_state {
+	int src_db, src_idx;
+	int dst_db, dst_idx;
+	char *buf;
+	off_t unsynced;		/* Bytes written since the last fsync() */
+	off_t db_unsynced;	/* Database bytes written since its last fsync() */
+	time_t behind_since;	/* When the source first grew past the replica (0: current) */
+	uint64_t total_blocks, total_images;
+};
+
+
+static off_t fd_size(const int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) return -1;
+	return st.st_size;
+}
+
+
+static int open_or_die(const char * const restrict dir,
+		const char * const restrict name, const int flags)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	fd = open(path, flags, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+
+static void sync_replica(struct repl_state * const restrict rs)
+{
+	if (rs->unsynced == 0) return;
+	if (fsync(rs->dst_db) != 0 || fsync(rs->dst_idx) != 0) {
+		fprintf(stderr, "Error: cannot sync replica: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	rs->unsynced = 0;
+	rs->db_unsynced = 0;
+	return;
+}
+
+
+/* Copy bytes [from, to) of one file to the same place in another */
+static void copy_range(struct repl_state * const restrict rs,
+		const int in, const int out, off_t from, const off_t to)
+{
+	while (from < to) {
+		size_t len = REPL_BUF_SIZE;
+		ssize_t r, w;
+
+		if ((off_t)len > to - from) len = (size_t)(to - from);
+		r = pread(in, rs->buf, len, from);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			fprintf(stderr, "Error: cannot read source pile: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		w = pwrite(out, rs->buf, (size_t)r, from);
+		if (w != r) {
+			fprintf(stderr, "Error: cannot write replica: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		from += r;
+		rs->unsynced += r;
+		if (out != rs->dst_db) continue;
+		/* Data must be durable before the hashes that commit it */
+		rs->db_unsynced += r;
+		if (rs->db_unsynced >= REPL_BATCH_BYTES) {
+			if (fsync(rs->dst_db) != 0) {
+				fprintf(stderr, "Error: cannot sync replica: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			rs->db_unsynced = 0;
+		}
+	}
+	return;
+}
+
+
+/* Blocks with both data and hash present in a pile */
+static off_t committed_blocks(const int db, const int idx)
+{
+	off_t blocks = fd_size(db) / B_SIZE;
+
+	if (fd_size(idx) / (off_t)sizeof(jodyhash_t) < blocks)
+		blocks = fd_size(idx) / (off_t)sizeof(jodyhash_t);
+	return blocks;
+}
+
+
+/* Copy any image file that is new or changed since the last pass
+ * Images referencing blocks the replica does not have yet (an "add" in
+ * progress) are left for a later pass */
+static uint64_t copy_images(struct repl_state * const restrict rs,
+		const char * const restrict src, const char * const restrict dst,
+		const off_t blocks)
+{
+	char **list;
+	char path[PATH_MAX];
+	size_t count, i;
+	uint64_t copied = 0;
+
+	if (catalog_image_list(src, &list, &count) != 0) return 0;
+	for (i = 0; i < count; i++) {
+		const char *name = catalog_local_name(src, list[i]);
+		struct stat sst, dstat;
+		struct timespec times[2];
+		struct ipil_t ip;
+		char tmp[PATH_MAX + 8];
+		size_t k;
+		int in, out, ok = 1;
+		off_t len;
+
+		/* The replica only mirrors IMGDIR itself */
+		if (name == NULL) continue;
+		snprintf(path, PATH_MAX, "%s/%s", dst, name);
+		if (stat(list[i], &sst) != 0) continue;
+		/* Copies carry the source mtime, so any difference means a change */
+		if (stat(path, &dstat) == 0 && dstat.st_size == sst.st_size
+				&& dstat.st_mtim.tv_sec == sst.st_mtim.tv_sec
+				&& dstat.st_mtim.tv_nsec == sst.st_mtim.tv_nsec) continue;
+
+		if ((in = open(list[i], O_RDONLY)) < 0) continue;
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			fprintf(stderr, "Error: cannot open %s: %s\n", tmp, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		len = fd_size(in);
+		copy_range(rs, in, out, 0, len);
+		close(in);
+		times[0] = sst.st_atim;
+		times[1] = sst.st_mtim;
+		if (futimens(out, times) != 0 || fsync(out) != 0 || close(out) != 0) {
+			fprintf(stderr, "Error: cannot write replica image %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Check the copy itself, since the source may change under us */
+		if (ipil_open(tmp, &ip) != 0) ok = 0;
+		else {
+			if (ip.depth > 0 && (off_t)ip.meta_max >= blocks) ok = 0;
+			for (k = 0; ok && k < ip.count; k++) if ((off_t)ip.offsets[k] >= blocks) ok = 0;
+			ipil_close(&ip);
+		}
+		if (!ok) {
+			fprintf(stderr, "Warning: skipping %s until the next pass (references blocks past the replica)\n", list[i]);
+			unlink(tmp);
+			continue;
+		}
+		if (rename(tmp, path) != 0) {
+			fprintf(stderr, "Error: cannot write replica image %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		copied++;
+	}
+	ipil_free_list(list, count);
+	return copied;
+}
+
+
+/* Append new catalog records; a shorter replica catalog is a prefix */
+static void copy_catalog(struct repl_state * const restrict rs,
+		const char * const restrict src, const char * const restrict dst)
+{
+	char path[PATH_MAX];
+	int in, out;
+	off_t src_size, dst_size;
+
+	if (snprintf(path, PATH_MAX, "%s/%s", src, CATALOG_FILE) >= PATH_MAX) return;
+	if ((in = open(path, O_RDONLY)) < 0) return;
+	out = open_or_die(dst, CATALOG_FILE, O_RDWR | O_CREAT);
+	src_size = fd_size(in);
+	dst_size = fd_size(out);
+	if (dst_size > src_size) {
+		fprintf(stderr, "Error: replica catalog in %s is ahead of the source; refusing to continue\n", dst);
+		exit(EXIT_FAILURE);
+	}
+	if (src_size > dst_size) {
+		copy_range(rs, in, out, dst_size, src_size);
+		if (fsync(out) != 0) {
+			fprintf(stderr, "Error: cannot sync replica catalog: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(out);
+	close(in);
+	return;
+}
+
+
+/* One replication pass; returns the number of blocks copied */
+static uint64_t replicate_pass(struct repl_state * const restrict rs,
+		const char * const restrict src, const char * const restrict dst)
+{
+	off_t src_blocks, dst_blocks, db_size, idx_size;
+	uint64_t images;
+	time_t now = time(NULL);
+	struct stat st;
+
+	src_blocks = committed_blocks(rs->src_db, rs->src_idx);
+
+	db_size = fd_size(rs->dst_db);
+	idx_size = fd_size(rs->dst_idx);
+	dst_blocks = db_size / B_SIZE;
+	if (idx_size / (off_t)sizeof(jodyhash_t) < dst_blocks)
+		dst_blocks = idx_size / (off_t)sizeof(jodyhash_t);
+
+	if (dst_blocks > src_blocks) {
+		fprintf(stderr, "Error: replica %s is ahead of the source pile; refusing to continue\n", dst);
+		exit(EXIT_FAILURE);
+	}
+	/* Drop any uncommitted tail left by an interrupted pass */
+	if (db_size != dst_blocks * B_SIZE || idx_size != dst_blocks * (off_t)sizeof(jodyhash_t)) {
+		if (ftruncate(rs->dst_db, dst_blocks * B_SIZE) != 0
+				|| ftruncate(rs->dst_idx, dst_blocks * (off_t)sizeof(jodyhash_t)) != 0) {
+			fprintf(stderr, "Error: cannot truncate replica: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* The replica was last current when its DB was last written */
+	if (src_blocks > dst_blocks && rs->behind_since == 0) {
+		if (dst_blocks > 0 && fstat(rs->dst_db, &st) == 0 && st.st_mtime < now)
+			rs->behind_since = st.st_mtime;
+		else rs->behind_since = now;
+	}
+
+	if (src_blocks > dst_blocks) {
+		copy_range(rs, rs->src_db, rs->dst_db, dst_blocks * B_SIZE, src_blocks * B_SIZE);
+		if (fsync(rs->dst_db) != 0) {
+			fprintf(stderr, "Error: cannot sync replica: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		copy_range(rs, rs->src_idx, rs->dst_idx,
+				dst_blocks * (off_t)sizeof(jodyhash_t),
+				src_blocks * (off_t)sizeof(jodyhash_t));
+	}
+	sync_replica(rs);
+	images = copy_images(rs, src, dst, src_blocks);
+	sync_replica(rs);
+	copy_catalog(rs, src, dst);
+
+	rs->total_blocks += (uint64_t)(src_blocks - dst_blocks);
+	rs->total_images += images;
+	if (src_blocks > dst_blocks || images > 0) {
+		char stamp[32];
+
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+		fprintf(stderr, "%s replicate: +%jd blocks, +%ju images; lag was %jd blocks (%jd KiB), %jd s\n",
+				stamp, (intmax_t)(src_blocks - dst_blocks), (uintmax_t)images,
+				(intmax_t)(src_blocks - dst_blocks),
+				(intmax_t)((src_blocks - dst_blocks) * (B_SIZE / 1024)),
+				(intmax_t)(rs->behind_since ? time(NULL) - rs->behind_since : 0));
+	}
+	/* Blocks appended during the pass are missing from the replica since
+	 * at most the start of the pass */
+	rs->behind_since = (committed_blocks(rs->src_db, rs->src_idx) > src_blocks) ? now : 0;
+	return (uint64_t)(src_blocks - dst_blocks);
+}
+
+
+/* Wait until something in the pile directory changes or the interval ends */
+static void wait_for_change(const int watch, const int interval)
+{
+#ifdef __linux__
+	if (watch >= 0) {
+		struct pollfd pfd;
+		char evbuf[4096];
+
+		pfd.fd = watch;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, interval * 1000) > 0) {
+			/* Drain queued events; the pass rescans everything anyway */
+			while (read(watch, evbuf, sizeof(evbuf)) > 0);
+		}
+		return;
+	}
+#else
+	(void)watch;
+#endif
+	sleep((unsigned int)interval);
+	return;
+}
+
+
+/* replicate [--follow] [--interval seconds] replica_dir */
+extern int replicate_pile(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct repl_state rs;
+	const char *dst = NULL;
+	int follow = 0, interval = REPL_INTERVAL, watch = -1, i;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--follow")) follow = 1;
+		else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+			interval = atoi(argv[++i]);
+			if (interval < 1) return 1;
+		} else if (dst == NULL) dst = argv[i];
+		else return 1;
+	}
+	if (dst == NULL) return 1;
+	if (!strcmp(dst, files->imgdir)) {
+		fprintf(stderr, "Error: source and replica piles must be different\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&rs, 0, sizeof(rs));
+	rs.src_db = open_or_die(files->imgdir, "imagepile.db", O_RDONLY);
+	rs.src_idx = open_or_die(files->imgdir, "imagepile.hash_index", O_RDONLY);
+	rs.dst_db = open_or_die(dst, "imagepile.db", O_RDWR | O_CREAT);
+	rs.dst_idx = open_or_die(dst, "imagepile.hash_index", O_RDWR | O_CREAT);
+	rs.buf = (char *)malloc(REPL_BUF_SIZE);
+	if (rs.buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef __linux__
+	if (follow) {
+		watch = inotify_init1(IN_NONBLOCK);
+		if (watch >= 0 && inotify_add_watch(watch, files->imgdir,
+					IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+			close(watch);
+			watch = -1;
+		}
+		if (watch < 0) fprintf(stderr, "Warning: inotify unavailable; polling every %d s\n", interval);
+	}
+#endif
+
+	do {
+		replicate_pass(&rs, files->imgdir, dst);
+		if (follow) wait_for_change(watch, interval);
+	} while (follow);
+
+	fprintf(stderr, "Stats: %ju blocks, %ju images replicated\n",
+			(uintmax_t)rs.total_blocks, (uintmax_t)rs.total_images);
+	if (watch >= 0) close(watch);
+	close(rs.src_db);
+	close(rs.src_idx);
+	close(rs.dst_db);
+	close(rs.dst_idx);
+	free(rs.buf);
+	return 0;
+}
@@ -0,0 +1,19 @@
+/* Tail-follow replication headers
+ * See imagepile.c for copyright information */
+
+#ifndef REPLICATE_H
+#define REPLICATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int replicate_pile(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* REPLICATE_H */
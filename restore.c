@@ -0,0 +1,991 @@
+/*
+ * Image restore onto existing targets
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * The plain "read" verb streams every byte of an image to its output.
+ * When the target already holds most of the image, only the blocks that
+ * differ need to be written; these modes find them and write them in
+ * place with positioned writes. With a known base image the offset lists
+ * say which blocks differ; otherwise the target is read and hashed and
+ * compared against the pile's hash index. Fan-out restores one image to
+ * many targets, reading each DB block once; batch restores of different
+ * images share one scan of the DB blocks they have in common. Direct
+ * restores bypass the page cache with large aligned writes.
+ */
+
+/* O_DIRECT */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>
+#endif
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "hotcache.h"
+#include "diff.h"
+#include "restore.h"
+#include "partition.h"
+#include "vdout.h"
+#include "zout.h"
+
+/* Image blocks gathered into one positioned write */
+#define RESTORE_RUN_BLOCKS 256
+
+/* Image blocks of the target read and hashed at once */
+#define RESTORE_SCAN_BLOCKS 2048
+
+/* Fan-out buffer: slots of RESTORE_RUN_BLOCKS blocks shared by all targets;
+ * the fastest target can run at most this many slots ahead of the slowest */
+#define FANOUT_SLOTS 32
+#define FANOUT_MAX_TARGETS 256
+
+/* Shared-scan batch restore: every image advances by SCAN_WINDOW blocks
+ * per round and each round's DB blocks are read once for all of them */
+#define SCAN_WINDOW 2048
+#define SCAN_MAX_RUN 256
+
+struct scan_round {
+	uint32_t *blocks;	/* Sorted unique DB offsets wanted this round */
+	size_t count;
+	char *data;		/* B_SIZE bytes per entry of blocks */
+};
+
+struct scan_state {
+	pthread_mutex_t lock;
+	pthread_cond_t published;
+	pthread_cond_t finished;
+	struct scan_round round[2];	/* Double buffered */
+	uint64_t ready;		/* Rounds published so far */
+	uint64_t rounds;	/* Total rounds */
+	int writers_done;	/* Writers finished with round ready - 1 */
+};
+
+struct scan_restore {
+	pthread_t thread;
+	struct scan_state *ss;
+	struct ipil_t ip;
+	const char *image, *path;
+	char *buf;
+	int fd;
+	int failed;
+	double secs;
+};
+
+/* Direct I/O restore: two aligned buffers, one filled while the other
+ * is written. DIRECT_ALIGN covers the logical block size of any device. */
+#define DIRECT_BUF_SIZE (4 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+struct direct_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[2];
+	size_t len[2];		/* Bytes queued in each buffer, 0 if free */
+	uint64_t pos[2];	/* Target position of each buffer */
+	int fd;
+	int done;
+	int failed;
+	const char *path;
+};
+
+struct fanout_slot {
+	char *data;
+	size_t len;
+};
+
+struct fanout_state {
+	pthread_mutex_t lock;
+	pthread_cond_t produced;	/* Reader filled a slot */
+	pthread_cond_t consumed;	/* A writer finished a slot */
+	struct fanout_slot slot[FANOUT_SLOTS];
+	uint64_t filled;	/* Slots filled so far */
+	int done;		/* Reader has filled the last slot */
+};
+
+struct fanout_target {
+	pthread_t thread;
+	struct fanout_state *fs;
+	const char *path;
+	int fd;
+	int failed;
+	uint64_t next;		/* Next slot sequence number to write */
+	uint64_t bytes;
+	double secs;
+};
+
+struct restore_out {
+	const struct files_t *files;
+	const struct ipil_t *ip;
+	const char *path;
+	int fd;
+	char *buf;
+	uint64_t written;	/* Image blocks written */
+	uint64_t bytes;
+};
+
+
+/* Copy one DB block into dst */
+static void restore_fetch(const struct files_t * const restrict files,
+		void * const restrict dst, const uint32_t offset)
+{
+	const void *cached = hotcache_get((off_t)offset);
+	size_t done = 0;
+
+	if (cached != NULL) {
+		memcpy(dst, cached, B_SIZE);
+		return;
+	}
+	while (done < B_SIZE) {
+		const ssize_t r = pread(fileno(files->db), (char *)dst + done, B_SIZE - done,
+				((off_t)offset * B_SIZE) + (off_t)done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			fprintf(stderr, "Error reading %s\n", files->dbfile);
+			exit(EXIT_FAILURE);
+		}
+		done += (size_t)r;
+	}
+	return;
+}
+
+
+/* Write image blocks [first, first + count) to their place in the target */
+static void restore_blocks(struct restore_out * const restrict out,
+		uint64_t first, uint64_t count)
+{
+	char blk[B_SIZE];
+
+	while (count > 0) {
+		const uint64_t pos = ipil_block_pos(out->ip, first);
+		size_t len = 0, n = RESTORE_RUN_BLOCKS, done = 0;
+		uint64_t k;
+
+		if (n > count) n = (size_t)count;
+		for (k = first; k < first + n; k++) {
+			const uint32_t part = ipil_block_len(out->ip, k);
+			restore_fetch(out->files, blk, out->ip->offsets[k]);
+			memcpy(out->buf + len, blk, part);
+			len += part;
+		}
+		while (done < len) {
+			const ssize_t w = pwrite(out->fd, out->buf + done, len - done, (off_t)(pos + done));
+			if (w <= 0) {
+				if (w < 0 && errno == EINTR) continue;
+				fprintf(stderr, "Error writing %s: %s\n", out->path, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			done += (size_t)w;
+		}
+		out->written += n;
+		out->bytes += len;
+		first += n;
+		count -= n;
+	}
+	return;
+}
+
+
+/* Open an existing target for in-place writes */
+static int restore_open_target(const char * const restrict path)
+{
+	const int fd = open(path, O_WRONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot open target %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+
+/* Finish a target: trim regular files to the image size and sync */
+static void restore_close_target(struct restore_out * const restrict out)
+{
+	struct stat st;
+
+	if (fstat(out->fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& ftruncate(out->fd, (off_t)ipil_image_size(out->ip)) != 0) goto error_out;
+	if (fsync(out->fd) != 0 || close(out->fd) != 0) goto error_out;
+	return;
+
+error_out:
+	fprintf(stderr, "Error writing %s: %s\n", out->path, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+
+/* Is image block k inside one of the (sorted) extents? */
+static int extent_covers(const struct diff_extent * const restrict ext,
+		const size_t count, const uint64_t k)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if (ext[mid].start + ext[mid].count <= k) lo = mid + 1;
+		else hi = mid;
+	}
+	return (lo < count && ext[lo].start <= k);
+}
+
+
+/* Restore an image onto a target known to hold base: write only the
+ * blocks whose offsets differ from the base image */
+static void restore_base(const struct files_t * const restrict files,
+		const char * const restrict base, const char * const restrict image,
+		const char * const restrict target)
+{
+	struct restore_out out;
+	struct diff_extent *ext;
+	struct ipil_t ip, bp;
+	size_t count, i;
+	uint64_t blocks_a, blocks_b;
+
+	if (ipil_open(image, &ip) != 0 || ipil_open(base, &bp) != 0) exit(EXIT_FAILURE);
+	if (ip.start_offset != bp.start_offset) {
+		fprintf(stderr, "Error: %s and %s have different start offsets; use a full read\n", base, image);
+		exit(EXIT_FAILURE);
+	}
+	ext = diff_images(base, image, &count, &blocks_a, &blocks_b);
+
+	memset(&out, 0, sizeof(out));
+	out.files = files;
+	out.ip = &ip;
+	out.path = target;
+	out.fd = restore_open_target(target);
+	out.buf = (char *)malloc(RESTORE_RUN_BLOCKS * B_SIZE);
+	if (out.buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) {
+		/* Blocks past the end of the image are left to the truncate */
+		uint64_t n = ext[i].count;
+		if (ext[i].start >= ip.count) break;
+		if (ext[i].start + n > ip.count) n = ip.count - ext[i].start;
+		restore_blocks(&out, ext[i].start, n);
+	}
+	/* A short last block leaves the rest of its DB block unwritten on
+	 * the target, so the last blocks of both images are always written */
+	if (bp.count > 0 && bp.count - 1 < ip.count && !extent_covers(ext, count, bp.count - 1))
+		restore_blocks(&out, bp.count - 1, 1);
+	if (ip.count > 0 && ip.count != bp.count && !extent_covers(ext, count, ip.count - 1))
+		restore_blocks(&out, ip.count - 1, 1);
+	restore_close_target(&out);
+
+	fprintf(stderr, "Stats: wrote %ju of %ju blocks (%ju KiB) in %ju extents\n",
+			(uintmax_t)out.written, (uintmax_t)ip.count,
+			(uintmax_t)(out.bytes / 1024), (uintmax_t)count);
+	free(out.buf);
+	free(ext);
+	ipil_close(&ip);
+	ipil_close(&bp);
+	return;
+}
+
+
+/* Restore an image onto a target with unknown contents: read the target
+ * in large runs, hash each block and write only blocks whose hash does
+ * not match the indexed hash of the DB block the image wants there */
+static void restore_compare(const struct files_t * const restrict files,
+		const char * const restrict image, const char * const restrict target)
+{
+	struct restore_out out;
+	struct ipil_t ip;
+	struct stat st;
+	jodyhash_t blk[B_SIZE / sizeof(jodyhash_t)];
+	const jodyhash_t *index;
+	char *scan;
+	size_t index_len;
+	uint64_t k = 0, matched = 0, run_start = 0, run_len = 0;
+	int idx_fd;
+
+	if (ipil_open(image, &ip) != 0) exit(EXIT_FAILURE);
+	idx_fd = open(files->indexfile, O_RDONLY);
+	if (idx_fd < 0 || fstat(idx_fd, &st) != 0) {
+		fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	index_len = (size_t)st.st_size;
+	index = (const jodyhash_t *)mmap(NULL, index_len ? index_len : 1, PROT_READ, MAP_SHARED, idx_fd, 0);
+	if (index == MAP_FAILED) {
+		fprintf(stderr, "Error: cannot map index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	close(idx_fd);
+
+	memset(&out, 0, sizeof(out));
+	out.files = files;
+	out.ip = &ip;
+	out.path = target;
+	out.fd = open(target, O_RDWR);
+	if (out.fd < 0) {
+		fprintf(stderr, "Error: cannot open target %s: %s\n", target, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(out.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	out.buf = (char *)malloc(RESTORE_RUN_BLOCKS * B_SIZE);
+	scan = (char *)malloc(RESTORE_SCAN_BLOCKS * B_SIZE);
+	if (out.buf == NULL || scan == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (k < ip.count) {
+		const uint64_t pos = ipil_block_pos(&ip, k);
+		uint64_t n = RESTORE_SCAN_BLOCKS, j;
+		size_t len = 0, got = 0, at = 0;
+
+		if (n > ip.count - k) n = ip.count - k;
+		for (j = k; j < k + n; j++) len += ipil_block_len(&ip, j);
+		/* A short read (target smaller than the image) just mismatches */
+		while (got < len) {
+			const ssize_t r = pread(out.fd, scan + got, len - got, (off_t)(pos + got));
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0) {
+				fprintf(stderr, "Error reading %s: %s\n", target, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			if (r == 0) break;
+			got += (size_t)r;
+		}
+
+		for (j = k; j < k + n; j++) {
+			const uint32_t part = ipil_block_len(&ip, j);
+			const uint32_t offset = ip.offsets[j];
+			int match = 0;
+
+			/* DB blocks are zero-padded past the image data they hold */
+			if (at + part <= got && (size_t)offset < index_len / sizeof(jodyhash_t)) {
+				memcpy(blk, scan + at, part);
+				if (part < B_SIZE) memset((char *)blk + part, 0, B_SIZE - part);
+				match = (jody_block_hash(blk, 0, B_SIZE) == index[offset]);
+			}
+			at += part;
+			if (match) {
+				matched++;
+				if (run_len > 0) restore_blocks(&out, run_start, run_len);
+				run_len = 0;
+			} else {
+				if (run_len == 0) run_start = j;
+				run_len++;
+			}
+		}
+		k += n;
+	}
+	if (run_len > 0) restore_blocks(&out, run_start, run_len);
+	restore_close_target(&out);
+
+	fprintf(stderr, "Stats: %ju of %ju blocks already matched, wrote %ju blocks (%ju KiB)\n",
+			(uintmax_t)matched, (uintmax_t)ip.count, (uintmax_t)out.written,
+			(uintmax_t)(out.bytes / 1024));
+	munmap((void *)(uintptr_t)index, index_len ? index_len : 1);
+	free(scan);
+	free(out.buf);
+	ipil_close(&ip);
+	return;
+}
+
+
+static double restore_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+
+/* Write every slot, in order, to one target */
+static void *fanout_writer(void *arg)
+{
+	struct fanout_target * const t = (struct fanout_target *)arg;
+	struct fanout_state * const fs = t->fs;
+	const double start = restore_now();
+
+	while (1) {
+		struct fanout_slot *slot;
+		size_t done = 0;
+
+		pthread_mutex_lock(&fs->lock);
+		while (t->next == fs->filled && !fs->done) pthread_cond_wait(&fs->produced, &fs->lock);
+		if (t->next == fs->filled) {
+			pthread_mutex_unlock(&fs->lock);
+			break;
+		}
+		slot = &fs->slot[t->next % FANOUT_SLOTS];
+		pthread_mutex_unlock(&fs->lock);
+
+		while (done < slot->len) {
+			const ssize_t w = write(t->fd, slot->data + done, slot->len - done);
+			if (w <= 0) {
+				if (w < 0 && errno == EINTR) continue;
+				fprintf(stderr, "Error writing %s: %s; dropping this target\n", t->path, strerror(errno));
+				t->failed = 1;
+				break;
+			}
+			done += (size_t)w;
+		}
+		t->bytes += done;
+
+		/* A failed target stops holding the others back */
+		pthread_mutex_lock(&fs->lock);
+		t->next = t->failed ? UINT64_MAX : t->next + 1;
+		pthread_cond_signal(&fs->consumed);
+		pthread_mutex_unlock(&fs->lock);
+		if (t->failed) return NULL;
+	}
+	if (fsync(t->fd) != 0 && errno != EINVAL) {
+		fprintf(stderr, "Error syncing %s: %s\n", t->path, strerror(errno));
+		t->failed = 1;
+	}
+	t->secs = restore_now() - start;
+	return NULL;
+}
+
+
+/* Restore one image to many targets, reading each DB block once */
+static void restore_fanout(const struct files_t * const restrict files,
+		const char * const restrict image, const int count, char **targets)
+{
+	struct fanout_target *t;
+	struct fanout_state fs;
+	struct ipil_t ip;
+	char blk[B_SIZE];
+	uint64_t k = 0, percent = 0;
+	double start, stalled = 0;
+	int i, failed = 0;
+
+	if (count > FANOUT_MAX_TARGETS) {
+		fprintf(stderr, "Error: at most %d fan-out targets are supported\n", FANOUT_MAX_TARGETS);
+		exit(EXIT_FAILURE);
+	}
+	if (ipil_open(image, &ip) != 0) exit(EXIT_FAILURE);
+	memset(&fs, 0, sizeof(fs));
+	pthread_mutex_init(&fs.lock, NULL);
+	pthread_cond_init(&fs.produced, NULL);
+	pthread_cond_init(&fs.consumed, NULL);
+	for (i = 0; i < FANOUT_SLOTS; i++) {
+		fs.slot[i].data = (char *)malloc(RESTORE_RUN_BLOCKS * B_SIZE);
+		if (fs.slot[i].data == NULL) goto oom;
+	}
+	t = (struct fanout_target *)calloc((size_t)count, sizeof(struct fanout_target));
+	if (t == NULL) goto oom;
+	for (i = 0; i < count; i++) {
+		t[i].fs = &fs;
+		t[i].path = targets[i];
+		t[i].fd = open(targets[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (t[i].fd < 0) {
+			fprintf(stderr, "Error: cannot open target %s: %s\n", targets[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&t[i].thread, NULL, fanout_writer, &t[i]) != 0) {
+			fprintf(stderr, "Error: cannot create writer thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start = restore_now();
+	while (k < ip.count) {
+		struct fanout_slot *slot;
+		uint64_t n = RESTORE_RUN_BLOCKS, j;
+		double wait_start;
+
+		/* Backpressure: wait for the slowest live target to free the slot */
+		pthread_mutex_lock(&fs.lock);
+		wait_start = restore_now();
+		while (1) {
+			uint64_t slowest = UINT64_MAX;
+			for (i = 0; i < count; i++) if (t[i].next < slowest) slowest = t[i].next;
+			if (slowest == UINT64_MAX || fs.filled - slowest < FANOUT_SLOTS) break;
+			pthread_cond_wait(&fs.consumed, &fs.lock);
+		}
+		stalled += restore_now() - wait_start;
+		slot = &fs.slot[fs.filled % FANOUT_SLOTS];
+		pthread_mutex_unlock(&fs.lock);
+
+		if (n > ip.count - k) n = ip.count - k;
+		slot->len = 0;
+		for (j = k; j < k + n; j++) {
+			const uint32_t part = ipil_block_len(&ip, j);
+			restore_fetch(files, blk, ip.offsets[j]);
+			memcpy(slot->data + slot->len, blk, part);
+			slot->len += part;
+		}
+		k += n;
+
+		pthread_mutex_lock(&fs.lock);
+		fs.filled++;
+		pthread_cond_broadcast(&fs.produced);
+		pthread_mutex_unlock(&fs.lock);
+		if ((k * 100) / ip.count > percent) {
+			percent = (k * 100) / ip.count;
+			fprintf(stderr, "\r%u%% complete ", (unsigned int)percent);
+		}
+	}
+	pthread_mutex_lock(&fs.lock);
+	fs.done = 1;
+	pthread_cond_broadcast(&fs.produced);
+	pthread_mutex_unlock(&fs.lock);
+	fprintf(stderr, "\n");
+
+	for (i = 0; i < count; i++) {
+		pthread_join(t[i].thread, NULL);
+		if (close(t[i].fd) != 0) t[i].failed = 1;
+		if (t[i].failed) {
+			failed++;
+			fprintf(stderr, "Target %s: FAILED\n", t[i].path);
+		} else fprintf(stderr, "Target %s: %ju KiB in %.2f s (%.1f MiB/s)\n",
+				t[i].path, (uintmax_t)(t[i].bytes / 1024), t[i].secs,
+				t[i].secs > 0 ? ((double)t[i].bytes / 1048576.0) / t[i].secs : 0.0);
+	}
+	fprintf(stderr, "Stats: %ju blocks read once for %d targets in %.2f s, reader stalled %.2f s on backpressure\n",
+			(uintmax_t)ip.count, count, restore_now() - start, stalled);
+
+	for (i = 0; i < FANOUT_SLOTS; i++) free(fs.slot[i].data);
+	free(t);
+	ipil_close(&ip);
+	pthread_mutex_destroy(&fs.lock);
+	pthread_cond_destroy(&fs.produced);
+	pthread_cond_destroy(&fs.consumed);
+	if (failed > 0) exit(EXIT_FAILURE);
+	return;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+static int cmp_u32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/* Collect and read the DB blocks all restores need in one round */
+static void scan_prepare(const struct files_t * const restrict files,
+		struct scan_restore * const restrict r, const int count,
+		const uint64_t round, struct scan_round * const restrict sr,
+		uint64_t * const restrict refs, uint64_t * const restrict reads)
+{
+	const uint64_t first = round * SCAN_WINDOW;
+	size_t n = 0, i, u;
+	int j;
+
+	for (j = 0; j < count; j++) {
+		uint64_t k, end = first + SCAN_WINDOW;
+		if (end > r[j].ip.count) end = r[j].ip.count;
+		for (k = first; k < end; k++) sr->blocks[n++] = r[j].ip.offsets[k];
+	}
+	*refs += n;
+	qsort(sr->blocks, n, sizeof(uint32_t), cmp_u32);
+	for (i = 0, u = 0; i < n; i++)
+		if (u == 0 || sr->blocks[u - 1] != sr->blocks[i]) sr->blocks[u++] = sr->blocks[i];
+	sr->count = u;
+
+	/* Coalesce consecutive DB blocks into single reads */
+	for (i = 0; i < u; ) {
+		size_t run = 1, done = 0;
+		while (run < SCAN_MAX_RUN && i + run < u && sr->blocks[i + run] == sr->blocks[i] + run) run++;
+		while (done < run * B_SIZE) {
+			const ssize_t got = pread(fileno(files->db), sr->data + (i * B_SIZE) + done,
+					(run * B_SIZE) - done, ((off_t)sr->blocks[i] * B_SIZE) + (off_t)done);
+			if (got <= 0) {
+				if (got < 0 && errno == EINTR) continue;
+				fprintf(stderr, "Error reading %s\n", files->dbfile);
+				exit(EXIT_FAILURE);
+			}
+			done += (size_t)got;
+		}
+		(*reads)++;
+		i += run;
+	}
+	return;
+}
+
+
+/* Assemble and write one restore's window of every round */
+static void *scan_writer(void *arg)
+{
+	struct scan_restore * const r = (struct scan_restore *)arg;
+	struct scan_state * const ss = r->ss;
+	const double start = restore_now();
+	uint64_t round;
+
+	for (round = 0; round < ss->rounds; round++) {
+		const struct scan_round *sr;
+		uint64_t k, end = (round + 1) * SCAN_WINDOW;
+		size_t len = 0, done = 0;
+
+		pthread_mutex_lock(&ss->lock);
+		while (ss->ready <= round) pthread_cond_wait(&ss->published, &ss->lock);
+		pthread_mutex_unlock(&ss->lock);
+		sr = &ss->round[round % 2];
+
+		if (end > r->ip.count) end = r->ip.count;
+		for (k = round * SCAN_WINDOW; k < end && !r->failed; k++) {
+			const size_t i = ipil_block_index(sr->blocks, sr->count, r->ip.offsets[k]);
+			const uint32_t part = ipil_block_len(&r->ip, k);
+			memcpy(r->buf + len, sr->data + (i * B_SIZE), part);
+			len += part;
+		}
+		while (done < len) {
+			const ssize_t w = write(r->fd, r->buf + done, len - done);
+			if (w <= 0) {
+				if (w < 0 && errno == EINTR) continue;
+				fprintf(stderr, "Error writing %s: %s; dropping this restore\n", r->path, strerror(errno));
+				r->failed = 1;
+				break;
+			}
+			done += (size_t)w;
+		}
+
+		pthread_mutex_lock(&ss->lock);
+		ss->writers_done++;
+		pthread_cond_signal(&ss->finished);
+		pthread_mutex_unlock(&ss->lock);
+	}
+	if (!r->failed && fsync(r->fd) != 0 && errno != EINVAL) {
+		fprintf(stderr, "Error syncing %s: %s\n", r->path, strerror(errno));
+		r->failed = 1;
+	}
+	r->secs = restore_now() - start;
+	return NULL;
+}
+
+
+/* Restore several images at once, reading the DB blocks they share once */
+static void restore_batch(const struct files_t * const restrict files,
+		const int count, char **argv)
+{
+	struct scan_restore *r;
+	struct scan_state ss;
+	uint64_t longest = 0, round, refs = 0, reads = 0, unique = 0;
+	double start;
+	int i, failed = 0;
+
+	r = (struct scan_restore *)calloc((size_t)count, sizeof(struct scan_restore));
+	if (r == NULL) goto oom;
+	memset(&ss, 0, sizeof(ss));
+	pthread_mutex_init(&ss.lock, NULL);
+	pthread_cond_init(&ss.published, NULL);
+	pthread_cond_init(&ss.finished, NULL);
+	for (i = 0; i < count; i++) {
+		r[i].ss = &ss;
+		r[i].image = argv[i * 2];
+		r[i].path = argv[(i * 2) + 1];
+		if (ipil_open(r[i].image, &r[i].ip) != 0) exit(EXIT_FAILURE);
+		if (r[i].ip.count > longest) longest = r[i].ip.count;
+		r[i].buf = (char *)malloc(SCAN_WINDOW * B_SIZE);
+		if (r[i].buf == NULL) goto oom;
+		r[i].fd = open(r[i].path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (r[i].fd < 0) {
+			fprintf(stderr, "Error: cannot open target %s: %s\n", r[i].path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		ss.round[i].blocks = (uint32_t *)malloc((size_t)count * SCAN_WINDOW * sizeof(uint32_t));
+		ss.round[i].data = (char *)malloc((size_t)count * SCAN_WINDOW * B_SIZE);
+		if (ss.round[i].blocks == NULL || ss.round[i].data == NULL) goto oom;
+	}
+	ss.rounds = (longest + SCAN_WINDOW - 1) / SCAN_WINDOW;
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&r[i].thread, NULL, scan_writer, &r[i]) != 0) {
+			fprintf(stderr, "Error: cannot create writer thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Read round N+1 while the writers work on round N */
+	start = restore_now();
+	for (round = 0; round < ss.rounds; round++) {
+		scan_prepare(files, r, count, round, &ss.round[round % 2], &refs, &reads);
+		unique += ss.round[round % 2].count;
+		pthread_mutex_lock(&ss.lock);
+		while (round > 0 && ss.writers_done < count) pthread_cond_wait(&ss.finished, &ss.lock);
+		ss.writers_done = 0;
+		ss.ready = round + 1;
+		pthread_cond_broadcast(&ss.published);
+		pthread_mutex_unlock(&ss.lock);
+		fprintf(stderr, "\r%u%% complete ", (unsigned int)(((round + 1) * 100) / ss.rounds));
+	}
+	if (ss.rounds > 0) fprintf(stderr, "\n");
+
+	for (i = 0; i < count; i++) {
+		pthread_join(r[i].thread, NULL);
+		if (close(r[i].fd) != 0) r[i].failed = 1;
+		if (r[i].failed) {
+			failed++;
+			fprintf(stderr, "Restore %s -> %s: FAILED\n", r[i].image, r[i].path);
+		} else fprintf(stderr, "Restore %s -> %s: %ju blocks in %.2f s\n",
+				r[i].image, r[i].path, (uintmax_t)r[i].ip.count, r[i].secs);
+		ipil_close(&r[i].ip);
+		free(r[i].buf);
+	}
+	fprintf(stderr, "Stats: %ju block references served by %ju DB block reads in %ju runs (%.2fx sharing) in %.2f s\n",
+			(uintmax_t)refs, (uintmax_t)unique, (uintmax_t)reads,
+			unique ? (double)refs / (double)unique : 0.0, restore_now() - start);
+
+	for (i = 0; i < 2; i++) {
+		free(ss.round[i].blocks);
+		free(ss.round[i].data);
+	}
+	free(r);
+	pthread_mutex_destroy(&ss.lock);
+	pthread_cond_destroy(&ss.published);
+	pthread_cond_destroy(&ss.finished);
+	if (failed > 0) exit(EXIT_FAILURE);
+	return;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* Write queued direct I/O buffers until told to stop */
+static void *direct_writer(void *arg)
+{
+	struct direct_state * const ds = (struct direct_state *)arg;
+	int b = 0;
+
+	while (1) {
+		size_t done = 0, len;
+
+		pthread_mutex_lock(&ds->lock);
+		while (ds->len[b] == 0 && !ds->done) pthread_cond_wait(&ds->cond, &ds->lock);
+		len = ds->len[b];
+		pthread_mutex_unlock(&ds->lock);
+		if (len == 0) break;
+
+		while (done < len && !ds->failed) {
+			const ssize_t w = pwrite(ds->fd, ds->buf[b] + done, len - done, (off_t)(ds->pos[b] + done));
+			if (w <= 0) {
+				if (w < 0 && errno == EINTR) continue;
+				fprintf(stderr, "Error writing %s: %s\n", ds->path, strerror(errno));
+				ds->failed = 1;
+			} else done += (size_t)w;
+		}
+
+		pthread_mutex_lock(&ds->lock);
+		ds->len[b] = 0;
+		pthread_cond_broadcast(&ds->cond);
+		pthread_mutex_unlock(&ds->lock);
+		b ^= 1;
+	}
+	return NULL;
+}
+
+
+/* Hand a filled buffer to the writer and wait until the other is free */
+static int direct_queue(struct direct_state * const restrict ds, const int b,
+		const size_t len, const uint64_t pos)
+{
+	pthread_mutex_lock(&ds->lock);
+	ds->pos[b] = pos;
+	ds->len[b] = len;
+	pthread_cond_broadcast(&ds->cond);
+	while (ds->len[b ^ 1] != 0) pthread_cond_wait(&ds->cond, &ds->lock);
+	pthread_mutex_unlock(&ds->lock);
+	return b ^ 1;
+}
+
+
+/* Restore an image to a device (or file) with O_DIRECT, bypassing the
+ * page cache with large aligned writes */
+static void restore_direct(const struct files_t * const restrict files,
+		const char * const restrict image, const char * const restrict target)
+{
+	struct direct_state ds;
+	struct ipil_t ip;
+	struct stat st;
+	pthread_t thread;
+	char blk[B_SIZE];
+	uint64_t size, pos = 0, k, percent = 0;
+	size_t fill = 0;
+	double start;
+	int b = 0, direct = 1, i;
+
+	if (ipil_open(image, &ip) != 0) exit(EXIT_FAILURE);
+	size = ipil_image_size(&ip);
+	memset(&ds, 0, sizeof(ds));
+	ds.path = target;
+#ifdef O_DIRECT
+	ds.fd = open(target, O_WRONLY | O_CREAT | O_DIRECT, 0644);
+	if (ds.fd < 0 && errno == EINVAL) {
+		fprintf(stderr, "Warning: %s does not support direct I/O; using buffered writes\n", target);
+		direct = 0;
+		ds.fd = open(target, O_WRONLY | O_CREAT, 0644);
+	}
+#else
+	direct = 0;
+	ds.fd = open(target, O_WRONLY | O_CREAT, 0644);
+#endif
+	if (ds.fd < 0 || fstat(ds.fd, &st) != 0) {
+		fprintf(stderr, "Error: cannot open target %s: %s\n", target, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Refuse devices that are too small before writing anything */
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t dev_size = 0;
+#if defined __linux__ && defined BLKGETSIZE64
+		if (ioctl(ds.fd, BLKGETSIZE64, &dev_size) != 0) dev_size = 0;
+#endif
+		if (dev_size == 0 && (dev_size = (uint64_t)lseek(ds.fd, 0, SEEK_END)) == (uint64_t)-1) dev_size = 0;
+		if (dev_size < size) {
+			fprintf(stderr, "Error: %s holds %ju bytes but the image needs %ju\n",
+					target, (uintmax_t)dev_size, (uintmax_t)size);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "Device %s: %ju bytes, image %ju bytes\n", target,
+				(uintmax_t)dev_size, (uintmax_t)size);
+	}
+
+	for (i = 0; i < 2; i++)
+		if (posix_memalign((void **)&ds.buf[i], DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0) {
+			fprintf(stderr, "Error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	pthread_mutex_init(&ds.lock, NULL);
+	pthread_cond_init(&ds.cond, NULL);
+	if (pthread_create(&thread, NULL, direct_writer, &ds) != 0) {
+		fprintf(stderr, "Error: cannot create writer thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = restore_now();
+	for (k = 0; k < ip.count && !ds.failed; k++) {
+		const uint32_t part = ipil_block_len(&ip, k);
+		uint32_t copied = 0;
+
+		restore_fetch(files, blk, ip.offsets[k]);
+		/* Blocks straddle buffer boundaries when start_offset is set */
+		while (copied < part) {
+			size_t n = part - copied;
+			if (n > DIRECT_BUF_SIZE - fill) n = DIRECT_BUF_SIZE - fill;
+			memcpy(ds.buf[b] + fill, blk + copied, n);
+			fill += n;
+			copied += (uint32_t)n;
+			if (fill == DIRECT_BUF_SIZE) {
+				b = direct_queue(&ds, b, fill, pos);
+				pos += fill;
+				fill = 0;
+			}
+		}
+		if ((k * 100) / ip.count > percent) {
+			percent = (k * 100) / ip.count;
+			fprintf(stderr, "\r%u%% complete ", (unsigned int)percent);
+		}
+	}
+
+	/* Aligned part of the tail goes direct; the rest is written buffered */
+	if (fill > 0) {
+		const size_t aligned = direct ? fill & ~(size_t)(DIRECT_ALIGN - 1) : fill;
+		const char * const tail = ds.buf[b];
+		if (aligned > 0) b = direct_queue(&ds, b, aligned, pos);
+		direct_queue(&ds, b, 0, 0);
+		if (fill > aligned) {
+#ifdef O_DIRECT
+			const int flags = fcntl(ds.fd, F_GETFL);
+			if (flags == -1 || fcntl(ds.fd, F_SETFL, flags & ~O_DIRECT) != 0) ds.failed = 1;
+#endif
+			if (pwrite(ds.fd, tail + aligned, fill - aligned, (off_t)(pos + aligned))
+					!= (ssize_t)(fill - aligned)) ds.failed = 1;
+		}
+	}
+	pthread_mutex_lock(&ds.lock);
+	ds.done = 1;
+	pthread_cond_broadcast(&ds.cond);
+	pthread_mutex_unlock(&ds.lock);
+	pthread_join(thread, NULL);
+	fprintf(stderr, "\n");
+
+	if (!ds.failed && S_ISREG(st.st_mode) && ftruncate(ds.fd, (off_t)size) != 0) ds.failed = 1;
+	if (ds.failed || fsync(ds.fd) != 0 || close(ds.fd) != 0) {
+		fprintf(stderr, "Error writing %s\n", target);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Stats: %ju bytes written %s in %.2f s (%.1f MiB/s)\n",
+			(uintmax_t)size, direct ? "with direct I/O" : "buffered",
+			restore_now() - start,
+			(double)size / 1048576.0 / (restore_now() - start));
+	for (i = 0; i < 2; i++) free(ds.buf[i]);
+	pthread_mutex_destroy(&ds.lock);
+	pthread_cond_destroy(&ds.cond);
+	ipil_close(&ip);
+	return;
+}
+
+
+/* read --base base_image image_file target
+ * read --direct image_file target
+ * read --compare image_file target
+ * read --fanout image_file target...
+ * read --batch image_file target [image_file target]...
+ * read --qcow2 image_file output_file
+ * read --vhdx image_file output_file
+ * read --zstd|--gzip [-T threads] [-L level] image_file output_file */
+extern int restore_read(struct files_t * const restrict files, int argc, char **argv)
+{
+	if (argc == 4 && !strcmp(argv[0], "--base")) {
+		restore_base(files, argv[1], argv[2], argv[3]);
+		return 0;
+	}
+	if (argc == 3 && !strcmp(argv[0], "--compare")) {
+		restore_compare(files, argv[1], argv[2]);
+		return 0;
+	}
+	if (argc == 3 && !strcmp(argv[0], "--direct")) {
+		restore_direct(files, argv[1], argv[2]);
+		return 0;
+	}
+	if (argc == 4 && !strcmp(argv[0], "--partition")) {
+		char *end;
+		const unsigned long n = strtoul(argv[1], &end, 10);
+		if (*end != '\0' || n == 0 || n > UINT_MAX) return 1;
+		partition_read(files, (unsigned int)n, argv[2], argv[3]);
+		return 0;
+	}
+	if (argc == 3 && (!strcmp(argv[0], "--qcow2") || !strcmp(argv[0], "--vhdx"))) {
+		vdout_write(files, argv[0] + 2, argv[1], argv[2]);
+		return 0;
+	}
+	if (argc >= 3 && (!strcmp(argv[0], "--zstd") || !strcmp(argv[0], "--gzip")))
+		return zout_read(files, argc, argv);
+	if (argc >= 3 && !strcmp(argv[0], "--fanout")) {
+		restore_fanout(files, argv[1], argc - 2, argv + 2);
+		return 0;
+	}
+	if (argc >= 3 && (argc % 2) == 1 && !strcmp(argv[0], "--batch")) {
+		restore_batch(files, (argc - 1) / 2, argv + 1);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,19 @@
+/* Image restore headers
+ * See imagepile.c for copyright information */
+
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int restore_read(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* RESTORE_H */
@@ -0,0 +1,251 @@
+/*
+ * Hash-negotiated delta sync between two piles
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Copies images from the pile in IMGDIR to another pile, transferring
+ * only the blocks the destination does not already have. The hashes of
+ * the blocks the images need are sorted and summarized in a Bloom filter;
+ * the destination hash index is then streamed once, and each entry that
+ * passes the filter is looked up in the sorted hashes and confirmed with
+ * a block compare. The destination index is never held in memory, so
+ * this stays fast and small even for billion-entry destination piles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include "imagepile.h"
+#include "jody_hash.h"
+#include "ipil.h"
+#include "sync.h"
+#include "catalog.h"
+
+/* Bloom filter bits per needed block (3 probes; roughly 1.5% false hits) */
+#define BLOOM_BITS_PER_ENTRY 16
+
+/* Unresolved entry in the source-to-destination block map */
+#define SYNC_UNMAPPED UINT32_MAX
+
+/* A needed source block, sortable by hash */
+struct sync_need {
+	jodyhash_t hash;
+	uint32_t index;		/* Index into the sorted list of needed blocks */
+};
+
+
+static int cmp_need(const void *a, const void *b)
+{
+	const jodyhash_t x = ((const struct sync_need *)a)->hash;
+	const jodyhash_t y = ((const struct sync_need *)b)->hash;
+	return (x > y) - (x < y);
+}
+
+
+/* Bloom filter probe positions are taken from different hash bits */
+static inline uint64_t bloom_probe(const jodyhash_t hash, const int n, const uint64_t bits)
+{
+	return (uint64_t)((hash >> (n * 21)) ^ (hash * (uint64_t)(n + 1))) % bits;
+}
+
+
+static void open_pile_files(const char * const restrict dir,
+		struct files_t * const restrict files)
+{
+	memset(files, 0, sizeof(struct files_t));
+	strncpy(files->imgdir, dir, PATH_MAX - 1);
+	snprintf(files->dbfile, PATH_MAX, "%s/imagepile.db", dir);
+	snprintf(files->indexfile, PATH_MAX, "%s/imagepile.hash_index", dir);
+	if (!(files->db = fopen(files->dbfile, "a+b"))) {
+		fprintf(stderr, "Error: cannot open DB: %s\n", files->dbfile);
+		exit(EXIT_FAILURE);
+	}
+	if (!(files->hashindex = fopen(files->indexfile, "a+b"))) {
+		fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+
+/* sync dest_dir image_file... */
+extern int sync_pile(struct files_t * const restrict files, int argc, char **argv)
+{
+	struct files_t dest_vars;
+	struct files_t * const restrict dest = &dest_vars;
+	struct ipil_t *images;
+	struct sync_need *need;
+	struct catalog_entry *catalog;
+	size_t catalog_count;
+	uint64_t *bloom, bloom_bits, refs;
+	uint32_t *blocks, *map;
+	jodyhash_t hashes[B_SIZE / sizeof(jodyhash_t)];
+	char blk1[B_SIZE], blk2[B_SIZE];
+	char path[PATH_MAX + 1];
+	size_t block_count, i, n;
+	uint64_t dest_blocks, di, present = 0, sent = 0, hash_fails = 0;
+	off_t src_blocks;
+	int image_count;
+
+	if (argc < 2) return 1;
+	image_count = argc - 1;
+	if (!strcmp(argv[0], files->imgdir)) {
+		fprintf(stderr, "Error: source and destination piles must be different\n");
+		exit(EXIT_FAILURE);
+	}
+	open_pile_files(argv[0], dest);
+
+	/* Find every source block the requested images need */
+	images = (struct ipil_t *)calloc((size_t)image_count, sizeof(struct ipil_t));
+	if (images == NULL) goto oom;
+	for (i = 0; i < (size_t)image_count; i++)
+		if (ipil_open(argv[i + 1], &images[i]) != 0) exit(EXIT_FAILURE);
+	src_blocks = db_block_count(files);
+	blocks = ipil_collect_blocks(images, (size_t)image_count, src_blocks, &block_count, &refs);
+
+	/* Pull the needed hashes out of the source index in one pass */
+	if (!(files->hashindex = fopen(files->indexfile, "rb"))) {
+		fprintf(stderr, "Error: cannot open index: %s\n", files->indexfile);
+		exit(EXIT_FAILURE);
+	}
+	need = (struct sync_need *)malloc((block_count ? block_count : 1) * sizeof(struct sync_need));
+	map = (uint32_t *)malloc((block_count ? block_count : 1) * sizeof(uint32_t));
+	if (need == NULL || map == NULL) goto oom;
+	di = 0;
+	for (i = 0; i < block_count; ) {
+		n = fread(hashes, sizeof(jodyhash_t), B_SIZE / sizeof(jodyhash_t), files->hashindex);
+		if (n == 0) {
+			fprintf(stderr, "Error: source index %s is shorter than the DB\n", files->indexfile);
+			exit(EXIT_FAILURE);
+		}
+		while (i < block_count && blocks[i] < di + n) {
+			need[i].hash = hashes[blocks[i] - di];
+			need[i].index = (uint32_t)i;
+			map[i] = SYNC_UNMAPPED;
+			i++;
+		}
+		di += n;
+	}
+	fclose(files->hashindex);
+	files->hashindex = NULL;
+	qsort(need, block_count, sizeof(struct sync_need), cmp_need);
+
+	/* Summarize the needed hashes in a Bloom filter */
+	bloom_bits = ((uint64_t)block_count * BLOOM_BITS_PER_ENTRY) | 64;
+	bloom = (uint64_t *)calloc((size_t)(bloom_bits / 64) + 1, sizeof(uint64_t));
+	if (bloom == NULL) goto oom;
+	for (i = 0; i < block_count; i++) {
+		int k;
+		for (k = 0; k < 3; k++) {
+			const uint64_t b = bloom_probe(need[i].hash, k, bloom_bits);
+			bloom[b / 64] |= (uint64_t)1 << (b % 64);
+		}
+	}
+
+	/* Stream the destination index and match it against the needed set */
+	dest_blocks = (uint64_t)db_block_count(dest);
+	fprintf(stderr, "Source needs %ju blocks; scanning %ju destination hashes\n",
+			(uintmax_t)block_count, (uintmax_t)dest_blocks);
+	fseeko(dest->hashindex, 0, SEEK_SET);
+	di = 0;
+	while (di < dest_blocks && (n = fread(hashes, sizeof(jodyhash_t), B_SIZE / sizeof(jodyhash_t), dest->hashindex))) {
+		size_t k;
+
+		for (k = 0; k < n && di < dest_blocks; k++, di++) {
+			const jodyhash_t h = hashes[k];
+			size_t lo = 0, hi = block_count;
+			int dest_read = 0, p;
+
+			for (p = 0; p < 3; p++) {
+				const uint64_t b = bloom_probe(h, p, bloom_bits);
+				if (!(bloom[b / 64] & ((uint64_t)1 << (b % 64)))) break;
+			}
+			if (p < 3) continue;
+
+			while (lo < hi) {
+				const size_t mid = lo + ((hi - lo) / 2);
+				if (need[mid].hash < h) lo = mid + 1;
+				else hi = mid;
+			}
+			/* Confirm every still-unmapped source block with this hash */
+			for (; lo < block_count && need[lo].hash == h; lo++) {
+				const uint32_t idx = need[lo].index;
+				if (map[idx] != SYNC_UNMAPPED) continue;
+				if (!dest_read) {
+					read_db_run(blk2, (off_t)di, 1, dest);
+					dest_read = 1;
+				}
+				read_db_run(blk1, (off_t)blocks[idx], 1, files);
+				if (memcmp(blk1, blk2, B_SIZE)) {
+					hash_fails++;
+					continue;
+				}
+				map[idx] = (uint32_t)di;
+				present++;
+			}
+		}
+	}
+	free(bloom);
+	free(need);
+
+	/* Append the missing blocks and their hashes to the destination */
+	fseeko(dest->db, 0, SEEK_END);
+	fseeko(dest->hashindex, 0, SEEK_END);
+	for (i = 0; i < block_count; i++) {
+		jodyhash_t h;
+
+		if (map[i] != SYNC_UNMAPPED) continue;
+		read_db_run(blk1, (off_t)blocks[i], 1, files);
+		h = jody_block_hash((const jodyhash_t *)blk1, 0, B_SIZE);
+		if (fwrite(blk1, B_SIZE, 1, dest->db) != 1) goto error_dest;
+		if (fwrite(&h, sizeof(jodyhash_t), 1, dest->hashindex) != 1) goto error_dest;
+		map[i] = (uint32_t)dest_blocks;
+		dest_blocks++;
+		sent++;
+	}
+	if (fflush(dest->db) != 0 || fflush(dest->hashindex) != 0) goto error_dest;
+
+	/* Images go last so they never reference blocks that are not there */
+	catalog_load(files->imgdir, &catalog, &catalog_count);
+	for (i = 0; i < (size_t)image_count; i++) {
+		const char *name = ipil_base_name(argv[i + 1]);
+		const struct catalog_entry *src = catalog_find(catalog, catalog_count, files->imgdir, argv[i + 1]);
+		struct catalog_entry info;
+
+		if (strlen(dest->imgdir) + strlen(name) + 2 > sizeof(path)) goto error_dest;
+		strcpy(path, dest->imgdir);
+		strcat(path, "/");
+		strcat(path, name);
+		ipil_write_remapped(path, images[i].start_offset, images[i].end_size,
+				images[i].offsets, images[i].count, blocks, block_count, map);
+		memset(&info, 0, sizeof(info));
+		info.size = ipil_image_size(&images[i]);
+		info.blocks = images[i].count;
+		if (src != NULL) info.digest = src->digest;
+		catalog_add(dest->imgdir, path, &info, NULL);
+		ipil_close(&images[i]);
+		fprintf(stderr, "Synced image %s\n", path);
+	}
+
+	fprintf(stderr, "Stats: %ju blocks needed, %ju already present, %ju sent (%ju KiB), %ju hash failures\n",
+			(uintmax_t)block_count, (uintmax_t)present, (uintmax_t)sent,
+			(uintmax_t)(sent * (B_SIZE / 1024)), (uintmax_t)hash_fails);
+	fclose(dest->hashindex);
+	fclose(dest->db);
+	catalog_free(catalog, catalog_count);
+	free(map);
+	free(blocks);
+	free(images);
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+error_dest:
+	fprintf(stderr, "Error: write to destination pile %s failed\n", dest->imgdir);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,19 @@
+/* Hash-negotiated delta sync headers
+ * See imagepile.c for copyright information */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int sync_pile(struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* SYNC_H */
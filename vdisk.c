@@ -0,0 +1,857 @@
+/*
+ * Virtual disk container input
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Reads QCOW2, VHD, VHDX and VMDK files as the disk they contain, using
+ * each format's allocation tables so that unallocated and zero regions
+ * are reported as zero without touching the container. "add" uses this
+ * to store such regions as references to the zero block, so importing a
+ * thin disk costs I/O only for the data actually in it.
+ *
+ * Supported: QCOW2 v2/v3 (zero clusters, deflate or zstd compressed
+ * clusters), fixed and dynamic VHD, VHDX, and VMDK monolithic sparse,
+ * stream-optimized and descriptor files with FLAT/SPARSE/ZERO extents.
+ * Images that need another file to be complete (backing files,
+ * differencing disks) and encrypted images are refused.
+ *
+ * A disk is a list of extents (one for every format but VMDK); each
+ * extent maps a position to a run of zeroes, plain data in a file, or a
+ * compressed unit that is inflated whole and cached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+ #include <zstd.h>
+#endif
+#include "vdisk.h"
+
+#define EXT_ZERO  0
+#define EXT_FLAT  1
+#define EXT_QCOW2 2
+#define EXT_VHD   3
+#define EXT_VHDX  4
+#define EXT_VMDK  5
+
+#define LOC_ZERO    0
+#define LOC_DATA    1
+#define LOC_DEFLATE 2	/* Raw deflate (QCOW2) */
+#define LOC_ZLIB    3	/* zlib stream after a grain marker (VMDK) */
+#define LOC_ZSTD    4
+
+/* Largest compressed unit accepted (QCOW2 cluster or VMDK grain) */
+#define VD_MAX_UNIT (2 * 1024 * 1024)
+
+/* Most extents accepted from a VMDK descriptor */
+#define VD_MAX_EXTENTS 1024
+
+struct vd_extent {
+	uint64_t start, size;	/* Virtual byte range covered */
+	int kind;
+	int fd;
+	uint64_t data_off;	/* FLAT: file offset of the extent's first byte */
+
+	/* Top-level table: QCOW2 L1, VHD/VHDX BAT, VMDK grain directory */
+	uint64_t *table;
+	uint64_t table_len;
+
+	uint64_t unit;		/* Cluster, block or grain size in bytes */
+	uint64_t l2_span;	/* Bytes covered by one second-level table */
+	uint32_t l2_entries;
+	uint32_t bitmap;	/* VHD: sector bitmap bytes before block data */
+	uint32_t chunk_ratio;	/* VHDX: payload blocks per bitmap entry */
+	uint32_t cbits;		/* QCOW2 cluster_bits */
+	int comp;		/* LOC_* for compressed units */
+	int zero_gte;		/* VMDK: GTE 1 means zero grain */
+
+	/* Second-level table cache: QCOW2 L2, VMDK grain table */
+	uint64_t *l2;
+	uint64_t l2_off;
+};
+
+struct vd_loc {
+	int kind;
+	int fd;
+	uint64_t off;		/* File offset of the data, or of the compressed unit */
+	uint64_t len;		/* Bytes from the position to the end of this run */
+	uint64_t unit_pos;	/* Compressed: extent position of the unit */
+	uint64_t csize;		/* Compressed: bytes to read */
+};
+
+struct vdisk {
+	const char *format;
+	uint64_t size;
+	struct vd_extent *ext;
+	size_t count, last;
+	int fds[VD_MAX_EXTENTS + 1];
+	size_t nfds;
+
+	/* Last decompressed unit */
+	unsigned char *ubuf, *cbuf;
+	int ufd;
+	uint64_t uoff;
+
+	uint64_t bytes_read, bytes_zero;
+};
+
+
+static void vd_error(const char * const restrict path, const char * const restrict what)
+{
+	fprintf(stderr, "Error: %s: %s\n", path, what);
+	exit(EXIT_FAILURE);
+}
+
+
+static void *vd_alloc(const size_t size)
+{
+	void *p = calloc(1, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+
+static int pread_full(const int fd, void * const restrict buf, const size_t len, const uint64_t off)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t r = pread(fd, (char *)buf + done, len - done, (off_t)(off + done));
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (r == 0) return -1;
+		done += (size_t)r;
+	}
+	return 0;
+}
+
+
+static uint32_t le32(const unsigned char * const restrict p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const unsigned char * const restrict p)
+{
+	return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static uint32_t be32(const unsigned char * const restrict p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t be64(const unsigned char * const restrict p)
+{
+	return ((uint64_t)be32(p) << 32) | (uint64_t)be32(p + 4);
+}
+
+
+/* Load a table of count entries of width bytes into 64-bit host values */
+static uint64_t *load_table(const int fd, const uint64_t off, const uint64_t count,
+		const unsigned int width, const int big_endian)
+{
+	unsigned char *raw;
+	uint64_t *t, i;
+
+	if (count > ((uint64_t)1 << 32)) return NULL;
+	raw = (unsigned char *)vd_alloc((size_t)(count * width));
+	t = (uint64_t *)vd_alloc((size_t)(count * sizeof(uint64_t)));
+	if (pread_full(fd, raw, (size_t)(count * width), off) != 0) {
+		free(raw);
+		free(t);
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		const unsigned char * const p = raw + (i * width);
+		if (width == 8) t[i] = big_endian ? be64(p) : le64(p);
+		else t[i] = big_endian ? be32(p) : le32(p);
+	}
+	free(raw);
+	return t;
+}
+
+
+/* Load the second-level table at off into the extent's cache */
+static int load_l2(struct vd_extent * const restrict e, const uint64_t off, const int big_endian)
+{
+	uint64_t *t;
+
+	if (e->l2 != NULL && e->l2_off == off) return 0;
+	t = load_table(e->fd, off, e->l2_entries, big_endian ? 8 : 4, big_endian);
+	if (t == NULL) return -1;
+	free(e->l2);
+	e->l2 = t;
+	e->l2_off = off;
+	return 0;
+}
+
+
+/* QCOW2 */
+
+static void open_qcow2(const char * const restrict path, struct vdisk * const restrict vd,
+		struct vd_extent * const restrict e, const unsigned char * const restrict h)
+{
+	const uint32_t version = be32(h + 4);
+	uint64_t l1_off, l1_size;
+
+	if (version < 2 || version > 3) vd_error(path, "unsupported QCOW2 version");
+	if (be64(h + 8) != 0) vd_error(path, "QCOW2 images with backing files are not supported");
+	e->cbits = be32(h + 20);
+	if (e->cbits < 9 || e->cbits > 21) vd_error(path, "bad QCOW2 cluster size");
+	if (be32(h + 32) != 0) vd_error(path, "encrypted QCOW2 images are not supported");
+	e->comp = LOC_DEFLATE;
+	if (version == 3) {
+		const uint64_t incompat = be64(h + 72);
+		if (incompat & 2) vd_error(path, "QCOW2 image is marked corrupt");
+		if (incompat & 4) vd_error(path, "QCOW2 external data files are not supported");
+		if (incompat & 16) vd_error(path, "QCOW2 extended L2 entries are not supported");
+		if (incompat & ~(uint64_t)0x1f) vd_error(path, "unknown QCOW2 incompatible features");
+		if ((incompat & 8) && be32(h + 100) > 104 && h[104] == 1) e->comp = LOC_ZSTD;
+		if (incompat & 1) fprintf(stderr, "Warning: %s was not closed cleanly; reading it anyway\n", path);
+	}
+	vd->format = "qcow2";
+	e->kind = EXT_QCOW2;
+	e->size = be64(h + 24);
+	e->unit = (uint64_t)1 << e->cbits;
+	e->l2_entries = (uint32_t)(e->unit / 8);
+	e->l2_span = e->unit * e->l2_entries;
+	l1_size = be32(h + 36);
+	l1_off = be64(h + 40);
+	if (l1_size < (e->size + e->l2_span - 1) / e->l2_span) vd_error(path, "QCOW2 L1 table too small");
+	e->table_len = l1_size;
+	if ((e->table = load_table(e->fd, l1_off, l1_size, 8, 1)) == NULL)
+		vd_error(path, "cannot read QCOW2 L1 table");
+}
+
+
+static int lookup_qcow2(struct vd_extent * const restrict e, const uint64_t pos,
+		struct vd_loc * const restrict loc)
+{
+	const uint64_t l1i = pos / e->l2_span;
+	const uint64_t in_cluster = pos & (e->unit - 1);
+	uint64_t l2off, entry, host;
+
+	if (l1i >= e->table_len || (l2off = e->table[l1i] & 0x00fffffffffffe00ULL) == 0) {
+		loc->kind = LOC_ZERO;
+		loc->len = e->l2_span - (pos % e->l2_span);
+		return 0;
+	}
+	if (load_l2(e, l2off, 1) != 0) return -1;
+	entry = e->l2[(pos % e->l2_span) >> e->cbits];
+	loc->len = e->unit - in_cluster;
+
+	if (entry & ((uint64_t)1 << 62)) {
+		/* Compressed: offset and sector count share the low 62 bits */
+		const unsigned int x = 62 - (e->cbits - 8);
+		const uint64_t coff = entry & (((uint64_t)1 << x) - 1);
+		const uint64_t nsec = ((entry >> x) & (((uint64_t)1 << (e->cbits - 8)) - 1)) + 1;
+
+		loc->kind = e->comp;
+		loc->off = coff;
+		loc->csize = (nsec * 512) - (coff & 511);
+		loc->unit_pos = pos - in_cluster;
+		return 0;
+	}
+	host = entry & 0x00fffffffffffe00ULL;
+	if ((entry & 1) || host == 0) {
+		loc->kind = LOC_ZERO;
+		return 0;
+	}
+	loc->kind = LOC_DATA;
+	loc->off = host + in_cluster;
+	return 0;
+}
+
+
+/* VHD */
+
+static int vhd_footer_ok(const unsigned char * const restrict f)
+{
+	uint32_t sum = 0;
+	unsigned int i;
+
+	if (memcmp(f, "conectix", 8)) return 0;
+	for (i = 0; i < 512; i++) if (i < 64 || i > 67) sum += f[i];
+	return (~sum) == be32(f + 64);
+}
+
+
+static void open_vhd(const char * const restrict path, struct vdisk * const restrict vd,
+		struct vd_extent * const restrict e, const unsigned char * const restrict f)
+{
+	const uint32_t type = be32(f + 60);
+	unsigned char dyn[1024];
+	uint64_t bat_off;
+
+	e->size = be64(f + 48);
+	if (type == 2) {
+		vd->format = "vhd (fixed)";
+		e->kind = EXT_FLAT;
+		e->data_off = 0;
+		return;
+	}
+	if (type == 4) vd_error(path, "differencing VHD images are not supported");
+	if (type != 3) vd_error(path, "unknown VHD disk type");
+	vd->format = "vhd (dynamic)";
+	if (pread_full(e->fd, dyn, sizeof(dyn), be64(f + 16)) != 0 || memcmp(dyn, "cxsparse", 8))
+		vd_error(path, "cannot read VHD dynamic disk header");
+	bat_off = be64(dyn + 16);
+	e->table_len = be32(dyn + 28);
+	e->unit = be32(dyn + 32);
+	if (e->unit < 512 || (e->unit & 511) || e->unit > ((uint64_t)1 << 30))
+		vd_error(path, "bad VHD block size");
+	if (e->table_len * e->unit < e->size) vd_error(path, "VHD block table too small");
+	e->bitmap = (uint32_t)((((e->unit / 512) + 7) / 8 + 511) & ~(uint64_t)511);
+	e->kind = EXT_VHD;
+	if ((e->table = load_table(e->fd, bat_off, e->table_len, 4, 1)) == NULL)
+		vd_error(path, "cannot read VHD block table");
+}
+
+
+static int lookup_vhd(struct vd_extent * const restrict e, const uint64_t pos,
+		struct vd_loc * const restrict loc)
+{
+	const uint64_t b = pos / e->unit, in_block = pos % e->unit;
+
+	loc->len = e->unit - in_block;
+	if (b >= e->table_len || e->table[b] == 0xffffffffU) {
+		loc->kind = LOC_ZERO;
+		return 0;
+	}
+	loc->kind = LOC_DATA;
+	loc->off = (e->table[b] * 512) + e->bitmap + in_block;
+	return 0;
+}
+
+
+/* VHDX */
+
+extern uint32_t vdisk_crc32c(const unsigned char * const restrict p, const size_t len)
+{
+	static uint32_t table[256];
+	static int ready = 0;
+	uint32_t crc = 0xffffffffU;
+	size_t i;
+
+	if (!ready) {
+		uint32_t n, k, c;
+		for (n = 0; n < 256; n++) {
+			c = n;
+			for (k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82f63b78U : c >> 1;
+			table[n] = c;
+		}
+		ready = 1;
+	}
+	for (i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+/* Check a VHDX structure whose CRC-32C at offset 4 covers len bytes */
+static int vhdx_checksum_ok(unsigned char * const restrict p, const size_t len)
+{
+	const uint32_t want = le32(p + 4);
+	uint32_t got;
+
+	memset(p + 4, 0, 4);
+	got = vdisk_crc32c(p, len);
+	p[4] = (unsigned char)want;
+	p[5] = (unsigned char)(want >> 8);
+	p[6] = (unsigned char)(want >> 16);
+	p[7] = (unsigned char)(want >> 24);
+	return got == want;
+}
+
+
+/* VHDX GUIDs as stored on disk (first three fields little-endian) */
+const unsigned char vhdx_guid_bat[16] = { 0x66, 0x77, 0xc2, 0x2d, 0x23, 0xf6, 0x00, 0x42,
+		0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 };
+const unsigned char vhdx_guid_meta[16] = { 0x06, 0xa2, 0x7c, 0x8b, 0x90, 0x47, 0x9a, 0x4b,
+		0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e };
+const unsigned char vhdx_guid_params[16] = { 0x37, 0x67, 0xa1, 0xca, 0x36, 0xfa, 0x43, 0x4d,
+		0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b };
+const unsigned char vhdx_guid_vsize[16] = { 0x24, 0x42, 0xa5, 0x2f, 0x1b, 0xcd, 0x76, 0x48,
+		0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 };
+const unsigned char vhdx_guid_lsize[16] = { 0x1d, 0xbf, 0x41, 0x81, 0x6f, 0xa9, 0x09, 0x47,
+		0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f };
+const unsigned char vhdx_guid_psize[16] = { 0xc7, 0x48, 0xa3, 0xcd, 0x5d, 0x44, 0x71, 0x44,
+		0x9c, 0xc9, 0xe9, 0x88, 0x52, 0x51, 0xc5, 0x56 };
+const unsigned char vhdx_guid_page83[16] = { 0xab, 0x12, 0xca, 0xbe, 0xe6, 0xb2, 0x23, 0x45,
+		0x93, 0xef, 0xc3, 0x09, 0xe0, 0x00, 0xc7, 0x46 };
+
+
+static void open_vhdx(const char * const restrict path, struct vdisk * const restrict vd,
+		struct vd_extent * const restrict e)
+{
+	static const unsigned char zero_guid[16];
+	unsigned char *hdr = (unsigned char *)vd_alloc(65536);
+	uint64_t best_seq = 0, bat_off = 0, meta_off = 0, bat_len = 0, blocks;
+	uint32_t meta_len = 0, lsize = 0, i, n;
+	int have_hdr = 0, have_params = 0, have_vsize = 0;
+	unsigned char log_guid[16];
+
+	/* Current header: the valid one with the higher sequence number */
+	for (i = 1; i <= 2; i++) {
+		if (pread_full(e->fd, hdr, 4096, (uint64_t)i * 65536) != 0) continue;
+		if (memcmp(hdr, "head", 4) || !vhdx_checksum_ok(hdr, 4096)) continue;
+		if (!have_hdr || le64(hdr + 8) > best_seq) {
+			best_seq = le64(hdr + 8);
+			memcpy(log_guid, hdr + 48, 16);
+			have_hdr = 1;
+		}
+	}
+	if (!have_hdr) vd_error(path, "no valid VHDX header");
+	if (memcmp(log_guid, zero_guid, 16))
+		vd_error(path, "VHDX log needs replaying; open the disk once in Hyper-V or run a repair first");
+
+	/* Region table (primary, else backup) */
+	for (i = 3; i <= 4; i++) {
+		if (pread_full(e->fd, hdr, 65536, (uint64_t)i * 65536) == 0
+				&& !memcmp(hdr, "regi", 4) && vhdx_checksum_ok(hdr, 65536)) break;
+	}
+	if (i > 4) vd_error(path, "no valid VHDX region table");
+	n = le32(hdr + 8);
+	if (n > 2047) vd_error(path, "bad VHDX region table");
+	for (i = 0; i < n; i++) {
+		const unsigned char * const r = hdr + 16 + (i * 32);
+		if (!memcmp(r, vhdx_guid_bat, 16)) {
+			bat_off = le64(r + 16);
+			bat_len = le32(r + 24);
+		} else if (!memcmp(r, vhdx_guid_meta, 16)) {
+			meta_off = le64(r + 16);
+			meta_len = le32(r + 24);
+		} else if (le32(r + 28) & 1) vd_error(path, "VHDX has an unknown required region");
+	}
+	if (bat_off == 0 || meta_off == 0 || meta_len < 65536) vd_error(path, "VHDX is missing its BAT or metadata");
+
+	/* Metadata items */
+	if (pread_full(e->fd, hdr, 65536, meta_off) != 0 || memcmp(hdr, "metadata", 8))
+		vd_error(path, "cannot read VHDX metadata");
+	n = (uint32_t)hdr[10] | ((uint32_t)hdr[11] << 8);
+	if (n > 2047) vd_error(path, "bad VHDX metadata table");
+	for (i = 0; i < n; i++) {
+		const unsigned char * const m = hdr + 32 + (i * 32);
+		unsigned char item[8];
+		const uint32_t off = le32(m + 16);
+
+		if (!memcmp(m, vhdx_guid_params, 16)) {
+			if (pread_full(e->fd, item, 8, meta_off + off) != 0) vd_error(path, "cannot read VHDX metadata");
+			e->unit = le32(item);
+			if (le32(item + 4) & 2) vd_error(path, "differencing VHDX images are not supported");
+			have_params = 1;
+		} else if (!memcmp(m, vhdx_guid_vsize, 16)) {
+			if (pread_full(e->fd, item, 8, meta_off + off) != 0) vd_error(path, "cannot read VHDX metadata");
+			e->size = le64(item);
+			have_vsize = 1;
+		} else if (!memcmp(m, vhdx_guid_lsize, 16)) {
+			if (pread_full(e->fd, item, 4, meta_off + off) != 0) vd_error(path, "cannot read VHDX metadata");
+			lsize = le32(item);
+		} else if (!memcmp(m, vhdx_guid_psize, 16) || !memcmp(m, vhdx_guid_page83, 16)) {
+			continue;	/* Not needed to read the disk */
+		} else if (le32(m + 24) & 4) vd_error(path, "VHDX has unknown required metadata");
+	}
+	free(hdr);
+	if (!have_params || !have_vsize || (lsize != 512 && lsize != 4096)
+			|| e->unit < (1 << 20) || e->unit > (256U << 20) || (e->unit & (e->unit - 1)))
+		vd_error(path, "bad VHDX disk parameters");
+
+	vd->format = "vhdx";
+	e->kind = EXT_VHDX;
+	e->chunk_ratio = (uint32_t)(((uint64_t)1 << 23) * lsize / e->unit);
+	blocks = (e->size + e->unit - 1) / e->unit;
+	e->table_len = blocks + ((blocks - 1) / e->chunk_ratio) + 1;
+	if (e->table_len * 8 > bat_len) vd_error(path, "VHDX BAT too small");
+	if ((e->table = load_table(e->fd, bat_off, e->table_len, 8, 0)) == NULL)
+		vd_error(path, "cannot read VHDX BAT");
+}
+
+
+static int lookup_vhdx(struct vd_extent * const restrict e, const uint64_t pos,
+		struct vd_loc * const restrict loc)
+{
+	const uint64_t b = pos / e->unit, in_block = pos % e->unit;
+	const uint64_t idx = b + (b / e->chunk_ratio);
+	uint64_t entry;
+
+	loc->len = e->unit - in_block;
+	entry = idx < e->table_len ? e->table[idx] : 0;
+	/* 6 = fully present, 7 = partially present; others read as zero */
+	if ((entry & 7) < 6) {
+		loc->kind = LOC_ZERO;
+		return 0;
+	}
+	loc->kind = LOC_DATA;
+	loc->off = ((entry >> 20) << 20) + in_block;
+	return 0;
+}
+
+
+/* VMDK */
+
+static void open_vmdk_sparse(const char * const restrict path, struct vd_extent * const restrict e,
+		const unsigned char * const restrict h0, const uint64_t expect_sectors)
+{
+	unsigned char h[512];
+	uint64_t grain, gd_off, gd_entries;
+	uint32_t flags;
+
+	memcpy(h, h0, 512);
+	flags = le32(h + 8);
+	if (le64(h + 56) == 0xffffffffffffffffULL) {
+		/* Stream-optimized: the usable header is the footer near the end */
+		struct stat st;
+		if (fstat(e->fd, &st) != 0 || st.st_size < 1536
+				|| pread_full(e->fd, h, 512, (uint64_t)st.st_size - 1024) != 0
+				|| le32(h) != 0x564d444bU)
+			vd_error(path, "cannot read stream-optimized VMDK footer");
+		flags = le32(h + 8);
+	}
+	grain = le64(h + 20);
+	e->l2_entries = le32(h + 44);
+	gd_off = le64(h + 56);
+	if (grain < 1 || grain > (VD_MAX_UNIT / 512) || (grain & (grain - 1))
+			|| e->l2_entries == 0 || e->l2_entries > 65536)
+		vd_error(path, "bad VMDK sparse extent header");
+	e->kind = EXT_VMDK;
+	e->size = le64(h + 12) * 512;
+	if (expect_sectors && expect_sectors * 512 != e->size) vd_error(path, "VMDK extent size mismatch");
+	e->unit = grain * 512;
+	e->l2_span = e->unit * e->l2_entries;
+	e->zero_gte = (flags & 4) != 0;
+	e->comp = (flags & 0x10000) ? LOC_ZLIB : LOC_DATA;
+	if (e->comp == LOC_ZLIB && ((uint32_t)h[77] | ((uint32_t)h[78] << 8)) != 1)
+		vd_error(path, "unknown VMDK grain compression");
+	gd_entries = (e->size + e->l2_span - 1) / e->l2_span;
+	e->table_len = gd_entries;
+	if ((e->table = load_table(e->fd, gd_off * 512, gd_entries, 4, 0)) == NULL)
+		vd_error(path, "cannot read VMDK grain directory");
+}
+
+
+static int lookup_vmdk(struct vd_extent * const restrict e, const uint64_t pos,
+		struct vd_loc * const restrict loc)
+{
+	const uint64_t gdi = pos / e->l2_span;
+	const uint64_t in_grain = pos % e->unit;
+	uint64_t gte;
+
+	if (gdi >= e->table_len || e->table[gdi] == 0) {
+		loc->kind = LOC_ZERO;
+		loc->len = e->l2_span - (pos % e->l2_span);
+		return 0;
+	}
+	if (load_l2(e, e->table[gdi] * 512, 0) != 0) return -1;
+	gte = e->l2[(pos % e->l2_span) / e->unit];
+	loc->len = e->unit - in_grain;
+	if (gte == 0 || (gte == 1 && e->zero_gte)) {
+		loc->kind = LOC_ZERO;
+		return 0;
+	}
+	if (e->comp == LOC_ZLIB) {
+		/* Grain marker: u64 LBA, u32 compressed size, then the data */
+		unsigned char marker[12];
+		if (pread_full(e->fd, marker, 12, gte * 512) != 0) return -1;
+		loc->kind = LOC_ZLIB;
+		loc->off = (gte * 512) + 12;
+		loc->csize = le32(marker + 8);
+		loc->unit_pos = pos - in_grain;
+		return 0;
+	}
+	loc->kind = LOC_DATA;
+	loc->off = (gte * 512) + in_grain;
+	return 0;
+}
+
+
+static int vd_add_fd(struct vdisk * const restrict vd, const char * const restrict path)
+{
+	const int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (vd->nfds < VD_MAX_EXTENTS + 1) vd->fds[vd->nfds++] = fd;
+	return fd;
+}
+
+
+/* Text descriptor: a list of FLAT, SPARSE and ZERO extents in other files */
+static void open_vmdk_descriptor(const char * const restrict path, struct vdisk * const restrict vd)
+{
+	char line[PATH_MAX + 128], dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+	uint64_t pos = 0;
+	FILE *f;
+
+	if (slash != NULL) snprintf(dir, sizeof(dir), "%.*s/", (int)(slash - path), path);
+	else dir[0] = '\0';
+	if (!(f = fopen(path, "r"))) vd_error(path, "cannot read VMDK descriptor");
+	vd->format = "vmdk (descriptor)";
+	vd->ext = (struct vd_extent *)vd_alloc(VD_MAX_EXTENTS * sizeof(struct vd_extent));
+	while (fgets(line, sizeof(line), f)) {
+		char access[16], type[16], name[PATH_MAX], full[PATH_MAX * 2];
+		unsigned long long sectors, offset = 0;
+		struct vd_extent *e;
+		int fields;
+
+		if (!strncmp(line, "parentCID", 9) && !strstr(line, "ffffffff"))
+			vd_error(path, "VMDK images with a parent are not supported");
+		fields = sscanf(line, "%15s %llu %15s \"%4095[^\"]\" %llu", access, &sectors, type, name, &offset);
+		if (fields < 3 || (strcmp(access, "RW") && strcmp(access, "RDONLY") && strcmp(access, "NOACCESS")))
+			continue;
+		if (vd->count == VD_MAX_EXTENTS) vd_error(path, "too many VMDK extents");
+		e = &vd->ext[vd->count++];
+		e->start = pos;
+		e->size = (uint64_t)sectors * 512;
+		e->kind = EXT_ZERO;
+		if (!strcmp(type, "ZERO") || !strcmp(access, "NOACCESS")) {
+			pos += e->size;
+			continue;
+		}
+		if (fields < 4) vd_error(path, "VMDK extent line without a file name");
+		if (name[0] == '/') snprintf(full, sizeof(full), "%s", name);
+		else snprintf(full, sizeof(full), "%s%s", dir, name);
+		e->fd = vd_add_fd(vd, full);
+		if (!strcmp(type, "FLAT") || !strcmp(type, "VMFS")) {
+			e->kind = EXT_FLAT;
+			e->data_off = (uint64_t)offset * 512;
+		} else if (!strcmp(type, "SPARSE")) {
+			unsigned char h[512];
+			if (pread_full(e->fd, h, 512, 0) != 0 || le32(h) != 0x564d444bU)
+				vd_error(full, "not a VMDK sparse extent");
+			open_vmdk_sparse(full, e, h, sectors);
+			e->start = pos;
+		} else vd_error(path, "unsupported VMDK extent type");
+		pos += e->size;
+	}
+	fclose(f);
+	if (vd->count == 0) vd_error(path, "VMDK descriptor lists no extents");
+	vd->size = pos;
+}
+
+
+/* Recognize a virtual disk container
+ * Returns NULL if the file is not one (it is then read as a raw image) */
+extern struct vdisk *vdisk_open(const char * const restrict path)
+{
+	unsigned char h[512], foot[512];
+	struct vdisk *vd;
+	struct vd_extent *e;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return NULL;
+	memset(h, 0, sizeof(h));
+	memset(foot, 0, sizeof(foot));
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || pread(fd, h, sizeof(h), 0) < 0
+			|| (st.st_size >= 512 && pread(fd, foot, 512, st.st_size - 512) != 512)) {
+		close(fd);
+		return NULL;
+	}
+
+	vd = (struct vdisk *)vd_alloc(sizeof(struct vdisk));
+	vd->ufd = -1;
+	if (!memcmp(h, "# Disk DescriptorFile", 21)) {
+		close(fd);
+		open_vmdk_descriptor(path, vd);
+		return vd;
+	}
+
+	e = vd->ext = (struct vd_extent *)vd_alloc(sizeof(struct vd_extent));
+	vd->count = 1;
+	e->fd = fd;
+	vd->fds[vd->nfds++] = fd;
+	if (be32(h) == 0x514649fbU) open_qcow2(path, vd, e, h);
+	else if (!memcmp(h, "vhdxfile", 8)) open_vhdx(path, vd, e);
+	else if (vhd_footer_ok(foot)) open_vhd(path, vd, e, foot);
+	else if (le32(h) == 0x564d444bU) {
+		vd->format = le64(h + 56) == 0xffffffffffffffffULL ? "vmdk (stream-optimized)" : "vmdk (sparse)";
+		open_vmdk_sparse(path, e, h, 0);
+	} else {
+		free(vd->ext);
+		free(vd);
+		close(fd);
+		return NULL;
+	}
+	vd->size = e->size;
+	return vd;
+}
+
+
+extern uint64_t vdisk_size(const struct vdisk * const restrict vd)
+{
+	return vd->size;
+}
+
+
+extern const char *vdisk_format(const struct vdisk * const restrict vd)
+{
+	return vd->format;
+}
+
+
+/* Inflate a compressed unit into vd->ubuf */
+static int vd_inflate(struct vdisk * const restrict vd, const struct vd_extent * const restrict e,
+		const struct vd_loc * const restrict loc)
+{
+	const size_t csize = (size_t)(loc->csize > VD_MAX_UNIT + 4096 ? VD_MAX_UNIT + 4096 : loc->csize);
+	ssize_t got;
+
+	if (vd->ufd == loc->fd && vd->uoff == loc->off) return 0;
+	if (vd->ubuf == NULL) {
+		vd->ubuf = (unsigned char *)vd_alloc(VD_MAX_UNIT);
+		vd->cbuf = (unsigned char *)vd_alloc(VD_MAX_UNIT + 4096);
+	}
+	/* The last compressed cluster may run past the end of the file */
+	got = pread(loc->fd, vd->cbuf, csize, (off_t)loc->off);
+	if (got <= 0) return -1;
+	vd->bytes_read += (uint64_t)got;
+	memset(vd->ubuf, 0, (size_t)e->unit);
+
+	if (loc->kind == LOC_DEFLATE || loc->kind == LOC_ZLIB) {
+#ifdef HAVE_ZLIB
+		z_stream zs;
+		int ret;
+		memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, loc->kind == LOC_DEFLATE ? -12 : 15) != Z_OK) return -1;
+		zs.next_in = vd->cbuf;
+		zs.avail_in = (uInt)got;
+		zs.next_out = vd->ubuf;
+		zs.avail_out = (uInt)e->unit;
+		ret = inflate(&zs, Z_FINISH);
+		inflateEnd(&zs);
+		if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && zs.avail_out == 0)) return -1;
+#else
+		fprintf(stderr, "Error: compressed clusters need a build with zlib\n");
+		exit(EXIT_FAILURE);
+#endif
+	} else {
+#ifdef HAVE_ZSTD
+		ZSTD_DCtx * const dctx = ZSTD_createDCtx();
+		ZSTD_inBuffer ib = { vd->cbuf, (size_t)got, 0 };
+		ZSTD_outBuffer ob = { vd->ubuf, (size_t)e->unit, 0 };
+		size_t ret;
+		if (dctx == NULL) return -1;
+		ret = ZSTD_decompressStream(dctx, &ob, &ib);
+		ZSTD_freeDCtx(dctx);
+		if (ZSTD_isError(ret) || ob.pos != ob.size) return -1;
+#else
+		fprintf(stderr, "Error: zstd compressed clusters need a build with USE_ZSTD=1\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+	vd->ufd = loc->fd;
+	vd->uoff = loc->off;
+	return 0;
+}
+
+
+/* Read len bytes of the virtual disk at pos
+ * Returns 1 if the whole range is unallocated or zero (buf is zeroed
+ * without reading the container), 0 if data was read, -1 on error */
+extern int vdisk_read(struct vdisk * const restrict vd, const uint64_t pos,
+		void * const restrict buf, const size_t len)
+{
+	unsigned char * const out = (unsigned char *)buf;
+	size_t done = 0;
+	int zero = 1;
+
+	if (pos > vd->size || len > vd->size - pos) return -1;
+	while (done < len) {
+		const uint64_t p = pos + done;
+		struct vd_extent *e = &vd->ext[vd->last];
+		struct vd_loc loc;
+		uint64_t rel, n;
+		int ret = 0;
+
+		if (p < e->start || p >= e->start + e->size) {
+			size_t i;
+			for (i = 0; i < vd->count; i++)
+				if (p >= vd->ext[i].start && p < vd->ext[i].start + vd->ext[i].size) break;
+			if (i == vd->count) return -1;
+			vd->last = i;
+			e = &vd->ext[i];
+		}
+		rel = p - e->start;
+		memset(&loc, 0, sizeof(loc));
+		loc.fd = e->fd;
+		switch (e->kind) {
+		case EXT_ZERO:
+			loc.kind = LOC_ZERO;
+			loc.len = e->size - rel;
+			break;
+		case EXT_FLAT:
+			loc.kind = LOC_DATA;
+			loc.off = e->data_off + rel;
+			loc.len = e->size - rel;
+			break;
+		case EXT_QCOW2: ret = lookup_qcow2(e, rel, &loc); break;
+		case EXT_VHD: ret = lookup_vhd(e, rel, &loc); break;
+		case EXT_VHDX: ret = lookup_vhdx(e, rel, &loc); break;
+		case EXT_VMDK: ret = lookup_vmdk(e, rel, &loc); break;
+		default: return -1;
+		}
+		if (ret != 0) return -1;
+
+		n = len - done;
+		if (n > loc.len) n = loc.len;
+		if (n > e->size - rel) n = e->size - rel;
+		switch (loc.kind) {
+		case LOC_ZERO:
+			memset(out + done, 0, (size_t)n);
+			vd->bytes_zero += n;
+			break;
+		case LOC_DATA:
+			if (pread_full(loc.fd, out + done, (size_t)n, loc.off) != 0) return -1;
+			vd->bytes_read += n;
+			zero = 0;
+			break;
+		default:
+			if (e->unit > VD_MAX_UNIT || vd_inflate(vd, e, &loc) != 0) return -1;
+			memcpy(out + done, vd->ubuf + (rel - loc.unit_pos), (size_t)n);
+			zero = 0;
+			break;
+		}
+		done += (size_t)n;
+	}
+	return zero;
+}
+
+
+extern void vdisk_close(struct vdisk * const restrict vd)
+{
+	size_t i;
+
+	if (vd == NULL) return;
+	fprintf(stderr, "Container: %s, %ju bytes read, %ju bytes unallocated or zero\n",
+			vd->format, (uintmax_t)vd->bytes_read, (uintmax_t)vd->bytes_zero);
+	for (i = 0; i < vd->count; i++) {
+		free(vd->ext[i].table);
+		free(vd->ext[i].l2);
+	}
+	for (i = 0; i < vd->nfds; i++) close(vd->fds[i]);
+	free(vd->ext);
+	free(vd->ubuf);
+	free(vd->cbuf);
+	free(vd);
+}
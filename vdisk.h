@@ -0,0 +1,32 @@
+/* Virtual disk container input headers
+ * See imagepile.c for copyright information */
+
+#ifndef VDISK_H
+#define VDISK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct vdisk;
+
+extern struct vdisk *vdisk_open(const char * const restrict path);
+extern uint64_t vdisk_size(const struct vdisk * const restrict vd);
+extern const char *vdisk_format(const struct vdisk * const restrict vd);
+extern int vdisk_read(struct vdisk * const restrict vd, const uint64_t pos,
+		void * const restrict buf, const size_t len);
+extern void vdisk_close(struct vdisk * const restrict vd);
+
+/* Shared with the VHDX writer */
+extern const unsigned char vhdx_guid_bat[16], vhdx_guid_meta[16], vhdx_guid_params[16],
+		vhdx_guid_vsize[16], vhdx_guid_lsize[16], vhdx_guid_psize[16], vhdx_guid_page83[16];
+extern uint32_t vdisk_crc32c(const unsigned char * const restrict p, const size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* VDISK_H */
@@ -0,0 +1,447 @@
+/*
+ * Virtual disk container output
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Restores an image straight into a sparse QCOW2 (version 3) or dynamic
+ * VHDX file that hypervisors can use directly. The image is walked one
+ * allocation unit (QCOW2 cluster or VHDX payload block) at a time; units
+ * that are entirely zero are left unallocated. Once the pile's zero block
+ * has been seen, units made only of references to it are recognized from
+ * the offsets alone and never read.
+ *
+ * Data units are appended in image order as they are produced; the
+ * tables that locate them (QCOW2 L2/L1 and refcounts, VHDX BAT) are
+ * written once everything else is in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "imagepile.h"
+#include "ipil.h"
+#include "range.h"
+#include "vdisk.h"
+#include "vdout.h"
+
+/* QCOW2: 64 KiB clusters, 16-bit refcounts */
+#define Q_CLUSTER_BITS 16
+#define Q_CLUSTER (1U << Q_CLUSTER_BITS)
+#define Q_L2_ENTRIES (Q_CLUSTER / 8)
+#define Q_REFS_PER_BLOCK (Q_CLUSTER / 2)
+
+/* VHDX: 2 MiB payload blocks, 512-byte logical sectors */
+#define X_BLOCK (2U * 1024 * 1024)
+#define X_MB (1024U * 1024)
+#define X_LOG_OFF (1 * X_MB)
+#define X_META_OFF (2 * X_MB)
+#define X_BAT_OFF (3 * X_MB)
+#define X_CHUNK_RATIO ((8ULL * 1024 * 1024 * 512) / X_BLOCK)
+
+/* Image data fetched per read while filling a unit */
+#define VO_READ (256 * 1024)
+
+struct vdout {
+	const struct files_t *files;
+	struct ipil_t ip;
+	uint64_t size;		/* Image bytes */
+	uint64_t vsize;		/* Virtual disk size (rounded up to 512 bytes) */
+	uint32_t zero_off;	/* DB offset of the zero block once seen */
+	int have_zero;
+	int fd;
+	const char *outpath;
+	uint64_t units, allocated, skipped_reads;
+};
+
+
+static void put_be32(unsigned char * const restrict p, const uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static void put_be64(unsigned char * const restrict p, const uint64_t v)
+{
+	put_be32(p, (uint32_t)(v >> 32));
+	put_be32(p + 4, (uint32_t)v);
+}
+
+static void put_le16(unsigned char * const restrict p, const uint16_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_le32(unsigned char * const restrict p, const uint32_t v)
+{
+	put_le16(p, (uint16_t)v);
+	put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_le64(unsigned char * const restrict p, const uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+
+static void *vo_alloc(const size_t size)
+{
+	void *p = calloc(1, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+
+static void vo_write(const struct vdout * const restrict vo, const void * const restrict buf,
+		const size_t len, const uint64_t off)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t w = pwrite(vo->fd, (const char *)buf + done, len - done, (off_t)(off + done));
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) {
+			fprintf(stderr, "Error: cannot write %s: %s\n", vo->outpath, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		done += (size_t)w;
+	}
+}
+
+
+static int all_zero(const unsigned char * const restrict buf, const size_t len)
+{
+	return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+
+/* Fill buf with image bytes [pos, pos + len), reading nothing for blocks
+ * that reference the zero block. Bytes past the image end are zero.
+ * Returns 1 if the unit is entirely zero. */
+static int fill_unit(struct vdout * const restrict vo, unsigned char * const restrict buf,
+		const uint64_t pos, const size_t len)
+{
+	const struct ipil_t * const ip = &vo->ip;
+	const uint64_t end = pos + len > vo->size ? vo->size : pos + len;
+	uint64_t k, run_start = pos;
+	int zero;
+
+	memset(buf, 0, len);
+	if (pos >= vo->size) return 1;
+	k = pos < (uint64_t)(B_SIZE - ip->start_offset) ? 0 : (pos + ip->start_offset) / B_SIZE;
+
+	/* Read maximal runs between zero block references */
+	for (; k < ip->count; k++) {
+		const uint64_t bpos = ipil_block_pos(ip, k);
+		const uint64_t bend = bpos + ipil_block_len(ip, k);
+
+		if (bpos >= end) break;
+		if (vo->have_zero && ip->offsets[k] == vo->zero_off) {
+			const uint64_t s = bpos > run_start ? bpos : run_start;
+			while (run_start < s) {
+				const size_t n = s - run_start > VO_READ ? VO_READ : (size_t)(s - run_start);
+				if (image_read_range(vo->files, ip, buf + (run_start - pos), run_start, n) != (ssize_t)n) goto error_read;
+				run_start += n;
+			}
+			run_start = bend < end ? bend : end;
+			vo->skipped_reads++;
+		}
+	}
+	while (run_start < end) {
+		const size_t n = end - run_start > VO_READ ? VO_READ : (size_t)(end - run_start);
+		if (image_read_range(vo->files, ip, buf + (run_start - pos), run_start, n) != (ssize_t)n) goto error_read;
+		run_start += n;
+	}
+
+	zero = all_zero(buf, len);
+	/* Learn the zero block from any all-zero block whose data lies inside
+	 * this unit (DB blocks are zero-padded past their data) */
+	if (!vo->have_zero) {
+		k = pos < (uint64_t)(B_SIZE - ip->start_offset) ? 0 : (pos + ip->start_offset) / B_SIZE;
+		for (; k < ip->count && ipil_block_pos(ip, k) < end; k++) {
+			const uint64_t bpos = ipil_block_pos(ip, k);
+			const uint32_t blen = ipil_block_len(ip, k);
+
+			if (bpos >= pos && bpos + blen <= end && (zero || all_zero(buf + (bpos - pos), blen))) {
+				vo->zero_off = ip->offsets[k];
+				vo->have_zero = 1;
+				break;
+			}
+		}
+	}
+	return zero;
+
+error_read:
+	fprintf(stderr, "Error: cannot read image data at %" PRIu64 "\n", run_start);
+	exit(EXIT_FAILURE);
+}
+
+
+/* QCOW2 version 3 */
+static void write_qcow2(struct vdout * const restrict vo)
+{
+	const uint64_t clusters = (vo->vsize + Q_CLUSTER - 1) / Q_CLUSTER;
+	const uint64_t l1_size = (clusters + Q_L2_ENTRIES - 1) / Q_L2_ENTRIES;
+	const uint64_t l1_clusters = ((l1_size * 8) + Q_CLUSTER - 1) / Q_CLUSTER;
+	unsigned char *buf = (unsigned char *)vo_alloc(Q_CLUSTER);
+	unsigned char *l1 = (unsigned char *)vo_alloc((size_t)(l1_clusters * Q_CLUSTER));
+	unsigned char *l2 = (unsigned char *)vo_alloc(Q_CLUSTER);
+	unsigned char *rb;
+	unsigned char hdr[104];
+	uint64_t next = 1 + l1_clusters;	/* Next free host cluster */
+	uint64_t c, rt_clusters = 0, rb_count = 0, used, i;
+	int l2_dirty = 0;
+
+	for (c = 0; c < clusters; c++) {
+		if (!fill_unit(vo, buf, c * Q_CLUSTER, Q_CLUSTER)) {
+			vo_write(vo, buf, Q_CLUSTER, next * Q_CLUSTER);
+			put_be64(l2 + ((c % Q_L2_ENTRIES) * 8), (next * Q_CLUSTER) | (1ULL << 63));
+			next++;
+			l2_dirty = 1;
+			vo->allocated++;
+		}
+		vo->units++;
+		/* Flush an L2 table once its range is done */
+		if ((c + 1) % Q_L2_ENTRIES == 0 || c + 1 == clusters) {
+			if (l2_dirty) {
+				vo_write(vo, l2, Q_CLUSTER, next * Q_CLUSTER);
+				put_be64(l1 + ((c / Q_L2_ENTRIES) * 8), (next * Q_CLUSTER) | (1ULL << 63));
+				next++;
+				memset(l2, 0, Q_CLUSTER);
+				l2_dirty = 0;
+			}
+		}
+	}
+	vo_write(vo, l1, (size_t)(l1_clusters * Q_CLUSTER), Q_CLUSTER);
+
+	/* Refcount blocks and table go at the end and must count themselves */
+	do {
+		used = next + rb_count + rt_clusters;
+		rb_count = (used + Q_REFS_PER_BLOCK - 1) / Q_REFS_PER_BLOCK;
+		rt_clusters = ((rb_count * 8) + Q_CLUSTER - 1) / Q_CLUSTER;
+	} while (next + rb_count + rt_clusters > used);
+	used = next + rb_count + rt_clusters;
+	rb = (unsigned char *)vo_alloc((size_t)(rt_clusters * Q_CLUSTER));
+	memset(buf, 0, Q_CLUSTER);
+	for (i = 0; i < rb_count; i++) {
+		uint64_t j;
+		memset(buf, 0, Q_CLUSTER);
+		for (j = 0; j < Q_REFS_PER_BLOCK && (i * Q_REFS_PER_BLOCK) + j < used; j++)
+			buf[(j * 2) + 1] = 1;
+		vo_write(vo, buf, Q_CLUSTER, (next + i) * Q_CLUSTER);
+		put_be64(rb + (i * 8), (next + i) * Q_CLUSTER);
+	}
+	vo_write(vo, rb, (size_t)(rt_clusters * Q_CLUSTER), (next + rb_count) * Q_CLUSTER);
+
+	/* Header last, so an interrupted restore leaves no valid image */
+	memset(hdr, 0, sizeof(hdr));
+	put_be32(hdr, 0x514649fbU);
+	put_be32(hdr + 4, 3);
+	put_be32(hdr + 20, Q_CLUSTER_BITS);
+	put_be64(hdr + 24, vo->vsize);
+	put_be32(hdr + 36, (uint32_t)l1_size);
+	put_be64(hdr + 40, Q_CLUSTER);
+	put_be64(hdr + 48, (next + rb_count) * Q_CLUSTER);
+	put_be32(hdr + 56, (uint32_t)rt_clusters);
+	put_be32(hdr + 96, 4);		/* refcount_order: 16 bits */
+	put_be32(hdr + 100, sizeof(hdr));
+	vo_write(vo, hdr, sizeof(hdr), 0);
+	if (ftruncate(vo->fd, (off_t)(used * Q_CLUSTER)) != 0) {
+		fprintf(stderr, "Error: cannot size %s: %s\n", vo->outpath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(rb);
+	free(l2);
+	free(l1);
+	free(buf);
+}
+
+
+static void random_guid(unsigned char * const restrict g)
+{
+	FILE *f = fopen("/dev/urandom", "rb");
+	size_t i;
+
+	if (f == NULL || fread(g, 16, 1, f) != 1) {
+		srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+		for (i = 0; i < 16; i++) g[i] = (unsigned char)rand();
+	}
+	if (f != NULL) fclose(f);
+	g[7] = (unsigned char)((g[7] & 0x0f) | 0x40);	/* Version 4 */
+	g[8] = (unsigned char)((g[8] & 0x3f) | 0x80);
+}
+
+
+static void vhdx_checksum(unsigned char * const restrict p, const size_t len)
+{
+	memset(p + 4, 0, 4);
+	put_le32(p + 4, vdisk_crc32c(p, len));
+}
+
+
+/* Dynamic VHDX */
+static void write_vhdx(struct vdout * const restrict vo)
+{
+	const uint64_t blocks = (vo->vsize + X_BLOCK - 1) / X_BLOCK;
+	const uint64_t bat_entries = blocks + ((blocks - 1) / X_CHUNK_RATIO) + 1;
+	const uint64_t bat_len = (((bat_entries * 8) + X_MB - 1) / X_MB) * X_MB;
+	unsigned char *buf = (unsigned char *)vo_alloc(X_BLOCK);
+	unsigned char *bat = (unsigned char *)vo_alloc((size_t)bat_len);
+	unsigned char *meta = (unsigned char *)vo_alloc(X_MB);
+	unsigned char *rt = (unsigned char *)vo_alloc(65536);
+	unsigned char hdr[4096], guid[16];
+	uint64_t next = X_BAT_OFF + bat_len, b;
+	unsigned int i;
+	struct {
+		const unsigned char *guid;
+		uint32_t len, flags;
+	} items[5];
+
+	for (b = 0; b < blocks; b++) {
+		if (!fill_unit(vo, buf, b * X_BLOCK, X_BLOCK)) {
+			vo_write(vo, buf, X_BLOCK, next);
+			/* State 6: fully present; file offset in MiB above bit 20 */
+			put_le64(bat + ((b + (b / X_CHUNK_RATIO)) * 8), next | 6);
+			next += X_BLOCK;
+			vo->allocated++;
+		}
+		vo->units++;
+	}
+	vo_write(vo, bat, (size_t)bat_len, X_BAT_OFF);
+
+	/* Metadata: table of 32-byte entries, items from 64 KiB on */
+	memcpy(meta, "metadata", 8);
+	items[0].guid = vhdx_guid_params;
+	items[0].len = 8;
+	items[0].flags = 4;
+	items[1].guid = vhdx_guid_vsize;
+	items[1].len = 8;
+	items[1].flags = 6;
+	items[2].guid = vhdx_guid_page83;
+	items[2].len = 16;
+	items[2].flags = 6;
+	items[3].guid = vhdx_guid_lsize;
+	items[3].len = 4;
+	items[3].flags = 6;
+	items[4].guid = vhdx_guid_psize;
+	items[4].len = 4;
+	items[4].flags = 6;
+	put_le16(meta + 10, 5);
+	for (i = 0; i < 5; i++) {
+		unsigned char * const e = meta + 32 + (i * 32);
+		memcpy(e, items[i].guid, 16);
+		put_le32(e + 16, 65536 + (i * 32));
+		put_le32(e + 20, items[i].len);
+		put_le32(e + 24, items[i].flags);
+	}
+	put_le32(meta + 65536, X_BLOCK);
+	put_le64(meta + 65536 + 32, vo->vsize);
+	random_guid(meta + 65536 + 64);
+	put_le32(meta + 65536 + 96, 512);
+	put_le32(meta + 65536 + 128, 4096);
+	vo_write(vo, meta, X_MB, X_META_OFF);
+
+	/* Region table, twice */
+	memcpy(rt, "regi", 4);
+	put_le32(rt + 8, 2);
+	memcpy(rt + 16, vhdx_guid_bat, 16);
+	put_le64(rt + 32, X_BAT_OFF);
+	put_le32(rt + 40, (uint32_t)bat_len);
+	put_le32(rt + 44, 1);
+	memcpy(rt + 48, vhdx_guid_meta, 16);
+	put_le64(rt + 64, X_META_OFF);
+	put_le32(rt + 72, X_MB);
+	put_le32(rt + 76, 1);
+	vhdx_checksum(rt, 65536);
+	vo_write(vo, rt, 65536, 3 * 65536);
+	vo_write(vo, rt, 65536, 4 * 65536);
+
+	/* Empty log */
+	memset(buf, 0, X_MB);
+	vo_write(vo, buf, X_MB, X_LOG_OFF);
+
+	/* Headers (sequence 1 and 2) and the file identifier last */
+	random_guid(guid);
+	for (i = 1; i <= 2; i++) {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, "head", 4);
+		put_le64(hdr + 8, i);
+		memcpy(hdr + 16, guid, 16);
+		memcpy(hdr + 32, guid, 16);
+		put_le16(hdr + 66, 1);
+		put_le32(hdr + 68, X_MB);
+		put_le64(hdr + 72, X_LOG_OFF);
+		vhdx_checksum(hdr, sizeof(hdr));
+		vo_write(vo, hdr, sizeof(hdr), (uint64_t)i * 65536);
+	}
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "vhdxfile", 8);
+	for (i = 0; i < 9; i++) hdr[8 + (i * 2)] = (unsigned char)"imagepile"[i];
+	vo_write(vo, hdr, sizeof(hdr), 0);
+	if (ftruncate(vo->fd, (off_t)next) != 0) {
+		fprintf(stderr, "Error: cannot size %s: %s\n", vo->outpath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(rt);
+	free(meta);
+	free(bat);
+	free(buf);
+}
+
+
+/* read --qcow2 image_file output_file
+ * read --vhdx image_file output_file */
+extern void vdout_write(const struct files_t * const restrict files,
+		const char * const restrict format, const char * const restrict image,
+		const char * const restrict outpath)
+{
+	struct vdout vo;
+
+	memset(&vo, 0, sizeof(vo));
+	vo.files = files;
+	vo.outpath = outpath;
+	if (ipil_open(image, &vo.ip) != 0) {
+		fprintf(stderr, "Error: cannot open image %s\n", image);
+		exit(EXIT_FAILURE);
+	}
+	vo.size = ipil_image_size(&vo.ip);
+	vo.vsize = (vo.size + 511) & ~(uint64_t)511;
+	if (vo.vsize == 0) {
+		fprintf(stderr, "Error: image %s is empty\n", image);
+		exit(EXIT_FAILURE);
+	}
+	if (vo.vsize != vo.size)
+		fprintf(stderr, "Warning: image size %" PRIu64 " padded to %" PRIu64 " (whole sectors)\n",
+				vo.size, vo.vsize);
+	vo.fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (vo.fd < 0) {
+		fprintf(stderr, "Error: cannot open outfile: %s\n", outpath);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!strcmp(format, "qcow2")) write_qcow2(&vo);
+	else write_vhdx(&vo);
+
+	if (fsync(vo.fd) != 0 || close(vo.fd) != 0) {
+		fprintf(stderr, "Error writing %s\n", outpath);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "%s: %" PRIu64 " of %" PRIu64 " %s allocated, %" PRIu64 " zero block reads skipped\n",
+			format, vo.allocated, vo.units, !strcmp(format, "qcow2") ? "clusters" : "blocks",
+			vo.skipped_reads);
+	ipil_close(&vo.ip);
+}
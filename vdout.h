@@ -0,0 +1,21 @@
+/* Virtual disk container output headers
+ * See imagepile.c for copyright information */
+
+#ifndef VDOUT_H
+#define VDOUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern void vdout_write(const struct files_t * const restrict files,
+		const char * const restrict format, const char * const restrict image,
+		const char * const restrict outpath);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* VDOUT_H */
@@ -0,0 +1,360 @@
+/*
+ * Compressed restore output
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See LICENSE for licensing information
+ *
+ * Restores an image as a zstd or gzip stream made of independent frames,
+ * compressed by a pool of worker threads while the main thread keeps
+ * reading image data ahead of them and writes finished frames in order.
+ * The result is an ordinary .zst or .gz file. gzip frames are written as
+ * BGZF members that record their own size, so "add" can decode either
+ * format in parallel later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+ #include <zstd.h>
+#endif
+#include "imagepile.h"
+#include "ipil.h"
+#include "range.h"
+#include "zout.h"
+
+#define ZOUT_GZIP 1
+#define ZOUT_ZSTD 2
+
+#define JOB_FREE  0
+#define JOB_READY 1
+#define JOB_BUSY  2
+#define JOB_DONE  3
+
+/* Image data compressed as one frame */
+#define ZOUT_FRAME (4 * 1024 * 1024)
+
+/* Image data per BGZF member; the largest member must fit in 64 KiB */
+#define BGZF_DATA 0xff00
+#define BGZF_HDR 18
+#define BGZF_TRAILER 8
+
+/* Frames in flight per worker thread */
+#define ZOUT_JOBS_PER_THREAD 2
+
+#define ZOUT_MAX_THREADS 64
+#define ZOUT_MAX_JOBS (ZOUT_MAX_THREADS * ZOUT_JOBS_PER_THREAD)
+
+struct zout_job {
+	unsigned char *in, *out;
+	size_t in_len, out_len, out_alloc;
+	int state;
+};
+
+static struct {
+	int format, level;
+	unsigned int threads, njobs, head, tail;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct zout_job jobs[ZOUT_MAX_JOBS];
+} zs;
+
+static const char * const zout_names[] = { "raw", "gzip", "zstd" };
+
+
+static void zout_oom(void)
+{
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+
+#if defined HAVE_ZLIB || defined HAVE_ZSTD
+static void zout_fail(const char * const restrict what)
+{
+	fprintf(stderr, "Error: %s compression failed: %s\n", zout_names[zs.format], what);
+	exit(EXIT_FAILURE);
+}
+#endif
+
+
+#ifdef HAVE_ZLIB
+static void put_le32(unsigned char * const restrict p, const uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+
+/* Compress a frame as a run of BGZF members: gzip members of at most
+ * 64 KiB whose BC extra field holds the member size minus one */
+static void job_gzip(struct zout_job * const restrict job)
+{
+	static const unsigned char hdr[BGZF_HDR - 2] = {
+		0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0 };
+	z_stream strm;
+	size_t done = 0;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, zs.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		zout_fail("deflateInit2");
+	job->out_len = 0;
+	do {
+		unsigned char * const out = job->out + job->out_len;
+		size_t len = job->in_len - done, size;
+
+		if (len > BGZF_DATA) len = BGZF_DATA;
+		strm.next_in = job->in + done;
+		strm.avail_in = (uInt)len;
+		strm.next_out = out + BGZF_HDR;
+		strm.avail_out = (uInt)(job->out_alloc - job->out_len - BGZF_HDR - BGZF_TRAILER);
+		if (deflate(&strm, Z_FINISH) != Z_STREAM_END) zout_fail("deflate");
+		size = BGZF_HDR + strm.total_out + BGZF_TRAILER;
+		if (size > 0x10000) zout_fail("BGZF member too large");
+		memcpy(out, hdr, sizeof(hdr));
+		out[16] = (unsigned char)(size - 1);
+		out[17] = (unsigned char)((size - 1) >> 8);
+		put_le32(out + size - 8, (uint32_t)crc32(0, job->in + done, (uInt)len));
+		put_le32(out + size - 4, (uint32_t)len);
+		job->out_len += size;
+		done += len;
+		deflateReset(&strm);
+	} while (done < job->in_len);
+	deflateEnd(&strm);
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static void job_zstd(struct zout_job * const restrict job, ZSTD_CCtx * const restrict cctx)
+{
+	const size_t r = ZSTD_compress2(cctx, job->out, job->out_alloc, job->in, job->in_len);
+	if (ZSTD_isError(r)) zout_fail(ZSTD_getErrorName(r));
+	job->out_len = r;
+}
+#endif
+
+
+static void *zout_worker(void *arg)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx = NULL;
+#endif
+
+	(void)arg;
+#ifdef HAVE_ZSTD
+	if (zs.format == ZOUT_ZSTD) {
+		if ((cctx = ZSTD_createCCtx()) == NULL) zout_oom();
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zs.level);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	}
+#endif
+
+	pthread_mutex_lock(&zs.lock);
+	while (1) {
+		struct zout_job *job = NULL;
+		unsigned int i;
+
+		for (i = zs.head; i != zs.tail; i++) {
+			if (zs.jobs[i % zs.njobs].state == JOB_READY) {
+				job = &zs.jobs[i % zs.njobs];
+				break;
+			}
+		}
+		if (job == NULL) {
+			if (zs.stop) break;
+			pthread_cond_wait(&zs.cond, &zs.lock);
+			continue;
+		}
+		job->state = JOB_BUSY;
+		pthread_mutex_unlock(&zs.lock);
+
+#ifdef HAVE_ZLIB
+		if (zs.format == ZOUT_GZIP) job_gzip(job);
+#endif
+#ifdef HAVE_ZSTD
+		if (zs.format == ZOUT_ZSTD) job_zstd(job, cctx);
+#endif
+
+		pthread_mutex_lock(&zs.lock);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&zs.cond);
+	}
+	pthread_mutex_unlock(&zs.lock);
+
+#ifdef HAVE_ZSTD
+	if (cctx != NULL) ZSTD_freeCCtx(cctx);
+#endif
+	return NULL;
+}
+
+
+static int write_full(const int fd, const unsigned char * const restrict buf, const size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t w = write(fd, buf + done, len - done);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		done += (size_t)w;
+	}
+	return 0;
+}
+
+
+/* read --zstd|--gzip [-T threads] [-L level] image_file output_file */
+extern int zout_read(const struct files_t * const restrict files, int argc, char **argv)
+{
+	pthread_t workers[ZOUT_MAX_THREADS];
+	struct ipil_t ip;
+	uint64_t size, pos = 0, written = 0, frames = 0;
+	size_t bound = 0;
+	unsigned int t;
+	long threads = 0, level = -1;
+	const char *outpath;
+	int fd, i;
+
+	memset(&zs, 0, sizeof(zs));
+	if (!strcmp(argv[0], "--zstd")) zs.format = ZOUT_ZSTD;
+	else if (!strcmp(argv[0], "--gzip")) zs.format = ZOUT_GZIP;
+	else return 1;
+	for (i = 1; i + 2 < argc; i += 2) {
+		char *end;
+		long v;
+
+		errno = 0;
+		v = strtol(argv[i + 1], &end, 10);
+		if (errno || *end != '\0' || end == argv[i + 1]) return 1;
+		if (!strcmp(argv[i], "-T")) threads = v;
+		else if (!strcmp(argv[i], "-L")) level = v;
+		else return 1;
+	}
+	if (argc - i != 2) return 1;
+	outpath = argv[i + 1];
+
+	if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	if (threads > ZOUT_MAX_THREADS) threads = ZOUT_MAX_THREADS;
+	zs.threads = (unsigned int)threads;
+
+	if (zs.format == ZOUT_ZSTD) {
+#ifdef HAVE_ZSTD
+		if (level < 0) level = 3;
+		if (level < 1 || level > ZSTD_maxCLevel()) return 1;
+		bound = ZSTD_compressBound(ZOUT_FRAME);
+#else
+		fprintf(stderr, "Error: zstd output needs a build with USE_ZSTD=1\n");
+		exit(EXIT_FAILURE);
+#endif
+	} else {
+#ifdef HAVE_ZLIB
+		if (level < 0) level = 6;
+		if (level > 9) return 1;
+		bound = ((ZOUT_FRAME + BGZF_DATA - 1) / BGZF_DATA)
+				* ((size_t)compressBound(BGZF_DATA) + BGZF_HDR + BGZF_TRAILER);
+#else
+		fprintf(stderr, "Error: gzip output needs a build with zlib\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+	zs.level = (int)level;
+
+	if (ipil_open(argv[i], &ip) != 0) exit(EXIT_FAILURE);
+	size = ipil_image_size(&ip);
+	if (!strcmp(outpath, "-")) fd = STDOUT_FILENO;
+	else if ((fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "Error: cannot open outfile: %s\n", outpath);
+		exit(EXIT_FAILURE);
+	}
+
+	zs.njobs = zs.threads * ZOUT_JOBS_PER_THREAD;
+	for (t = 0; t < zs.njobs; t++) {
+		zs.jobs[t].in = (unsigned char *)malloc(ZOUT_FRAME);
+		zs.jobs[t].out = (unsigned char *)malloc(bound);
+		if (zs.jobs[t].in == NULL || zs.jobs[t].out == NULL) zout_oom();
+		zs.jobs[t].out_alloc = bound;
+	}
+	pthread_mutex_init(&zs.lock, NULL);
+	pthread_cond_init(&zs.cond, NULL);
+	for (t = 0; t < zs.threads; t++)
+		if (pthread_create(&workers[t], NULL, zout_worker, NULL) != 0) {
+			fprintf(stderr, "Error: cannot create compression thread\n");
+			exit(EXIT_FAILURE);
+		}
+
+	/* Advise the first window of frames; each fill advises one more */
+	image_prefetch_range(files, &ip, 0, (uint64_t)ZOUT_FRAME * zs.njobs);
+	pthread_mutex_lock(&zs.lock);
+	while (1) {
+		struct zout_job *job;
+
+		/* Keep every free slot filled with image data; an empty image
+		 * still gets one empty frame so the output is a valid file */
+		while ((pos < size || zs.tail == 0) && zs.jobs[zs.tail % zs.njobs].state == JOB_FREE) {
+			ssize_t got = 0;
+
+			job = &zs.jobs[zs.tail % zs.njobs];
+			pthread_mutex_unlock(&zs.lock);
+			if (pos < size) {
+				image_prefetch_range(files, &ip, pos + ((uint64_t)ZOUT_FRAME * zs.njobs), ZOUT_FRAME);
+				got = image_read_range(files, &ip, job->in, pos, ZOUT_FRAME);
+				if (got <= 0) {
+					fprintf(stderr, "Error reading %s\n", files->dbfile);
+					exit(EXIT_FAILURE);
+				}
+			}
+			job->in_len = (size_t)got;
+			pos += (uint64_t)got;
+			pthread_mutex_lock(&zs.lock);
+			job->state = JOB_READY;
+			zs.tail++;
+			pthread_cond_broadcast(&zs.cond);
+		}
+		if (zs.head == zs.tail) break;
+
+		/* Write finished frames in order */
+		job = &zs.jobs[zs.head % zs.njobs];
+		while (job->state != JOB_DONE) pthread_cond_wait(&zs.cond, &zs.lock);
+		pthread_mutex_unlock(&zs.lock);
+		if (write_full(fd, job->out, job->out_len) != 0) {
+			fprintf(stderr, "Error: cannot write %s: %s\n", outpath, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		written += job->out_len;
+		frames++;
+		pthread_mutex_lock(&zs.lock);
+		job->state = JOB_FREE;
+		zs.head++;
+	}
+	zs.stop = 1;
+	pthread_cond_broadcast(&zs.cond);
+	pthread_mutex_unlock(&zs.lock);
+	for (t = 0; t < zs.threads; t++) pthread_join(workers[t], NULL);
+	for (t = 0; t < zs.njobs; t++) {
+		free(zs.jobs[t].in);
+		free(zs.jobs[t].out);
+	}
+
+	if (fd != STDOUT_FILENO && ((fsync(fd) != 0 && errno != EINVAL) || close(fd) != 0)) {
+		fprintf(stderr, "Error writing %s\n", outpath);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "%s: %" PRIu64 " bytes to %" PRIu64 " in %" PRIu64 " frames (%u threads, level %d)\n",
+			zout_names[zs.format], size, written, frames, zs.threads, zs.level);
+	ipil_close(&ip);
+	return 0;
+}
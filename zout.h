@@ -0,0 +1,19 @@
+/* Compressed restore output headers
+ * See imagepile.c for copyright information */
+
+#ifndef ZOUT_H
+#define ZOUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "imagepile.h"
+
+extern int zout_read(const struct files_t * const restrict files, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* ZOUT_H */